@@ -28,13 +28,7 @@ static const __constant float M2[3][3] = {
     0.0259040371f,  0.7827717662f, -0.8086757660f
 };
 
-__kernel void rgb_to_ok(__global const int *In, __global float *Out) {
-
-    // Get the index of the current element to be processed
-    __private int i = get_global_id(0);
-
-    //read the pixel
-    __private int4 rgb = vload4(i, In);
+float4 rgb_to_ok_pixel(int4 rgb) {
 
     //convert to okLab
 
@@ -54,7 +48,81 @@ __kernel void rgb_to_ok(__global const int *In, __global float *Out) {
         rgb[3]
     };
 
-    vstore4(ok, i, Out);
+    return ok;
+
+}
+
+__kernel void rgb_to_ok(__global const int *In, __global float *Out) {
+
+    // Get the index of the current element to be processed
+    __private int i = get_global_id(0);
+
+    //read the pixel
+    __private int4 rgb = vload4(i, In);
+
+    vstore4(rgb_to_ok_pixel(rgb), i, Out);
+
+}
+
+//compact image storage: half precision keeps ~3 significant digits, plenty for the L range ( 0 - 6.34 ) and for the alpha threshold
+__kernel void rgb_to_ok_half(__global const int *In, __global half *Out) {
+
+    // Get the index of the current element to be processed
+    __private int i = get_global_id(0);
+
+    //read the pixel
+    __private int4 rgb = vload4(i, In);
+
+    vstore_half4(rgb_to_ok_pixel(rgb), i, Out);
+
+}
+
+
+//box filter over factor x factor pixels, the blocks on the right and bottom borders are clipped to the image
+__kernel void downsample(__global const float *In, __global float *Out, const uint width, const uint height, const uint factor,
+                         const uint band_first) {
+
+    // Get the index of the current element to be processed, counted from the first output row of the band
+    __private ulong i = get_global_id(0);
+
+    __private uint out_width = (width + factor - 1) / factor;
+    //In only holds the input rows of the band
+    __private uint band_y = band_first * factor;
+    __private uint x0 = (i % out_width) * factor;
+    __private uint y0 = band_y + (i / out_width) * factor;
+    __private uint x1 = min(x0 + factor, width);
+    __private uint y1 = min(y0 + factor, height);
+
+    __private float4 sum = 0;
+
+    for (__private uint y = y0; y < y1; y++)
+        for (__private uint x = x0; x < x1; x++)
+            sum += vload4(((ulong)(y - band_y) * width) + x, In);
+
+    vstore4(sum / (float)((x1 - x0) * (y1 - y0)), i, Out);
 
 }
 
+__kernel void downsample_half(__global const half *In, __global half *Out, const uint width, const uint height, const uint factor,
+                              const uint band_first) {
+
+    // Get the index of the current element to be processed, counted from the first output row of the band
+    __private ulong i = get_global_id(0);
+
+    __private uint out_width = (width + factor - 1) / factor;
+    //In only holds the input rows of the band
+    __private uint band_y = band_first * factor;
+    __private uint x0 = (i % out_width) * factor;
+    __private uint y0 = band_y + (i / out_width) * factor;
+    __private uint x1 = min(x0 + factor, width);
+    __private uint y1 = min(y0 + factor, height);
+
+    __private float4 sum = 0;
+
+    for (__private uint y = y0; y < y1; y++)
+        for (__private uint x = x0; x < x1; x++)
+            sum += vload_half4(((ulong)(y - band_y) * width) + x, In);
+
+    vstore_half4(sum / (float)((x1 - x0) * (y1 - y0)), i, Out);
+
+}
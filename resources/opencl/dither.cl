@@ -23,6 +23,83 @@ __constant char delta_states[3] = { -1, 0 , 1 };
 
 #define STATE_TO_DELTA(x) ( (x >= 0 && x < 3) ? delta_states[x] : 0 )
 
+//specialized builds: the host compiles a variant of this program for each combination with
+//-DDITHER_SPECIALIZED -DPALETTE_ENTRIES=n -DHEIGHT_MODE=m -DMETRIC_VARIANT=k and, for the error diffusion,
+//-DBLEEDING_COUNT=n -DBLEEDING_MATRIX=(int4)(dx,dy,num,den),...
+//the kernels keep the same arguments, the baked values just replace them.
+//-DHALF_LAB ( set on every build when the image is stored compact ) reads the OK-L*ab image as half4 instead of float4
+#define HEIGHT_FLAT      0
+#define HEIGHT_UNLIMITED 1
+#define HEIGHT_LIMITED   2
+
+#ifdef DITHER_SPECIALIZED
+#define PALETTE_SIZE PALETTE_ENTRIES
+#define DITHER_METRIC METRIC_VARIANT
+#define UNROLL _Pragma("unroll")
+#if HEIGHT_MODE == HEIGHT_FLAT
+#define MC_LIMIT 0
+#elif HEIGHT_MODE == HEIGHT_UNLIMITED
+#define MC_LIMIT -1
+#else
+#define MC_LIMIT max_mc_height
+#endif
+#else
+#define PALETTE_SIZE entry_count
+#define DITHER_METRIC metric
+#define UNROLL
+#define MC_LIMIT max_mc_height
+#endif
+
+#ifdef HALF_LAB
+#define LAB_T half
+#define LOAD_LAB(i, p) vload_half4(i, p)
+#else
+#define LAB_T float
+#define LOAD_LAB(i, p) vload4(i, p)
+#endif
+
+#if defined(BLEEDING_COUNT) && BLEEDING_COUNT > 0
+__constant int4 bleeding_matrix[BLEEDING_COUNT] = { BLEEDING_MATRIX };
+#define BLEED_COUNT BLEEDING_COUNT
+#define BLEED_PARAM(j) bleeding_matrix[j]
+#elif defined(BLEEDING_COUNT)
+#define BLEED_COUNT 0
+#define BLEED_PARAM(j) ((int4)(0))
+#else
+#define BLEED_COUNT bleeding_size
+#define BLEED_PARAM(j) vload4(j, bleeding_params)
+#endif
+
+//the palette search runs on a compact copy of the palette: only the usable ( id, state ) pairs, in search order.
+//palette_lab holds entry_count L values, then the a values, then the b values, palette_entries packs the rest
+#define ENTRY_ID(e)     ((e) & 0xFF)
+#define ENTRY_STATE(e)  (((e) >> 8) & 0x3)
+#define ENTRY_LIQUID(e) (((e) >> 10) & 0x1)
+
+//diagnostics of the staircase, summed per work group and read back by the host ( must match gpu.c )
+#define DIAG_RESTRICTED    0 // retries because the staircase got too high
+#define DIAG_TRANSPARENT   1 // visible pixels left transparent, no palette entry was allowed
+#define DIAG_DROPS         2 // random height drops
+#define DIAG_RETRIES       3 // pixels by number of retries: 0, 1, 2, 3 or more
+#define DIAG_RETRY_BINS    4
+#define DIAG_COUNTERS      (DIAG_RETRIES + DIAG_RETRY_BINS)
+#define DIAG_SAMPLE_COUNT  DIAG_COUNTERS // then x,y of the first DIAG_SAMPLES transparent defaults
+#define DIAG_SAMPLES       16
+
+//adds the counters of the whole work group to the global ones, every item of the group must call it
+inline void diag_flush_group(__private uint *counters, __local uint *group, __global uint *diagnostics){
+    for (__private uint c = get_local_id(0); c < DIAG_COUNTERS; c += get_local_size(0))
+        group[c] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (__private uchar c = 0; c < DIAG_COUNTERS; c++)
+        if (counters[c] != 0)
+            atomic_add(&group[c], counters[c]);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (__private uint c = get_local_id(0); c < DIAG_COUNTERS; c += get_local_size(0))
+        if (group[c] != 0)
+            atomic_add(&diagnostics[c], group[c]);
+}
+
 float alpha(float4 op){
     return op[3] / 255;
 }
@@ -36,63 +113,269 @@ float deltaE(float4 op_1, float4 op_2){
     return sqrt(deltaEsqr(op_1, op_2));
 }
 
-//kernel
+//selectable distance used to match the palette
+#define METRIC_EUCLID    0
+#define METRIC_OKLCH     1
+#define METRIC_CIEDE2000 2
+
+//the OK-L*ab values are computed from 0-255 channels, rescale them so L is 0-100 as the CIE terms expect
+#define METRIC_SCALE (100.f / 6.3413026f)
+
+//palette side terms, for each entry: L a b C then a' C' h' for each quantized CIEDE2000 G factor ( must match gpu.c )
+#define METRIC_G_LEVELS 16
+#define METRIC_G_MAX 0.5f
+#define METRIC_STRIDE (4 + METRIC_G_LEVELS * 3)
+
+//the euclid builds keep none of the pixel side terms in private memory
+#if defined(DITHER_SPECIALIZED) && METRIC_VARIANT == METRIC_EUCLID
+#define PIXEL_G_LEVELS 1
+#else
+#define PIXEL_G_LEVELS METRIC_G_LEVELS
+#endif
+
+//image side lookup tables, indexed by the quantized mean chroma, lightness or hue of a pair ( must match gpu.c )
+#define METRIC_LUT_BINS 256
+#define METRIC_CHROMA_MAX 64.f
+#define LUT_G      0
+#define LUT_RC     1
+#define LUT_SL     2
+#define LUT_T      3
+#define LUT_RT_HUE 4
+#define LUT_SC     5
+#define LUT_SH     6
+
+#define POW_25_7 6103515625.f
+
+float metric_lut(__global const float *luts, uint lut, float value, float range){
+    __private float bin = clamp(value / range, 0.f, 1.f) * (METRIC_LUT_BINS - 1);
+    return luts[(lut * METRIC_LUT_BINS) + (uint)(bin + 0.5f)];
+}
 
-__kernel void error_bleed(
-                    __global float         *src,      
-                    __global uchar         *dst,
-                    __global int           *err_buf,
-                    __global float         *Palette,
-                    __global uchar         *valid_palette_ids,
-                    __global uchar         *liquid_palette_ids,
-                    __global float         *noise,
-                    __global int           *mc_height,
-                    __global uint          *coord_list,
-                    const uint              width,
-                    const uint              height,
-                    const uchar             palette_indexes,
-                    __global int           *bleeding_params,
-                    const uchar             bleeding_size,
-                    const uchar             min_progress,
-                    const int               max_mc_height)
+float hue_degrees(float a, float b){
+    if (a == 0 && b == 0)
+        return 0;
+    __private float h = degrees(atan2(b, a));
+    return (h < 0) ? h + 360.f : h;
+}
+
+//one work item per bin
+__kernel void prepare_metric_luts(__global float *luts)
 {
+    __private uint i = get_global_id(0);
+    __private float t = (float)i / (METRIC_LUT_BINS - 1);
+    __private float c = t * METRIC_CHROMA_MAX;
+    __private float l = t * 100.f;
+    __private float h = t * 360.f;
+    __private float c7 = pow(c, 7.f);
+    __private float c7_ratio = sqrt(c7 / (c7 + POW_25_7));
+
+    luts[(LUT_G * METRIC_LUT_BINS) + i]      = 0.5f * (1 - c7_ratio);
+    luts[(LUT_RC * METRIC_LUT_BINS) + i]     = 2 * c7_ratio;
+    luts[(LUT_SL * METRIC_LUT_BINS) + i]     = 1 / (1 + (0.015f * SQR(l - 50) / sqrt(20 + SQR(l - 50))));
+    luts[(LUT_T * METRIC_LUT_BINS) + i]      = 1 - 0.17f * cos(radians(h - 30)) + 0.24f * cos(radians(2 * h))
+                                                 + 0.32f * cos(radians(3 * h + 6)) - 0.20f * cos(radians(4 * h - 63));
+    luts[(LUT_RT_HUE * METRIC_LUT_BINS) + i] = -sin(radians(60 * exp(-SQR((h - 275) / 25))));
+    luts[(LUT_SC * METRIC_LUT_BINS) + i]     = 1 / SQR(1 + 0.045f * c);
+    luts[(LUT_SH * METRIC_LUT_BINS) + i]     = 1 / SQR(1 + 0.015f * c);
+}
 
-    __private uint index = get_global_id(0);
+//one work item per palette entry ( id and state )
+__kernel void prepare_metric_palette(__global float *Palette, __global float *metric_palette)
+{
+    __private uint i = get_global_id(0);
+    __private float4 color = vload4(i, Palette) * METRIC_SCALE;
+    __global float *entry = metric_palette + ((ulong)i * METRIC_STRIDE);
+
+    entry[0] = color[0];
+    entry[1] = color[1];
+    entry[2] = color[2];
+    entry[3] = hypot(color[1], color[2]);
+
+    for (__private uint k = 0; k < METRIC_G_LEVELS; k++){
+        __private float g = METRIC_G_MAX * k / (METRIC_G_LEVELS - 1);
+        __private float a = color[1] * (1 + g);
+        entry[4 + (k * 3) + 0] = a;
+        entry[4 + (k * 3) + 1] = hypot(a, color[2]);
+        entry[4 + (k * 3) + 2] = hue_degrees(a, color[2]);
+    }
+}
 
-    //printf("Index was %d \n", index);
+//squared distance between the pixel and a palette entry, the pixel side CIEDE2000 terms are computed once per G level
+float metric_distance(
+                    const uchar             metric,
+                    float4                  pixel,
+                    float4                  palette,
+                    __global const float   *entry,
+                    __global const float   *luts,
+                    float4                  scaled,
+                    float                   chroma,
+                    float3                 *levels,
+                    ushort                 *levels_ready)
+{
+    if (metric == METRIC_EUCLID)
+        return deltaEsqr(pixel, palette);
 
-    __private uint2 coords = vload2(index, coord_list);
+    __private float dL = entry[0] - scaled[0];
 
-    //printf("Coords are %d %d\n", coords[0], coords[1]);
+    if (metric == METRIC_OKLCH){
+        __private float mean_c = (entry[3] + chroma) / 2;
+        __private float dC = entry[3] - chroma;
+        __private float dH2 = max(SQR(entry[1] - scaled[1]) + SQR(entry[2] - scaled[2]) - SQR(dC), 0.f);
+        return SQR(dL) + (SQR(dC) * metric_lut(luts, LUT_SC, mean_c, METRIC_CHROMA_MAX))
+                       + (dH2 * metric_lut(luts, LUT_SH, mean_c, METRIC_CHROMA_MAX));
+    }
 
-    __private int curr_mc_height = mc_height[coords[0]];
+    __private float g = metric_lut(luts, LUT_G, (entry[3] + chroma) / 2, METRIC_CHROMA_MAX);
+    __private uint k = min((uint)((g / METRIC_G_MAX) * (METRIC_G_LEVELS - 1) + 0.5f), (uint)(METRIC_G_LEVELS - 1));
+    if (!(*levels_ready & (1 << k))){
+        __private float a = scaled[1] * (1 + (METRIC_G_MAX * k / (METRIC_G_LEVELS - 1)));
+        levels[k] = (float3)(a, hypot(a, scaled[2]), hue_degrees(a, scaled[2]));
+        *levels_ready |= (1 << k);
+    }
+    __private float3 px = levels[k];
+    __global const float *pe = entry + 4 + (k * 3);
+
+    __private float dC = pe[1] - px.y;
+    //|dH'| from the a' b differences, its sign from the rotation between the two hues
+    __private float dH2 = max(SQR(pe[0] - px.x) + SQR(entry[2] - scaled[2]) - SQR(dC), 0.f);
+    __private float dH = ((px.x * entry[2]) - (scaled[2] * pe[0]) < 0) ? -sqrt(dH2) : sqrt(dH2);
+
+    __private float mean_h = px.z + pe[2];
+    if (px.y != 0 && pe[1] != 0){
+        if (fabs(px.z - pe[2]) <= 180)
+            mean_h /= 2;
+        else
+            mean_h = (mean_h < 360) ? (mean_h + 360) / 2 : (mean_h - 360) / 2;
+    }
+    __private float mean_cp = (px.y + pe[1]) / 2;
 
-    __private ulong i = (width * coords[1]) + coords[0];
+    __private float tl = dL * metric_lut(luts, LUT_SL, (entry[0] + scaled[0]) / 2, 100.f);
+    __private float tc = dC / (1 + 0.045f * mean_cp);
+    __private float th = dH / (1 + 0.015f * mean_cp * metric_lut(luts, LUT_T, mean_h, 360.f));
+    __private float rt = metric_lut(luts, LUT_RT_HUE, mean_h, 360.f) * metric_lut(luts, LUT_RC, mean_cp, METRIC_CHROMA_MAX);
 
-    __private float4 og_pixel = vload4(i, src);
+    return SQR(tl) + SQR(tc) + SQR(th) + (rt * tc * th);
+}
 
-    //printf("Pixel %d %d is [%f, %f, %f, %f]\n", coords[0] , coords[1], og_pixel[0], og_pixel[1], og_pixel[2], og_pixel[3]);
-    __private int4   int_error = vload4(i, err_buf);
-    __private float4 error     = {int_error[0],int_error[1],int_error[2],int_error[3]};
-                     error    /= 1000.f;
+//integer hash ( lowbias32 ), gives the same bits on every device
+uint hash(uint x){
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
 
-    //printf("Error at %d %d is [%f, %f, %f, %f]\n", coords[0] , coords[1], error[0], error[1], error[2], error[3]);
+//counter based random value in [0,1) for a pixel, only depends on the seed and the coordinates
+float pixel_noise(uint seed, uint x, uint y){
+    __private uint h = hash(seed ^ hash(x ^ hash(y)));
+    //keep the 24 bits a float can represent exactly
+    return (float)(h >> 8) / 16777216.f;
+}
 
-    __private float4 pixel = og_pixel + error;
+//nearest palette color whose state is not blacklisted, returns the quantization error.
+//min_index stays 0 ( transparent ) if nothing is allowed
+float4 find_palette_color(
+                    float4                  pixel,
+                    __constant float       *palette_lab,
+                    __constant uint        *palette_entries,
+                    const uint              entry_count,
+                    uchar                  *blacklisted_states,
+                    uchar                  *blacklisted_liquid_states,
+                    __global const float   *metric_palette,
+                    __global const float   *metric_luts,
+                    const uchar             metric,
+                    float4                  scaled,
+                    float                   chroma,
+                    float3                 *levels,
+                    ushort                 *levels_ready,
+                    uchar                  *min_index,
+                    uchar                  *min_state)
+{
+    __private float4 min_d = 0;
+    __private float  min_d2_sum = FLT_MAX;
+
+    __private float4 tmp_d = 0;
+    __private float  tmp_d2_sum = FLT_MAX;
+
+    *min_index = 0;
+    *min_state = 0;
+
+    for(__private uint e = 0; e < entry_count; e++){
+        __private uint  entry = palette_entries[e];
+        __private uchar s     = ENTRY_STATE(entry);
+        if ( ( ENTRY_LIQUID(entry) && blacklisted_liquid_states[s]) || ( !ENTRY_LIQUID(entry) && blacklisted_states[s]) ){
+            continue;
+        }
+        __private int palette_index = ENTRY_ID(entry) * 3 + s;
+        __private float4 palette = (float4)(palette_lab[e], palette_lab[entry_count + e], palette_lab[(2 * entry_count) + e], pixel[3]);
+
+        tmp_d = pixel - palette;
+
+        //the metric buffers are not bound for the plain distance
+        if (metric == METRIC_EUCLID)
+            tmp_d2_sum = deltaEsqr(pixel, palette);
+        else
+            tmp_d2_sum = metric_distance(metric, pixel, palette, metric_palette + (palette_index * METRIC_STRIDE),
+                                         metric_luts, scaled, chroma, levels, levels_ready);
+
+        if (FLT_LT(tmp_d2_sum, min_d2_sum)){
+            min_d2_sum = tmp_d2_sum;
+            *min_index = ENTRY_ID(entry);
+            *min_state = s;
+            min_d = tmp_d;
+        }
+    }
+    return min_d;
+}
+
+//pick the palette color for a pixel ( error already applied ) respecting the height limits,
+//stores the result and the new column height and returns the quantization error
+float4 quantize_pixel(
+                    float4                  pixel,
+                    uint2                   coords,
+                    __global uchar         *dst,
+                    __constant float       *palette_lab,
+                    __constant uint        *palette_entries,
+                    __global uchar         *liquid_palette_ids,
+                    const uint              seed,
+                    __global int           *mc_height,
+                    const uint              width,
+                    const uint              height,
+                    const uint              entry_count,
+                    const int               max_mc_height,
+                    __global const float   *metric_palette,
+                    __global const float   *metric_luts,
+                    const uchar             metric,
+                    __private uint         *counters,
+                    __global uint          *diagnostics,
+                    const uint              band_row)
+{
+    __private int curr_mc_height = mc_height[coords[0]];
+
+    //dst only holds the rows from band_row on
+    __private ulong i = ((ulong)width * (coords[1] - band_row)) + coords[0];
 
     //restrict in Lab colorspace
     pixel = max(min(pixel,(float4)(100.0, 128.0, 128.0, 255.0)),(float4)(0.0,-128.0,-128.0, 0.0));
 
+    //pixel side terms of the perceptual metrics, shared by every palette entry
+    __private float4 scaled = 0;
+    __private float  chroma = 0;
+    __private float3 levels[PIXEL_G_LEVELS];
+    __private ushort levels_ready = 0;
+    if (metric != METRIC_EUCLID){
+        scaled = pixel * METRIC_SCALE;
+        chroma = hypot(scaled[1], scaled[2]);
+    }
+
     //printf("Pixel %d %d after error is [%f, %f, %f, %f]\n", coords[0] , coords[1], pixel[0], pixel[1], pixel[2], pixel[3]);
 
     __private float4 min_d = 0;
-    __private float  min_d2_sum = FLT_MAX;
     __private uchar  min_index = 0;
     __private uchar  min_state = 0;
 
-    __private float4 tmp_d = 0;
-    __private float  tmp_d2_sum = FLT_MAX;
-
     __private uchar  valid = 0;
 
     __private uchar  blacklisted_states[3] = {};
@@ -112,7 +395,7 @@ __kernel void error_bleed(
 
     //if there is a previous pixel
     if ( coords[1] > 0 ) {
-        __private uint p_i = (width * (coords[1] - 1)) + coords[0]; ;
+        __private ulong p_i = ((ulong)width * (coords[1] - 1 - band_row)) + coords[0];
         __private uchar2 prev = vload2(p_i, dst);
         //if the previous pixel was transparent
         if (prev[0] == 0){
@@ -128,12 +411,15 @@ __kernel void error_bleed(
     __private uint abs_mc_height = abs(curr_mc_height);
     
     //randomly reset the height to spread out the errors
-    __private float rand = noise[i];
+    //if the image is smaller or equal to the worse case staircase
+    //compute as if there was no limit ( no random height drops )
+    __private float rand = (max_mc_height >= (int)height) ? FLT_MAX : pixel_noise(seed, coords[0], coords[1]);
     //have the probability heavily tipped towards high y levels
     __private float f_x = (float)(abs_mc_height) / max_mc_height;
     __private float compare = -log(1 - f_x) / 3;
 
     if (max_mc_height > 0 && FLT_LT(rand, compare)){
+        counters[DIAG_DROPS]++;
         if (curr_mc_height < 0){
             blacklisted_states[0] = 1;
         }else{
@@ -145,43 +431,19 @@ __kernel void error_bleed(
         }
     }
     
+    __private uint retries = 0;
+
     //check if we're not going out of build limit
     while(!valid){
 
         min_d = 0;
-        min_d2_sum = FLT_MAX;
         min_index = 0;
         min_state = 0;
 
-        tmp_d = 0;
-        tmp_d2_sum = FLT_MAX;
-
         if ( FLT_GT(alpha(pixel) , 0.3f) ){
-            for(__private uchar p = 1; p < palette_indexes; p++){
-                if (valid_palette_ids[p])
-                    for (__private uchar s = 0; s < 3; s++){
-                        if ( ( liquid_palette_ids[p] && blacklisted_liquid_states[s]) || ( !liquid_palette_ids[p] && blacklisted_states[s]) ){
-                            continue;
-                        }
-                        __private int palette_index = p * 3 + s;
-                        __private float4 palette = vload4(palette_index, Palette);
-
-                        tmp_d = pixel - palette;
-
-                        tmp_d2_sum = deltaEsqr(pixel, palette);
-
-                        if (FLT_LT(tmp_d2_sum, min_d2_sum)){
-                            min_d2_sum = tmp_d2_sum;
-                            min_index = p;
-                            min_state = s;
-                            min_d = tmp_d;
-                        }
-
-                    }
-            }
-            if (min_index == 0){
-                printf("Pixel %d %d found nothing!\n", coords[0] , coords[1]);
-            }
+            min_d = find_palette_color(pixel, palette_lab, palette_entries, entry_count,
+                                       blacklisted_states, blacklisted_liquid_states, metric_palette, metric_luts, metric,
+                                       scaled, chroma, levels, &levels_ready, &min_index, &min_state);
         }
 
         __private char delta = STATE_TO_DELTA(min_state);
@@ -205,7 +467,8 @@ __kernel void error_bleed(
                     blacklisted_states[min_state] = 1;
                     if ( FLT_LT(rand, 0.5f) )
                         blacklisted_states[1] = 1;
-                    printf("Pixel %d %d reached %d: Restricted\n", coords[0] , coords[1], tmp_mc_height);
+                    counters[DIAG_RESTRICTED]++;
+                    retries++;
                 }
             }else{
                 valid = 1;
@@ -214,19 +477,112 @@ __kernel void error_bleed(
             valid = 1;
             tmp_mc_height = 0;
             if ( FLT_GT(alpha(pixel), 0.3f) ){
-                printf("Pixel %d %d defaulted to Transparent\n", coords[0] , coords[1]);
+                counters[DIAG_TRANSPARENT]++;
+                //keep a few of them for the report, once they are taken only the private counter is updated
+                if (diagnostics[DIAG_SAMPLE_COUNT] < DIAG_SAMPLES){
+                    __private uint sample = atomic_inc(&diagnostics[DIAG_SAMPLE_COUNT]);
+                    if (sample < DIAG_SAMPLES)
+                        vstore2(coords, sample, diagnostics + DIAG_SAMPLE_COUNT + 1);
+                }
             }
         }
     }
 
+    counters[DIAG_RETRIES + min(retries, (uint)(DIAG_RETRY_BINS - 1))]++;
+
     mc_height[coords[0]] = tmp_mc_height;
 
     //printf("Pixel %d %d Error is [%f,%f,%f,%f]\n", coords[0] , coords[1], min_d[0], min_d[1], min_d[2], min_d[3]);
     //printf("Result Pixel %d %d is %d %d\n", coords[0] , coords[1], (int)min_index ,(int)min_state);
     vstore2((uchar2){min_index, min_state}, i, dst);
 
-    for (__private uchar j = 0; j < bleeding_size; j++){
-        __private int4 param = vload4(j, bleeding_params);
+    return min_d;
+}
+
+//pixel k of a diagonal, the diagonals are numbered in the order the host launches them:
+//first the ones starting on the top row, then steepness of them for each following row on the right edge
+inline uint2 diagonal_coords(const uint diagonal, const uint k, const uint width, const uchar steepness){
+    if (steepness == 0)
+        return (uint2)(k, diagonal);
+
+    __private long2 start;
+    if (diagonal < width){
+        start = (long2)(diagonal, 0);
+    }else{
+        __private uint row_diagonal = diagonal - width;
+        start = (long2)((long)width - steepness + (row_diagonal % steepness), 1 + (row_diagonal / steepness));
+    }
+    return (uint2)(start[0] - (long)k * steepness, start[1] + k);
+}
+
+//kernel
+
+__kernel void error_bleed(
+                    __global LAB_T         *src,
+                    __global uchar         *dst,
+                    __global int           *err_buf,
+                    __constant float       *palette_lab,
+                    __constant uint        *palette_entries,
+                    __global uchar         *liquid_palette_ids,
+                    const uint              seed,
+                    __global int           *mc_height,
+                    const uint              width,
+                    const uint              height,
+                    const uint              entry_count,
+                    __global int           *bleeding_params,
+                    const uchar             bleeding_size,
+                    const uchar             min_progress,
+                    const int               max_mc_height,
+                    const uint              err_rows,
+                    __global float         *metric_palette,
+                    __global float         *metric_luts,
+                    const uchar             metric,
+                    __global uint          *diagnostics,
+                    const uint              band_first,
+                    const uint              band_row)
+{
+
+    //one launch per diagonal, dimension 1 is the diagonal and dimension 0 the pixel along it
+    __private uint index = get_global_id(0);
+
+    //printf("Index was %d \n", index);
+
+    //large images run in bands of rows, src and dst only hold the rows from band_row on
+    __private uint2 coords = diagonal_coords(get_global_id(1), index, width, min_progress) + (uint2)(0, band_first);
+
+    //printf("Coords are %d %d\n", coords[0], coords[1]);
+
+    __private ulong i = ((ulong)width * (coords[1] - band_row)) + coords[0];
+
+    __private float4 og_pixel = LOAD_LAB(i, src);
+
+    //the error buffer only holds err_rows rows, used as a ring
+    __private ulong err_i = ((ulong)width * (coords[1] % err_rows)) + coords[0];
+
+    //printf("Pixel %d %d is [%f, %f, %f, %f]\n", coords[0] , coords[1], og_pixel[0], og_pixel[1], og_pixel[2], og_pixel[3]);
+    __private int4   int_error = vload4(err_i, err_buf);
+    //free the slot for the pixel err_rows below this one
+    vstore4((int4)(0), err_i, err_buf);
+    __private float4 error     = {int_error[0],int_error[1],int_error[2],int_error[3]};
+                     error    /= 1000.f;
+
+    //printf("Error at %d %d is [%f, %f, %f, %f]\n", coords[0] , coords[1], error[0], error[1], error[2], error[3]);
+
+    __private float4 pixel = og_pixel + error;
+
+    __private uint counters[DIAG_COUNTERS] = {};
+    __local   uint group_counters[DIAG_COUNTERS];
+
+    __private float4 min_d = quantize_pixel(pixel, coords, dst, palette_lab, palette_entries, liquid_palette_ids, seed,
+                                            mc_height, width, height, PALETTE_SIZE, MC_LIMIT,
+                                            metric_palette, metric_luts, DITHER_METRIC, counters, diagnostics, band_row);
+
+    diag_flush_group(counters, group_counters, diagnostics);
+
+
+    UNROLL
+    for (__private uchar j = 0; j < BLEED_COUNT; j++){
+        __private int4 param = BLEED_PARAM(j);
 
         __private long2 new_coords;
         new_coords[0] = (long)coords[0] + (long)param[0];
@@ -236,13 +592,14 @@ __kernel void error_bleed(
         if ( new_coords[0] >= 0L && new_coords[0] < width 
         &&   new_coords[1] >= 0L && new_coords[1] < height){
 
-            __private uint   error_index =  (width * new_coords[1]) + new_coords[0];
+            __private ulong  dst_index   =  ((ulong)width * (new_coords[1] - band_row)) + new_coords[0];
+            __private ulong  error_index =  ((ulong)width * (new_coords[1] % err_rows)) + new_coords[0];
             
             __private float4 spread_error = (min_d * (float)param[2] / (float)param[3]);
             __private float4 tmp_spread_error = spread_error * 1000.f;
             __private int4   int_spread_error = {tmp_spread_error[0],tmp_spread_error[1],tmp_spread_error[2], tmp_spread_error[3]};
 
-            __private float4 dst_pixel = vload4(error_index, src);
+            __private float4 dst_pixel = LOAD_LAB(dst_index, src);
 
             __private float dE = deltaE(og_pixel, dst_pixel);
 
@@ -255,3 +612,266 @@ __kernel void error_bleed(
         }
     }
 }
+
+
+//same as error_bleed but each pixel pulls the error from the pixels that would have bled into it,
+//no atomics are needed and the result does not depend on the execution order
+__kernel void error_gather(
+                    __global LAB_T         *src,
+                    __global uchar         *dst,
+                    __global float         *err_buf,
+                    __constant float       *palette_lab,
+                    __constant uint        *palette_entries,
+                    __global uchar         *liquid_palette_ids,
+                    const uint              seed,
+                    __global int           *mc_height,
+                    const uint              width,
+                    const uint              height,
+                    const uint              entry_count,
+                    __global int           *bleeding_params,
+                    const uchar             bleeding_size,
+                    const uchar             min_progress,
+                    const int               max_mc_height,
+                    const uint              err_rows,
+                    __global float         *metric_palette,
+                    __global float         *metric_luts,
+                    const uchar             metric,
+                    __global uint          *diagnostics,
+                    const uint              band_first,
+                    const uint              band_row)
+{
+
+    __private uint2 coords = diagonal_coords(get_global_id(1), get_global_id(0), width, min_progress) + (uint2)(0, band_first);
+
+    __private ulong i = ((ulong)width * (coords[1] - band_row)) + coords[0];
+
+    __private float4 og_pixel = LOAD_LAB(i, src);
+
+    __private float4 error = 0;
+
+    //the predecessors already ran in a previous diagonal, their quantization error is still in the ring
+    UNROLL
+    for (__private uchar j = 0; j < BLEED_COUNT; j++){
+        __private int4 param = BLEED_PARAM(j);
+
+        __private long2 old_coords;
+        old_coords[0] = (long)coords[0] - (long)param[0];
+        old_coords[1] = (long)coords[1] - (long)param[1];
+
+        //do not go out or range
+        if ( old_coords[0] >= 0L && old_coords[0] < width
+        &&   old_coords[1] >= 0L && old_coords[1] < height){
+
+            __private ulong  old_index   =  ((ulong)width * (old_coords[1] - band_row)) + old_coords[0];
+            __private ulong  error_index =  ((ulong)width * (old_coords[1] % err_rows)) + old_coords[0];
+
+            __private float4 old_pixel = LOAD_LAB(old_index, src);
+
+            __private float dE = deltaE(old_pixel, og_pixel);
+
+            if (FLT_LT(dE, 1.f)){
+                __private float4 old_error = vload4(error_index, err_buf);
+                old_error[3] = 0;
+                error += old_error * (float)param[2] / (float)param[3];
+            }
+        }
+    }
+
+    __private float4 pixel = og_pixel + error;
+
+    __private uint counters[DIAG_COUNTERS] = {};
+    __local   uint group_counters[DIAG_COUNTERS];
+
+    __private float4 min_d = quantize_pixel(pixel, coords, dst, palette_lab, palette_entries, liquid_palette_ids, seed,
+                                            mc_height, width, height, PALETTE_SIZE, MC_LIMIT,
+                                            metric_palette, metric_luts, DITHER_METRIC, counters, diagnostics, band_row);
+
+    diag_flush_group(counters, group_counters, diagnostics);
+
+    //publish the error for the pixels below and to the right
+    vstore4(min_d, ((ulong)width * (coords[1] % err_rows)) + coords[0], err_buf);
+}
+
+
+//offset a pixel by the threshold map, each channel reads the map at a different shift
+//so the chroma gets dithered too and not only the lightness
+float4 threshold_pixel(
+                    __global LAB_T         *src,
+                    __global float         *threshold_map,
+                    const uint              map_size,
+                    const uint              seed,
+                    const uint              width,
+                    const float             spread,
+                    uint2                   coords,
+                    const uint              band_row)
+{
+    //different seeds move the pattern around
+    __private uint  shift = hash(seed);
+    __private uint  x     = coords[0] + (shift & 0xFFFF);
+    __private uint  y     = coords[1] + (shift >> 16);
+    __private uint  shift_half = map_size / 2;
+
+    __private float3 threshold = {
+        threshold_map[((y % map_size) * map_size) + (x % map_size)],
+        threshold_map[((y % map_size) * map_size) + ((x + shift_half) % map_size)],
+        threshold_map[(((y + shift_half) % map_size) * map_size) + (x % map_size)]
+    };
+    threshold = (threshold - 0.5f) * spread;
+
+    //src only holds the rows from band_row on
+    __private float4 pixel = LOAD_LAB(((ulong)width * (coords[1] - band_row)) + coords[0], src);
+    return pixel + (float4)(threshold[0], threshold[1], threshold[2], 0);
+}
+
+//ordered dithering, every pixel is independent: pick the nearest color to the offset pixel
+//ignoring the staircase, threshold_fixup repairs the columns that break it
+__kernel void threshold_dither(
+                    __global LAB_T         *src,
+                    __global uchar         *dst,
+                    __constant float       *palette_lab,
+                    __constant uint        *palette_entries,
+                    __global uchar         *liquid_palette_ids,
+                    __global float         *threshold_map,
+                    const uint              map_size,
+                    const uint              seed,
+                    const uint              width,
+                    const uint              height,
+                    const uint              entry_count,
+                    const int               max_mc_height,
+                    const float             spread,
+                    __global float         *metric_palette,
+                    __global float         *metric_luts,
+                    const uchar             metric,
+                    const uint              band_first,
+                    const uint              band_end,
+                    const uint              band_row)
+{
+    //large images run in bands of rows, the ids count from the first row of the band
+    __private ulong index = get_global_id(0);
+
+    if (index >= (ulong)width * (band_end - band_first))
+        return;
+
+    __private uint2 coords = { index % width, band_first + (index / width) };
+
+    __private float4 pixel = threshold_pixel(src, threshold_map, map_size, seed, width, spread, coords, band_row);
+
+    pixel = max(min(pixel,(float4)(100.0, 128.0, 128.0, 255.0)),(float4)(0.0,-128.0,-128.0, 0.0));
+
+    __private float4 scaled = 0;
+    __private float  chroma = 0;
+    __private float3 levels[PIXEL_G_LEVELS];
+    __private ushort levels_ready = 0;
+    if (DITHER_METRIC != METRIC_EUCLID){
+        scaled = pixel * METRIC_SCALE;
+        chroma = hypot(scaled[1], scaled[2]);
+    }
+
+    __private uchar  blacklisted_states[3] = {};
+    __private uchar  blacklisted_liquid_states[3] = {};
+
+    if (MC_LIMIT == 0){
+        blacklisted_states[0] = 1;
+        blacklisted_states[2] = 1;
+        blacklisted_liquid_states[0] = 1;
+        blacklisted_liquid_states[1] = 1;
+    }else {
+        for(__private char state = 0; state < 3; state++){
+            if (LIQUID_DEPTH[state] > MC_LIMIT)
+                blacklisted_liquid_states[state] = 1;
+        }
+    }
+
+    __private uchar min_index = 0;
+    __private uchar min_state = 0;
+
+    if ( FLT_GT(alpha(pixel) , 0.3f) ){
+        find_palette_color(pixel, palette_lab, palette_entries, PALETTE_SIZE,
+                           blacklisted_states, blacklisted_liquid_states, metric_palette, metric_luts, DITHER_METRIC,
+                           scaled, chroma, levels, &levels_ready, &min_index, &min_state);
+    }
+
+    vstore2((uchar2){min_index, min_state}, ((ulong)width * (coords[1] - band_row)) + coords[0], dst);
+}
+
+//one work item per column: follow the staircase down the column and send only the pixels
+//that break it ( too high, or not going up after a transparent pixel ) through quantize_pixel
+__kernel void threshold_fixup(
+                    __global LAB_T         *src,
+                    __global uchar         *dst,
+                    __constant float       *palette_lab,
+                    __constant uint        *palette_entries,
+                    __global uchar         *liquid_palette_ids,
+                    __global float         *threshold_map,
+                    const uint              map_size,
+                    const uint              seed,
+                    __global int           *mc_height,
+                    const uint              width,
+                    const uint              height,
+                    const uint              entry_count,
+                    const int               max_mc_height,
+                    const float             spread,
+                    __global float         *metric_palette,
+                    __global float         *metric_luts,
+                    const uchar             metric,
+                    __global uint          *diagnostics,
+                    const uint              band_first,
+                    const uint              band_end,
+                    const uint              band_row)
+{
+    __private uint x = get_global_id(0);
+
+    if (x >= width)
+        return;
+
+    //mc_height carries over between bands, the previous row comes from the halo row above the band
+    __private uchar prev_index = 1;
+    if (band_first > band_row)
+        prev_index = dst[(((ulong)width * (band_first - 1 - band_row)) + x) * 2];
+    __private uint  counters[DIAG_COUNTERS] = {};
+
+    for (__private uint y = band_first; y < band_end; y++){
+        __private ulong  i       = ((ulong)width * (y - band_row)) + x;
+        __private uchar2 current = vload2(i, dst);
+        __private int    curr_mc_height = mc_height[x];
+        __private int    tmp_mc_height  = curr_mc_height;
+        __private uchar  valid   = 1;
+
+        if (current[0] != 0){
+            if (prev_index == 0 && !liquid_palette_ids[current[0]] && current[1] != 2)
+                valid = 0;
+
+            if (MC_LIMIT > 0){
+                __private char delta = STATE_TO_DELTA(current[1]);
+                if (liquid_palette_ids[current[0]])
+                    tmp_mc_height = LIQUID_DEPTH[current[1]];
+                else if ( delta == - SIGN(curr_mc_height) )
+                    tmp_mc_height = delta;
+                else
+                    tmp_mc_height = curr_mc_height + delta;
+
+                if (abs( tmp_mc_height ) >= MC_LIMIT)
+                    valid = 0;
+            }
+        }else{
+            tmp_mc_height = 0;
+        }
+
+        if (valid){
+            mc_height[x] = tmp_mc_height;
+        }else{
+            __private float4 pixel = threshold_pixel(src, threshold_map, map_size, seed, width, spread, (uint2)(x, y), band_row);
+            quantize_pixel(pixel, (uint2)(x, y), dst, palette_lab, palette_entries, liquid_palette_ids, seed,
+                           mc_height, width, height, PALETTE_SIZE, MC_LIMIT,
+                           metric_palette, metric_luts, DITHER_METRIC, counters, diagnostics, band_row);
+            current = vload2(i, dst);
+        }
+
+        prev_index = current[0];
+    }
+
+    //one item per column, few enough to add straight to the global counters
+    for (__private uchar c = 0; c < DIAG_COUNTERS; c++)
+        if (counters[c] != 0)
+            atomic_add(&diagnostics[c], counters[c]);
+}
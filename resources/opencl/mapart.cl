@@ -28,26 +28,190 @@ __kernel void palette_to_rgb(
 }
 
 
-__kernel void palette_to_height(
+//staircase state of a column, carried from a row to the next
+//( mirrored by gpu_column_state on the host )
+typedef struct {
+    int  mc_height;
+    uint start_index;
+    int  start_padding;
+    uint flat_count;
+    int  max_height;
+    //lifts owed to the start of the staircase and to the padding blocks before it
+    uint stair_lifts;
+    uint pad_lifts;
+    //highest block ( lifts included ) of the staircase and of the padding
+    int  stair_max;
+    int  pad_max;
+    //rows of dst already added to the stats
+    uint counted_rows;
+} column_state;
+
+void column_state_init(column_state *state){
+    state->mc_height     = 0;
+    state->start_index   = 0;
+    state->start_padding = 1;
+    state->flat_count    = 0;
+    state->max_height    = 0;
+    state->stair_lifts   = 0;
+    state->pad_lifts     = 0;
+    state->stair_max     = 0;
+    state->pad_max       = 0;
+    state->counted_rows  = 0;
+}
+
+//clear the histogram of the work group
+void stats_clear(
+                __local  uint          *local_counts,
+                const uint              bins)
+{
+    for (__private uint i = get_local_id(0); i < bins; i += get_local_size(0))
+        local_counts[i] = 0;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+//rows of dst ( support row included ) that no staircase can lift anymore after the pixel x,y:
+//the ones before the padding of the current staircase, the whole column after its last pixel
+uint final_rows(
+                column_state           *state,
+                const int               y,
+                const uint              height)
+{
+    if (y == (int)height - 1)
+        return height + 1;
+    return (uint)max((int)state->counted_rows, (int)state->start_index - state->start_padding + 1);
+}
+
+//add the rows finalized by the pixel x,y to the histogram of the work group,
+//the layers from stats_layers on go to the overflow histogram of the stripe
+void count_final_rows(
+                __global uint          *dst,
+                column_state           *state,
+                __local  uint          *local_counts,
+                __global uint          *overflow_counts,
+                const int               x,
+                const int               y,
+                const uint              width,
+                const uint              height,
+                const uint              stats_layers)
+{
+    __private uint end = final_rows(state, y, height);
+
+    for (__private uint tmp_y = state->counted_rows; tmp_y < end; tmp_y++){
+        __private uint3 o_pixel = vload3(((size_t)width * tmp_y) + x, dst);
+        for (__private uint layer = o_pixel[1]; layer <= o_pixel[2]; layer++){
+            if (layer < stats_layers)
+                atomic_inc(&local_counts[(layer * (UCHAR_MAX + 1) ) + o_pixel[0] ]);
+            else
+                atomic_inc(&overflow_counts[((layer - stats_layers) * (UCHAR_MAX + 1) ) + o_pixel[0] ]);
+        }
+    }
+
+    state->counted_rows = end;
+}
+
+//same as count_final_rows for the per row launches, the local memory does not outlive a launch
+//so the low layers go straight to the slice of the work group
+void count_final_rows_global(
+                __global uint          *dst,
+                column_state           *state,
+                __global uint          *group_counts,
+                __global uint          *overflow_counts,
+                const int               x,
+                const int               y,
+                const uint              width,
+                const uint              height,
+                const uint              stats_layers)
+{
+    __private uint end = final_rows(state, y, height);
+
+    for (__private uint tmp_y = state->counted_rows; tmp_y < end; tmp_y++){
+        __private uint3 o_pixel = vload3(((size_t)width * tmp_y) + x, dst);
+        for (__private uint layer = o_pixel[1]; layer <= o_pixel[2]; layer++){
+            if (layer < stats_layers)
+                atomic_inc(&group_counts[(layer * (UCHAR_MAX + 1) ) + o_pixel[0] ]);
+            else
+                atomic_inc(&overflow_counts[((layer - stats_layers) * (UCHAR_MAX + 1) ) + o_pixel[0] ]);
+        }
+    }
+
+    state->counted_rows = end;
+}
+
+//save the histogram of the work group in its slice of partial_counts, reduce_stats sums the slices
+void stats_flush(
+                __local  uint          *local_counts,
+                __global uint          *partial_counts,
+                const uint              slice,
+                const uint              bins)
+{
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    __global uint *group_counts = partial_counts + ((size_t)slice * bins);
+
+    for (__private uint i = get_local_id(0); i < bins; i += get_local_size(0))
+        group_counts[i] = local_counts[i];
+}
+
+//apply the lifts postponed while the staircase was growing to the rows start_index..end-1
+void resolve_staircase(
+                __global uchar         *src,
+                __global uint          *dst,
+                column_state           *state,
+                const int               x,
+                const int               end,
+                const uint              width)
+{
+    __private int start = (int)state->start_index;
+    __private uint lifts = 0;
+    __private size_t tmp_o;
+    __private uint3 o_pixel;
+
+    //every block going down raised all the blocks of the staircase before it
+    for (__private int tmp_y = end - 1; tmp_y >= start; tmp_y--){
+        if (lifts > 0){
+            tmp_o = (width * (tmp_y + 1)) + x;
+            o_pixel = vload3(tmp_o, dst);
+            o_pixel[1] += lifts;
+            o_pixel[2] += lifts;
+            vstore3(o_pixel, tmp_o, dst);
+        }
+        if (src[(((width * tmp_y) + x) * 2) + 1] == 0)
+            lifts++;
+    }
+
+    //the padding blocks were raised only while they were part of the staircase
+    if (state->pad_lifts > 0){
+        for (__private int tmp_y = start - state->start_padding; tmp_y < start; tmp_y++){
+            tmp_o = (width * (tmp_y + 1)) + x;
+            o_pixel = vload3(tmp_o, dst);
+            o_pixel[1] += state->pad_lifts;
+            o_pixel[2] += state->pad_lifts;
+            vstore3(o_pixel, tmp_o, dst);
+        }
+    }
+
+    state->stair_lifts = 0;
+    state->pad_lifts   = 0;
+    state->stair_max   = 0;
+    state->pad_max     = 0;
+}
+
+//place the block of the pixel x,y ( rows have to be processed in order for each column )
+void palette_to_height_pixel(
                 __global uchar         *src,
                 __global uchar         *liquid_palette_ids,
                 __global uint          *dst,
                 __global uint          *error,
-                __global int           *mc_height,
-                __global uint          *start_index,
-                __global int           *start_padding,
-                __global uint          *flat_count,
+                column_state           *state,
+                const int               x,
+                const int               y,
                 const uint              width,
                 const uint              height,
-                const int               max_mc_height,
-                __global uint          *computed_max)
+                const int               max_mc_height)
 {
 
-    __private size_t index        = get_global_id(0);
-
-    __private int x              = index % width;
-
-    __private int y              = index / width;
+    __private size_t index        = (width * y) + x;
 
     __private size_t o            = (width * (y + 1)) + x;
 
@@ -68,20 +232,21 @@ __kernel void palette_to_height(
             if (block_id == 0 || liquid_palette_ids[block_id] || block_state == 2){
                 //if the first block is transparent or liquid or goes up do not set any support block ( or set it to transparent ) and remove it from the movable blocks
                 vstore3((uint3){0,0,0}, x ,dst);
-                start_padding[x] =  0;
-                start_index[x]   =  1;
-                mc_height[x]     = -1;
+                state->start_padding =  0;
+                state->start_index   =  1;
+                state->mc_height     = -1;
             }else if (block_state == 0){
                 //if the first block goes down set the support to y1
                 vstore3((uint3){SUPPORT_BLOCK,1,1}, x ,dst);
+                state->pad_max = 1;
             } else if ( block_state == 1 ){
                 //if the first block is flat set the support block to y0 and increase the count of sequential flat blocks
                 vstore3((uint3){SUPPORT_BLOCK,0,0}, x ,dst);
-                flat_count[x] = 1;
+                state->flat_count = 1;
             }
         }
         
-        __private int curr_mc_height = mc_height[x];
+        __private int curr_mc_height = state->mc_height;
 
         __private char delta       = ((char)block_state) - 1;
 
@@ -92,79 +257,88 @@ __kernel void palette_to_height(
 
         if (block_id == 0){
             //if is transparent
-            bottom_block     = 0;
-            top_block        = 0;
-            start_index[x]   = y + 1;
-            start_padding[x] = 0;
-            flat_count[x]    = 0;
+            resolve_staircase(src, dst, state, x, y, width);
+            bottom_block         = 0;
+            top_block            = 0;
+            state->start_index   = y + 1;
+            state->start_padding = 0;
+            state->flat_count    = 0;
         }else if (liquid_palette_ids[block_id]){
             //if it is liquid
-            bottom_block     = 0;
-            top_block        = LIQUID_DEPTH[block_state];
-            start_index[x]   = y;
-            start_padding[x] = 0;
-            flat_count[x]    = 0;
+            resolve_staircase(src, dst, state, x, y, width);
+            bottom_block         = 0;
+            top_block            = LIQUID_DEPTH[block_state];
+            state->start_index   = y;
+            state->start_padding = 0;
+            state->flat_count    = 0;
         }else{
             if (delta == -1){
                 //if the staircase is going down
                 if (curr_mc_height > 0){
                     //if we were in a raising staircase
+                    resolve_staircase(src, dst, state, x, y, width);
                     //drop down to y0
-                    bottom_block     = 0;
-                    top_block        = 0;
+                    bottom_block         = 0;
+                    top_block            = 0;
                     //set this as start of the downards staircase
-                    start_index[x]   = y;
+                    state->start_index   = y;
                     //tell that it is possible to raise the block before if we reach it's height
-                    start_padding[x] = flat_count[x];
+                    state->start_padding = state->flat_count;
+
+                    //the padding blocks are a flat run, read its height once
+                    for (__private int tmp_y = y - state->start_padding; tmp_y < y; tmp_y++){
+                        __private uint3 p_pixel = vload3((width * (tmp_y + 1)) + x, dst);
+                        state->pad_max = max(state->pad_max, (int)p_pixel[2]);
+                    }
                 }
 
                 //check the start of the staircase
-                __private int tmp_y = (int)start_index[x];
+                __private int tmp_y = (int)state->start_index;
+                __private char include_padding = 0;
 
                 //if there are an extra blocks before the staircase
-                if (start_padding[x] != 0){
+                if (state->start_padding != 0){
                     __private size_t tmp_o;
                     __private uint3 s_pixel;
                     if (tmp_y < y){
                         tmp_o = (width * ( tmp_y + 1 ) + x);
                         s_pixel = vload3(tmp_o, dst);
+                        s_pixel[2] += state->stair_lifts;
                     }else{
                         s_pixel = (uint3){block_id, bottom_block, top_block};
                     }
-                    tmp_o = (width * ( tmp_y + 1 - (int)start_padding[x] ) + x);
-                    __private uint3 p_pixel = vload3(tmp_o, dst);;
+                    tmp_o = (width * ( tmp_y + 1 - state->start_padding ) + x);
+                    __private uint3 p_pixel = vload3(tmp_o, dst);
+                    p_pixel[2] += state->pad_lifts;
 
                     //if the block is at our height or one higher include it in the staircase
                     if (s_pixel[2] == (p_pixel[2] - 1) || s_pixel[2] == p_pixel[2])
-                        tmp_y -= (int)start_padding[x];
+                        include_padding = 1;
                 }
 
-                __private size_t tmp_o;
-                __private uint3 o_pixel;
-                //loop over the entire staircase
-                for (;tmp_y < y && ( atomic_and(error, 1) == 0 ) ; tmp_y++){
-                    tmp_o = (width * (tmp_y + 1)) + x;
-                    o_pixel = vload3(tmp_o, dst);
-
-                    //shift the staircase to accomodate the new block
-                    __private int2 tmp_height = {(int)o_pixel[1], (int)o_pixel[2]};
-                    tmp_height += 1;
-
-                    //check if we are pushing the staircase out of the world
-                    if (max_mc_height > 0 && tmp_height[1] > max_mc_height){
-                        printf("Error: Pixel (%d,%d) crashed a staircase y:%d-%d\n", (uint)x, (uint)y, o_pixel[1], o_pixel[2]);
-                        atomic_or(error, 1);
-                    }else{
-                        //save the new positions
-                        o_pixel[1] = tmp_height[0];
-                        o_pixel[2] = tmp_height[1];
-                        vstore3(o_pixel, tmp_o, dst);
+                //shift the staircase to accomodate the new block
+                //( only the counters move here, the blocks are moved by resolve_staircase )
+                __private int lifted_max = -1;
+                if (tmp_y < y){
+                    state->stair_lifts ++;
+                    state->stair_max ++;
+                    lifted_max = state->stair_max;
+                }
+                if (include_padding){
+                    state->pad_lifts ++;
+                    state->pad_max ++;
+                    lifted_max = max(lifted_max, state->pad_max);
+                }
 
-                        //update the maximum height
-                        atomic_max(computed_max, tmp_height[1]);
-                    }
+                //check if we are pushing the staircase out of the world
+                if (max_mc_height > 0 && lifted_max > max_mc_height){
+                    printf("Error: Pixel (%d,%d) crashed a staircase y:%d\n", (uint)x, (uint)y, lifted_max);
+                    atomic_or(error, 1);
                 }
 
+                //update the maximum height
+                state->max_height = max(state->max_height, lifted_max);
+
                 //we have are back at y0
                 bottom_block = 0;
                 top_block    = 0;
@@ -173,48 +347,196 @@ __kernel void palette_to_height(
 
             // update the count of flat blocks
             if (delta == 0){
-                flat_count[x] ++;
+                state->flat_count ++;
             }else{
-                flat_count[x] = 0;
+                state->flat_count = 0;
             }
             
         }
         
         //update the current height
-        mc_height[x] = top_block;
+        state->mc_height = top_block;
         //update the maximum height
-        atomic_max(computed_max, top_block);
+        state->max_height = max(state->max_height, top_block);
+        //track the highest block of the staircase
+        if (y >= (int)state->start_index)
+            state->stair_max = max(state->stair_max, top_block);
 
         //store the position
         __private uint3 ret_pixel = {block_id, bottom_block, top_block};
         vstore3(ret_pixel, o ,dst);
+
+        //the column is over, move the last staircase in place
+        if (y == (int)height - 1)
+            resolve_staircase(src, dst, state, x, height, width);
     }
 }
 
+//one launch per row, each work item moves its column down by one row
+//and counts the rows it finalized in the slice of its work group
+__kernel void palette_to_height(
+                __global uchar         *src,
+                __global uchar         *liquid_palette_ids,
+                __global uint          *dst,
+                __global uint          *error,
+                __global column_state  *states,
+                const uint              width,
+                const uint              height,
+                const int               max_mc_height,
+                __global uint          *computed_max,
+                __global uint          *partial_counts,
+                __global uint          *overflow_counts,
+                const uint              stats_layers,
+                const uint              stats_slice)
+{
+
+    __private size_t index        = get_global_id(0);
+
+    __private int x              = index % width;
+
+    __private int y              = index / width;
+
+    __private column_state state;
+
+    if (y == 0)
+        column_state_init(&state);
+    else
+        state = states[x];
+
+    palette_to_height_pixel(src, liquid_palette_ids, dst, error, &state, x, y, width, height, max_mc_height);
+
+    __private uint bins = stats_layers * (UCHAR_MAX + 1);
+    count_final_rows_global(dst, &state, partial_counts + ((size_t)(stats_slice + get_group_id(0)) * bins), overflow_counts,
+                            x, y, width, height, stats_layers);
+
+    states[x] = state;
+
+    //update the maximum height
+    atomic_max(computed_max, (uint)state.max_height);
+}
+
+//single launch, each work item walks a whole column and counts its rows in the histogram of its work group as they are finalized
+__kernel void palette_to_height_columns(
+                __global uchar         *src,
+                __global uchar         *liquid_palette_ids,
+                __global uint          *dst,
+                __global uint          *error,
+                const uint              width,
+                const uint              height,
+                const int               max_mc_height,
+                __global uint          *computed_max,
+                __global uint          *partial_counts,
+                __global uint          *overflow_counts,
+                __local  uint          *local_counts,
+                const uint              stats_layers,
+                const uint              stats_slice)
+{
+
+    __private int x              = get_global_id(0);
+
+    __private uint bins          = stats_layers * (UCHAR_MAX + 1);
+
+    stats_clear(local_counts, bins);
+
+    //the padding work items only take part in the barriers
+    if (x < width){
+
+        __private column_state state;
 
+        column_state_init(&state);
 
+        for (__private int y = 0; y < height && ( atomic_and(error, 1) == 0 ); y++){
+            palette_to_height_pixel(src, liquid_palette_ids, dst, error, &state, x, y, width, height, max_mc_height);
+            count_final_rows(dst, &state, local_counts, overflow_counts, x, y, width, height, stats_layers);
+        }
+
+        //update the maximum height
+        atomic_max(computed_max, (uint)state.max_height);
+    }
+
+    stats_flush(local_counts, partial_counts, stats_slice + get_group_id(0), bins);
+}
+
+//each work group counts the blocks of a band of layers in its own local histogram
+//and saves it in its slice of partial_counts
 __kernel void height_to_stats(
                 __global uint         *src,
-                __global uint         *layer_count,
-                __global uint         *layer_id_count,
-                __global uint         *id_count
+                __global uint         *partial_counts,
+                __local  uint         *local_counts,
+                const ulong            pixel_count,
+                const uint             band_start,
+                const uint             band_layers
                 )
 {
 
-    __private size_t index     = get_global_id(0);
+    __private size_t local_id    = get_local_id(0);
+
+    __private size_t local_size  = get_local_size(0);
 
-    __private uint3 og_pixel   = vload3(index, src);
+    __private uint   bins        = band_layers * (UCHAR_MAX + 1);
 
-    __private uint block_id    = og_pixel[0];
+    __private uint   band_end    = band_start + band_layers - 1;
 
-    __private uint min_layer   = og_pixel[1];
+    for (__private uint i = local_id; i < bins; i += local_size)
+        local_counts[i] = 0;
 
-    __private uint max_layer   = og_pixel[2];
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (__private uint layer = min_layer; layer <= max_layer; layer++){
-        atomic_inc(&layer_count[layer]);
-        atomic_inc(&layer_id_count[(layer * (UCHAR_MAX + 1) ) + block_id ]);
-        atomic_inc(&id_count[block_id]);
+    for (__private size_t index = get_global_id(0); index < pixel_count; index += get_global_size(0)){
+
+        __private uint3 og_pixel   = vload3(index, src);
+
+        __private uint block_id    = og_pixel[0];
+
+        __private uint min_layer   = max(og_pixel[1], band_start);
+
+        __private uint max_layer   = min(og_pixel[2], band_end);
+
+        for (__private uint layer = min_layer; layer <= max_layer; layer++)
+            atomic_inc(&local_counts[((layer - band_start) * (UCHAR_MAX + 1) ) + block_id ]);
     }
 
-}
\ No newline at end of file
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    __global uint *group_counts = partial_counts + (get_group_id(0) * bins);
+
+    for (__private uint i = local_id; i < bins; i += local_size)
+        group_counts[i] = local_counts[i];
+
+}
+
+//add the histograms of all the work groups to the 64bit counters of the band:
+//one work group ( a power of two ) for each bin, every work item sums a few groups then the sums are folded in a tree
+__kernel void reduce_stats(
+                __global uint         *partial_counts,
+                __global ulong        *layer_id_count,
+                __local  ulong        *local_sums,
+                const uint             group_count,
+                const uint             bins,
+                const uint             band_offset
+                )
+{
+
+    __private size_t bin       = get_group_id(0);
+
+    __private size_t local_id  = get_local_id(0);
+
+    __private ulong count      = 0;
+
+    for (__private size_t group = local_id; group < group_count; group += get_local_size(0))
+        count += partial_counts[(group * bins) + bin];
+
+    local_sums[local_id] = count;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (__private size_t stride = get_local_size(0) / 2; stride > 0; stride /= 2){
+        if (local_id < stride)
+            local_sums[local_id] += local_sums[local_id + stride];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (local_id == 0)
+        layer_id_count[band_offset + bin] += local_sums[0];
+
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
+#include <pthread.h>
 #define TRACKER_MAX (1<<20)
 typedef struct  {
     void * ptr;
@@ -10,6 +11,8 @@ typedef struct  {
 
 static tracker_t tracker_l[TRACKER_MAX] = { 0 };
 static long track_last = 0;
+// the tracker is shared by all the worker threads
+static pthread_mutex_t tracker_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int t_compare(const void * o1, const void * o2){
     if ( ((tracker_t *)o1)->ptr > ((tracker_t *)o2)->ptr)
@@ -39,32 +42,41 @@ tracker_t *find(void * ptr){
 
 void* t_malloc(size_t size)
 {
+    pthread_mutex_lock(&tracker_lock);
     if (track_last > TRACKER_MAX){
+        pthread_mutex_unlock(&tracker_lock);
         return NULL;
     }
     void * ptr = malloc(size);
     tracker_t tmp = {ptr, size};
     track(tmp);
+    pthread_mutex_unlock(&tracker_lock);
     return ptr;
 }
 
 void* t_calloc(size_t count, size_t size){
+    pthread_mutex_lock(&tracker_lock);
     if (track_last > TRACKER_MAX){
+        pthread_mutex_unlock(&tracker_lock);
         return NULL;
     }
     void * ptr = calloc(count, size);
     tracker_t tmp = {ptr, count*size};
     track(tmp);
+    pthread_mutex_unlock(&tracker_lock);
     return ptr;
 }
 
 char* t_strdup(const char * src){
+    pthread_mutex_lock(&tracker_lock);
     if (track_last > TRACKER_MAX){
+        pthread_mutex_unlock(&tracker_lock);
         return NULL;
     }
     char * ptr = strdup(src);
     tracker_t tmp = {ptr, strlen(ptr)};
     track(tmp);
+    pthread_mutex_unlock(&tracker_lock);
     return ptr;
 }
 
@@ -72,14 +84,17 @@ void* t_realloc(void * old_ptr, size_t size){
     if (old_ptr == NULL){
         return t_malloc(size);
     }
+    pthread_mutex_lock(&tracker_lock);
     tracker_t * tracker = find(old_ptr);
     if (tracker) {
         void *ptr = realloc(old_ptr, size);
         tracker->ptr =ptr;
         tracker->size = size;
         reorder();
+        pthread_mutex_unlock(&tracker_lock);
         return ptr;
     }
+    pthread_mutex_unlock(&tracker_lock);
     return NULL;
 }
 
@@ -87,6 +102,7 @@ void* t_recalloc(void * old_ptr, size_t count, size_t size){
     if (old_ptr == NULL){
         return t_calloc(count, size);
     }
+    pthread_mutex_lock(&tracker_lock);
     tracker_t * tracker = find(old_ptr);
     if (tracker) {
         size_t old_size = tracker->size;
@@ -99,13 +115,16 @@ void* t_recalloc(void * old_ptr, size_t count, size_t size){
         tracker->ptr = ptr;
         tracker->size = new_size;
         reorder();
+        pthread_mutex_unlock(&tracker_lock);
         return ptr;
     }
+    pthread_mutex_unlock(&tracker_lock);
     return NULL;
 }
 
 void t_free(void* ptr)
 {
+    pthread_mutex_lock(&tracker_lock);
     tracker_t * tracker = find(ptr);
     if (tracker) {
         free(ptr);
@@ -114,6 +133,7 @@ void t_free(void* ptr)
         reorder();
         track_last--;
     }
+    pthread_mutex_unlock(&tracker_lock);
     /*
     if (tracker == NULL && ptr != NULL)
         printf("%p not tracked, maybe was already freed\n", ptr);
@@ -122,6 +142,8 @@ void t_free(void* ptr)
 
 int t_isTracked(void* ptr)
 {
+    pthread_mutex_lock(&tracker_lock);
     tracker_t * tracker = find(ptr);
+    pthread_mutex_unlock(&tracker_lock);
     return tracker != NULL;
 }
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "../alloc/tracked.h"
+
+#if defined(__WIN32__) || defined(__WIN64__) || defined(__WINNT__)
+#define MKDIR(p) mkdir(p)
+#else
+#define MKDIR(p) mkdir(p, 0755)
+#endif
+
+#define CACHE_FOLDER "cache/"
+#define CACHE_MAGIC "MAPCACHE"
+#define CACHE_VERSION 1
+#define CACHE_FNV_PRIME 0x100000001b3ULL
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t element_size;
+    int32_t width;
+    int32_t height;
+    int32_t channels;
+    uint32_t padding;
+    cache_key key;
+    cache_key checksum;
+} cache_header;
+
+cache_key cache_hash(cache_key key, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        key ^= bytes[i];
+        key *= CACHE_FNV_PRIME;
+    }
+    return key;
+}
+
+cache_key cache_hash_file(cache_key key, const char *filename, int *ret) {
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot read %s for the cache key\n", filename);
+        *ret = 14;
+        return key;
+    }
+
+    unsigned char buffer[65536];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        key = cache_hash(key, buffer, read);
+
+    *ret = ferror(fp) ? 14 : 0;
+    fclose(fp);
+    return key;
+}
+
+static void cache_filename(char *filename, const char *stage, cache_key key) {
+    sprintf(filename, "%s%s_%016llx.bin", CACHE_FOLDER, stage, (unsigned long long) key);
+}
+
+int cache_load(const char *stage, cache_key key, image_data *image, size_t element_size) {
+    char filename[300] = {};
+    cache_filename(filename, stage, key);
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+        return 1;
+
+    cache_header header = {};
+    int ret = 0;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CACHE_VERSION || header.element_size != element_size || header.key != key ||
+        header.width <= 0 || header.height <= 0 || header.channels <= 0)
+        ret = 2;
+
+    size_t data_size = 0;
+    void *data = NULL;
+    if (ret == 0) {
+        data_size = (size_t) header.width * header.height * header.channels * element_size;
+        data = t_malloc(data_size);
+        if (data == NULL || fread(data, 1, data_size, fp) != data_size)
+            ret = 3;
+    }
+
+    //a truncated or corrupted entry is treated as a miss
+    if (ret == 0 && cache_hash(CACHE_KEY_INIT, data, data_size) != header.checksum)
+        ret = 4;
+
+    fclose(fp);
+
+    if (ret == 0) {
+        image->image_data = data;
+        image->width = header.width;
+        image->height = header.height;
+        image->channels = header.channels;
+    } else {
+        fprintf(stderr, "Ignoring invalid cache entry %s\n", filename);
+        if (data != NULL)
+            t_free(data);
+    }
+    return ret;
+}
+
+int cache_store(const char *stage, cache_key key, image_data *image, size_t element_size) {
+    char filename[300] = {};
+    char tmp_filename[310] = {};
+    cache_filename(filename, stage, key);
+    sprintf(tmp_filename, "%s.tmp", filename);
+
+    MKDIR(CACHE_FOLDER);
+
+    size_t data_size = (size_t) image->width * image->height * image->channels * element_size;
+
+    cache_header header = {};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.element_size = element_size;
+    header.width = image->width;
+    header.height = image->height;
+    header.channels = image->channels;
+    header.key = key;
+    header.checksum = cache_hash(CACHE_KEY_INIT, image->image_data, data_size);
+
+    FILE *fp = fopen(tmp_filename, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot write cache entry %s\n", tmp_filename);
+        return 1;
+    }
+
+    int ret = 0;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(image->image_data, 1, data_size, fp) != data_size)
+        ret = 2;
+    if (fclose(fp) != 0)
+        ret = 2;
+
+    //only expose complete entries, an interrupted run leaves just the .tmp file behind
+    if (ret == 0) {
+        remove(filename);
+        if (rename(tmp_filename, filename) != 0)
+            ret = 3;
+    }
+
+    if (ret != 0) {
+        fprintf(stderr, "Cannot write cache entry %s\n", filename);
+        remove(tmp_filename);
+    }
+    return ret;
+}
+
+void cache_remove(const char *stage, cache_key key) {
+    char filename[300] = {};
+    cache_filename(filename, stage, key);
+    remove(filename);
+}
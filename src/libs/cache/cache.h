@@ -0,0 +1,62 @@
+#ifndef CACHE_DEF
+#define CACHE_DEF
+
+#include <stdint.h>
+#include "../globaldefs.h"
+
+/// <summary>
+/// Content hash identifying a cached stage ( 64bit FNV-1a )
+/// </summary>
+typedef uint64_t cache_key;
+
+/// <summary>
+/// Starting value for a new cache_key
+/// </summary>
+#define CACHE_KEY_INIT 0xcbf29ce484222325ULL
+
+/// <summary>
+/// Folds a block of memory into the key
+/// </summary>
+/// <param name="key">the key to extend ( CACHE_KEY_INIT for a new one )</param>
+/// <param name="data">the bytes to hash</param>
+/// <param name="size">the number of bytes</param>
+/// <returns>the extended key</returns>
+cache_key cache_hash(cache_key key, const void *data, size_t size);
+
+/// <summary>
+/// Folds the whole content of a file into the key
+/// </summary>
+/// <param name="key">the key to extend</param>
+/// <param name="filename">the file to hash</param>
+/// <param name="ret">set to 0 on success, to an error code if the file cannot be read</param>
+/// <returns>the extended key</returns>
+cache_key cache_hash_file(cache_key key, const char *filename, int *ret);
+
+/// <summary>
+/// Loads a stage saved by cache_store, the data is allocated with t_malloc
+/// </summary>
+/// <param name="stage">name of the stage</param>
+/// <param name="key">hash of everything the stage depends on</param>
+/// <param name="image">filled with the cached data and size</param>
+/// <param name="element_size">size of a single channel value</param>
+/// <returns>0 if a valid entry was found and loaded</returns>
+int cache_load(const char *stage, cache_key key, image_data *image, size_t element_size);
+
+/// <summary>
+/// Saves the output of a stage to the cache folder
+/// </summary>
+/// <param name="stage">name of the stage</param>
+/// <param name="key">hash of everything the stage depends on</param>
+/// <param name="image">the data to save</param>
+/// <param name="element_size">size of a single channel value</param>
+/// <returns>0 if the entry was written</returns>
+int cache_store(const char *stage, cache_key key, image_data *image, size_t element_size);
+
+/// <summary>
+/// Deletes an entry of the cache folder, if present
+/// </summary>
+/// <param name="stage">name of the stage</param>
+/// <param name="key">hash of everything the stage depends on</param>
+void cache_remove(const char *stage, cache_key key);
+
+#endif
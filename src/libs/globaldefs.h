@@ -20,6 +20,19 @@ typedef struct {
     char *dithering;
     char verbose;
     char fix_y0;
+    char split_maps;
+    char gather_error;
+    char column_height;
+    char no_cache;
+    char *seed_label;
+    unsigned int queues;
+    char all_devices;
+    char metric;
+    unsigned int preview; // downscale factor of the preview, 0 for the full run
+    char half_lab;
+    float progress_interval;
+    float checkpoint_interval;
+    char resume;
     gpu_t gpu;
 } main_options;
 
@@ -50,6 +63,8 @@ typedef struct {
     unsigned char *is_usable;
     unsigned char *is_liquid;
     unsigned int minecraft_data_version;
+    void *mapping; // set if the arrays point into a compiled palette file
+    size_t mapping_size;
 } mapart_palette;
 
 typedef mapart_palette mapart_float_palette;
@@ -18,7 +18,8 @@ typedef struct {
 	int16_t z; // The z coord of this block
 } block_pos_data;
 
-main_options main_config;
+// thread local so that multiple litematics can be generated at once
+_Thread_local main_options main_config;
 
 /// <summary>
 /// Compares 2 block_pos_data objects, sorting by y, then z, then x
@@ -51,7 +52,7 @@ int block_pos_data_compare(const void* v1, const void* v2)
 /// <param name="stats">the stats of the mapart</param>
 /// <returns>True if there is any block at height 0 which requires support<para/>False otherwise</returns>
 bool is_upwards_shift_needed(mapart_palette* block_palette, mapart_stats* stats) {
-	unsigned int cur_block_count;
+	uint64_t cur_block_count;
 	for (int i = 0; i < block_palette->palette_size; i++) {
 		cur_block_count = stats->layer_id_count[i]; // Assumes that the y0 layer is the first layer
 
@@ -187,7 +188,7 @@ int* get_max_up_shifts_allowed(image_uint_data* block_data) {
 }
 
 //TODO: Add function documentation
-block_pos_data* get_all_block_data(mapart_palette* block_palette, image_uint_data* block_data, int upwards_shift, int* all_blocks_len, int** region_block_lens, int** region_sizes, int** region_positions, char*** region_names, int* region_count) {
+block_pos_data* get_all_block_data(mapart_palette* block_palette, image_uint_data* block_data, mapart_window window, int upwards_shift, int* all_blocks_len, int** region_block_lens, int** region_sizes, int** region_positions, char*** region_names, int* region_count) {
     fprintf(stdout, "Getting all block data along with supporting blocks\n");
     fflush(stdout);
 
@@ -197,11 +198,11 @@ block_pos_data* get_all_block_data(mapart_palette* block_palette, image_uint_dat
     // Create an array to store all the new block data including the supporting blocks
     // Each block stores its block_id and its x, y, and z positions relative to its region's origin (Note: y is not relative if min_height is not 0)
     // Size allocated to the array is 20x the size of incoming block_data to account for worst-case scenario of all blocks requiring support and all blocks being 10-deep water
-    block_pos_data* all_block_data = t_calloc((int64_t)block_data->width * block_data->height * 20, sizeof(block_pos_data));
+    block_pos_data* all_block_data = t_calloc((int64_t)window.width * (window.height + 1) * 20, sizeof(block_pos_data));
 
     // Get the number of regions we'll be using
-    int region_x_count = (int)(ceil(block_data->width / 128.0));
-    int region_z_count = (int)(ceil((block_data->height - 1) / 128.0)); // Subtract 1 from height to ignore 'header' region
+    int region_x_count = (int)(ceil(window.width / 128.0));
+    int region_z_count = (int)(ceil(window.height / 128.0)); // The window height already ignores the 'header' region
     *region_count = region_x_count * region_z_count + 1; // Add back 1 to region count for the 'header' region
 
     // Create arrays to store information about each region
@@ -224,11 +225,11 @@ block_pos_data* get_all_block_data(mapart_palette* block_palette, image_uint_dat
     int cur_height;
     *all_blocks_len = 0;
 
-    // Get 'header' region blocks
-    int in_index = 0;
+    // Get 'header' region blocks ( the row just above the window )
+    int in_index = (window.z * block_data->width + window.x) * channels;
     int max_height = 0;
-    int min_height = (int)in_data[1] + upwards_shift;
-    for (int x = 0; x < block_data->width; x++) {
+    int min_height = (int)in_data[in_index + 1] + upwards_shift;
+    for (int x = 0; x < window.width; x++) {
         cur_block_id = in_data[in_index];
         // Ignore glass blocks with id 0
         if (cur_block_id != 0) {
@@ -249,7 +250,7 @@ block_pos_data* get_all_block_data(mapart_palette* block_palette, image_uint_dat
     }
     // Store the 'header' region's information
     (*region_block_lens)[0] = *all_blocks_len;
-    (*region_sizes)[0] = block_data->width;
+    (*region_sizes)[0] = window.width;
     (*region_sizes)[1] = max_height - min_height + 1;
     (*region_sizes)[2] = 1;
     (*region_positions)[0] = 0;
@@ -261,13 +262,13 @@ block_pos_data* get_all_block_data(mapart_palette* block_palette, image_uint_dat
     int region_index = 1;
     for (int region_index_z = 0; region_index_z < region_z_count; region_index_z++) {
         for (int region_index_x = 0; region_index_x < region_x_count; region_index_x++) {
-            in_index = region_index_x * 128 * channels
-                   + ((region_index_z * 128 + 1) * block_data->width) * channels;
+            in_index = (window.x + region_index_x * 128) * channels
+                   + ((window.z + region_index_z * 128 + 1) * block_data->width) * channels;
             max_height = 0;
             min_height = (int)in_data[in_index + 1] + upwards_shift;
-            // If the 128x128 region extends outside of bounds clamp it down
-            int region_width = (region_index_x + 1) * 128 < block_data->width ? 128 : block_data->width - region_index_x * 128;
-            int region_height = (region_index_z + 1) * 128 < block_data->height - 1 ? 128 : block_data->height - 1 - region_index_z * 128;
+            // If the 128x128 region extends outside of the window clamp it down
+            int region_width = (region_index_x + 1) * 128 < window.width ? 128 : window.width - region_index_x * 128;
+            int region_height = (region_index_z + 1) * 128 < window.height ? 128 : window.height - region_index_z * 128;
             for (int z = 0; z < region_height; z++) {
                 for (int x = 0; x < region_width; x++) {
                     cur_block_id = in_data[in_index];
@@ -351,7 +352,7 @@ block_pos_data* get_all_block_data(mapart_palette* block_palette, image_uint_dat
             (*region_positions)[region_index * 3] = region_index_x * 128;
             (*region_positions)[region_index * 3 + 1] = min_height;
             (*region_positions)[region_index * 3 + 2] = region_index_z * 128;
-            sprintf(buffer, "Map %d_%d", region_index_z + 1, region_index_x + 1);
+            sprintf(buffer, "Map %d_%d", window.z / 128 + region_index_z + 1, window.x / 128 + region_index_x + 1);
             (*region_names)[region_index] = t_strdup(buffer);
 
             region_index++;
@@ -505,6 +506,11 @@ int64_t* get_bit_packed_block_data(block_pos_data* block_data, int block_data_le
 
 //TODO: Add function documentation
 void litematica_create(char* author, main_options config, char* file_name, mapart_stats* stats, version_numbers version_info, mapart_palette* block_palette, image_uint_data* block_data) {
+    mapart_window window = { 0, 0, block_data->width, block_data->height - 1 };
+    litematica_create_window(author, config, file_name, stats, version_info, block_palette, block_data, window);
+}
+
+void litematica_create_window(char* author, main_options config, char* file_name, mapart_stats* stats, version_numbers version_info, mapart_palette* block_palette, image_uint_data* block_data, mapart_window window) {
     fprintf(stdout, "Creating litematica file from image\n");
     fflush(stdout);
 
@@ -528,7 +534,7 @@ void litematica_create(char* author, main_options config, char* file_name, mapar
     int* region_sizes;
     int* region_positions;
     char** region_names;
-    block_pos_data* all_block_data = get_all_block_data(block_palette, block_data, upwards_shift, &all_blocks_len, &region_block_lens, &region_sizes, &region_positions, &region_names, &region_count);
+    block_pos_data* all_block_data = get_all_block_data(block_palette, block_data, window, upwards_shift, &all_blocks_len, &region_block_lens, &region_sizes, &region_positions, &region_names, &region_count);
 
     // Sort the new block data by y, then z, then x for each region separately
     int all_blocks_offset = 0;
@@ -699,6 +705,7 @@ void litematica_create(char* author, main_options config, char* file_name, mapar
 	sprintf(buffer, "%s.litematic", file_name);
     clock_t start = clock();
 	write_nbt_file(buffer, tagTop, NBT_WRITE_FLAG_USE_GZIP);
+    nbt_free_tag(tagTop);
     clock_t stop = clock();
     double delta = (double)(stop - start) / CLOCKS_PER_SEC;
     fprintf(stdout, "Saved in %.5lf s\n", delta);
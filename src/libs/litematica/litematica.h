@@ -10,7 +10,7 @@ typedef struct {
 	uint16_t y_length; // The length of the 3d mapart along the y axis
 	uint16_t z_length; // The length of the 3d mapart along the z axis
 	uint64_t volume; // The total volume a box encompassing the 3d mapart would have
-	unsigned int* layer_id_count; // 2d matrix containing the block count at a given layer with a given palette id
+	uint64_t* layer_id_count; // 2d matrix containing the block count at a given layer with a given palette id
 } mapart_stats;
 
 /// <summary>
@@ -21,6 +21,16 @@ typedef struct {
 	int litematica; // The Litematica version the litematic should use
 } version_numbers;
 
+/// <summary>
+/// Describes the part of the block data a litematic is generated from
+/// </summary>
+typedef struct {
+	int x; // The first column of the window
+	int z; // The first row of the window, not counting the 'header' row ( the row above it is used as header )
+	int width; // The number of columns in the window
+	int height; // The number of rows in the window, not counting the 'header' row
+} mapart_window;
+
 /// <summary>
 /// 
 /// </summary>
@@ -32,4 +42,11 @@ typedef struct {
 /// <param name="version_info"></param>
 /// <param name="block_palette"></param>
 /// <param name="block_data"></param>
-void litematica_create(char* author, main_options config, char* file_name, mapart_stats* stats, version_numbers version_info, mapart_palette* block_palette, image_uint_data* block_data);
\ No newline at end of file
+void litematica_create(char* author, main_options config, char* file_name, mapart_stats* stats, version_numbers version_info, mapart_palette* block_palette, image_uint_data* block_data);
+
+/// <summary>
+/// Same as litematica_create but only uses the blocks inside the window, the row just above the window is used as 'header' region.
+/// Map regions keep the names they have in the full litematic so the files can be matched with each other
+/// </summary>
+/// <param name="window">the part of block_data to export ( must be inside the block data )</param>
+void litematica_create_window(char* author, main_options config, char* file_name, mapart_stats* stats, version_numbers version_info, mapart_palette* block_palette, image_uint_data* block_data, mapart_window window);
\ No newline at end of file
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__WIN32__) || defined(__WIN64__) || defined(__WINNT__)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "palette.h"
+#include "../alloc/tracked.h"
+
+#define PALETTE_MAGIC "MAPPALET"
+#define PALETTE_VERSION 1
+#define PALETTE_ALIGN 16
+#define PALETTE_NO_STRING 0xFFFFFFFFu
+
+//all the offsets are from the start of the file and aligned to PALETTE_ALIGN
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t palette_size;
+    uint32_t entry_size;
+    uint32_t minecraft_data_version;
+    uint64_t source_hash;
+    uint64_t file_size;
+    uint64_t rgb_offset;        // int[palette_size * entry_size]
+    uint64_t lab_offset;        // float[palette_size * entry_size]
+    uint64_t usable_offset;     // uchar[palette_size]
+    uint64_t supported_offset;  // uchar[palette_size]
+    uint64_t liquid_offset;     // uchar[palette_size]
+    uint64_t string_offset;     // uint[palette_size * 2 + 1] names, block ids, support block
+    uint64_t text_offset;       // the null terminated strings
+    uint64_t text_size;
+} palette_header;
+
+static uint64_t palette_align(uint64_t offset) {
+    return (offset + PALETTE_ALIGN - 1) & ~(uint64_t) (PALETTE_ALIGN - 1);
+}
+
+int palette_is_binary(const char *filename) {
+    char magic[8] = {};
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+        return 0;
+    size_t read = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+    return read == sizeof(magic) && memcmp(magic, PALETTE_MAGIC, sizeof(magic)) == 0;
+}
+
+static uint32_t palette_add_string(char *text, uint64_t *text_size, const char *value) {
+    if (value == NULL)
+        return PALETTE_NO_STRING;
+    uint32_t offset = *text_size;
+    size_t length = strlen(value) + 1;
+    if (text != NULL)
+        memcpy(text + offset, value, length);
+    *text_size += length;
+    return offset;
+}
+
+int palette_compile(const char *filename, mapart_palette *palette, mapart_float_palette *lab_palette, unsigned int entry_size, uint64_t source_hash) {
+    unsigned int size = palette->palette_size;
+    unsigned int string_count = size * 2 + 1;
+
+    //measure the strings first
+    uint64_t text_size = 0;
+    for (unsigned int i = 0; i < size; i++) {
+        palette_add_string(NULL, &text_size, palette->palette_id_names[i]);
+        palette_add_string(NULL, &text_size, palette->palette_block_ids[i]);
+    }
+    palette_add_string(NULL, &text_size, palette->support_block);
+
+    palette_header header = {};
+    memcpy(header.magic, PALETTE_MAGIC, sizeof(header.magic));
+    header.version = PALETTE_VERSION;
+    header.palette_size = size;
+    header.entry_size = entry_size;
+    header.minecraft_data_version = palette->minecraft_data_version;
+    header.source_hash = source_hash;
+    header.rgb_offset = palette_align(sizeof(header));
+    header.lab_offset = palette_align(header.rgb_offset + (uint64_t) size * entry_size * sizeof(int));
+    header.usable_offset = palette_align(header.lab_offset + (uint64_t) size * entry_size * sizeof(float));
+    header.supported_offset = palette_align(header.usable_offset + size);
+    header.liquid_offset = palette_align(header.supported_offset + size);
+    header.string_offset = palette_align(header.liquid_offset + size);
+    header.text_offset = palette_align(header.string_offset + (uint64_t) string_count * sizeof(uint32_t));
+    header.text_size = text_size;
+    header.file_size = header.text_offset + text_size;
+
+    unsigned char *data = t_calloc(header.file_size, sizeof(unsigned char));
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + header.rgb_offset, palette->palette, (size_t) size * entry_size * sizeof(int));
+    memcpy(data + header.lab_offset, lab_palette->palette, (size_t) size * entry_size * sizeof(float));
+    memcpy(data + header.usable_offset, palette->is_usable, size);
+    memcpy(data + header.supported_offset, palette->is_supported, size);
+    memcpy(data + header.liquid_offset, palette->is_liquid, size);
+
+    uint32_t *strings = (uint32_t *) (data + header.string_offset);
+    char *text = (char *) (data + header.text_offset);
+    text_size = 0;
+    for (unsigned int i = 0; i < size; i++) {
+        strings[i] = palette_add_string(text, &text_size, palette->palette_id_names[i]);
+        strings[size + i] = palette_add_string(text, &text_size, palette->palette_block_ids[i]);
+    }
+    strings[size * 2] = palette_add_string(text, &text_size, palette->support_block);
+
+    int ret = 0;
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot write compiled palette %s\n", filename);
+        ret = 1;
+    } else {
+        if (fwrite(data, 1, header.file_size, fp) != header.file_size)
+            ret = 2;
+        if (fclose(fp) != 0)
+            ret = 2;
+        if (ret != 0) {
+            fprintf(stderr, "Cannot write compiled palette %s\n", filename);
+            remove(filename);
+        }
+    }
+
+    t_free(data);
+    return ret;
+}
+
+static void *palette_map_file(const char *filename, size_t *size) {
+#if defined(__WIN32__) || defined(__WIN64__) || defined(__WINNT__)
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+    LARGE_INTEGER file_size;
+    void *data = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            //the view keeps the mapping alive
+            CloseHandle(mapping);
+        }
+        *size = file_size.QuadPart;
+    }
+    CloseHandle(file);
+    return data;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat info;
+    void *data = NULL;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            data = NULL;
+        *size = info.st_size;
+    }
+    close(fd);
+    return data;
+#endif
+}
+
+static void palette_unmap_file(void *data, size_t size) {
+#if defined(__WIN32__) || defined(__WIN64__) || defined(__WINNT__)
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+static char *palette_get_string(const unsigned char *data, const palette_header *header, uint32_t offset) {
+    if (offset == PALETTE_NO_STRING)
+        return NULL;
+    return (char *) (data + header->text_offset + offset);
+}
+
+int palette_load(const char *filename, mapart_palette *palette, mapart_float_palette *lab_palette, unsigned int entry_size, uint64_t *source_hash) {
+    size_t size = 0;
+    unsigned char *data = palette_map_file(filename, &size);
+    if (data == NULL) {
+        fprintf(stderr, "Cannot map compiled palette %s\n", filename);
+        return 100;
+    }
+
+    palette_header header = {};
+    int ret = 0;
+    if (size < sizeof(header))
+        ret = 102;
+    else
+        memcpy(&header, data, sizeof(header));
+
+    uint64_t count = header.palette_size;
+    if (ret == 0 && (memcmp(header.magic, PALETTE_MAGIC, sizeof(header.magic)) != 0 || header.version != PALETTE_VERSION ||
+                     header.entry_size != entry_size || header.file_size != size))
+        ret = 102;
+
+    //every section has to fit, and the strings must be terminated inside the file
+    if (ret == 0 && (header.rgb_offset + count * entry_size * sizeof(int) > size ||
+                     header.lab_offset + count * entry_size * sizeof(float) > size ||
+                     header.usable_offset + count > size || header.supported_offset + count > size ||
+                     header.liquid_offset + count > size ||
+                     header.string_offset + (count * 2 + 1) * sizeof(uint32_t) > size ||
+                     header.text_offset + header.text_size != size ||
+                     (header.text_size > 0 && data[size - 1] != '\0')))
+        ret = 102;
+
+    const uint32_t *strings = (const uint32_t *) (data + header.string_offset);
+    for (uint64_t i = 0; ret == 0 && i < count * 2 + 1; i++)
+        if (strings[i] != PALETTE_NO_STRING && strings[i] >= header.text_size)
+            ret = 102;
+
+    if (ret != 0) {
+        fprintf(stderr, "Invalid compiled palette %s\n", filename);
+        palette_unmap_file(data, size);
+        return ret;
+    }
+
+    palette->palette_size = header.palette_size;
+    palette->palette = data + header.rgb_offset;
+    palette->is_usable = data + header.usable_offset;
+    palette->is_supported = data + header.supported_offset;
+    palette->is_liquid = data + header.liquid_offset;
+    palette->minecraft_data_version = header.minecraft_data_version;
+    palette->palette_id_names = t_calloc(count, sizeof(char *));
+    palette->palette_block_ids = t_calloc(count, sizeof(char *));
+    for (uint64_t i = 0; i < count; i++) {
+        palette->palette_id_names[i] = palette_get_string(data, &header, strings[i]);
+        palette->palette_block_ids[i] = palette_get_string(data, &header, strings[count + i]);
+    }
+    palette->support_block = palette_get_string(data, &header, strings[count * 2]);
+    palette->mapping = data;
+    palette->mapping_size = size;
+
+    *lab_palette = *palette;
+    lab_palette->palette = data + header.lab_offset;
+    lab_palette->mapping = NULL;
+
+    *source_hash = header.source_hash;
+    return ret;
+}
+
+void palette_unmap(mapart_palette *palette) {
+    if (palette->mapping != NULL)
+        palette_unmap_file(palette->mapping, palette->mapping_size);
+    palette->mapping = NULL;
+    palette->mapping_size = 0;
+}
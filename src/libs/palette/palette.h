@@ -0,0 +1,42 @@
+#ifndef PALETTE_DEF
+#define PALETTE_DEF
+
+#include <stdint.h>
+#include "../globaldefs.h"
+
+/// <summary>
+/// Checks whether a file is a compiled palette ( starts with the binary magic )
+/// </summary>
+/// <param name="filename">the palette file</param>
+/// <returns>1 if the file is a compiled palette</returns>
+int palette_is_binary(const char *filename);
+
+/// <summary>
+/// Writes a compiled palette: multiplied RGB, OK-L*ab values in device layout, flags, block ids and support block
+/// </summary>
+/// <param name="filename">the output file</param>
+/// <param name="palette">the palette as loaded from the json</param>
+/// <param name="lab_palette">the same palette converted to OK-L*ab</param>
+/// <param name="entry_size">number of values stored for each palette id</param>
+/// <param name="source_hash">hash of the json the palette was compiled from</param>
+/// <returns>0 if the file was written</returns>
+int palette_compile(const char *filename, mapart_palette *palette, mapart_float_palette *lab_palette, unsigned int entry_size, uint64_t source_hash);
+
+/// <summary>
+/// Maps a compiled palette in memory, the arrays of both palettes point into the mapping
+/// </summary>
+/// <param name="filename">the compiled palette</param>
+/// <param name="palette">filled with the RGB palette, owns the mapping</param>
+/// <param name="lab_palette">filled with the OK-L*ab palette</param>
+/// <param name="entry_size">number of values expected for each palette id</param>
+/// <param name="source_hash">set to the hash of the json the palette was compiled from</param>
+/// <returns>0 if the palette was loaded</returns>
+int palette_load(const char *filename, mapart_palette *palette, mapart_float_palette *lab_palette, unsigned int entry_size, uint64_t *source_hash);
+
+/// <summary>
+/// Releases the mapping of a palette loaded with palette_load
+/// </summary>
+/// <param name="palette">the palette owning the mapping</param>
+void palette_unmap(mapart_palette *palette);
+
+#endif
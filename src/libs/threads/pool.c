@@ -0,0 +1,190 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#if defined(__WIN32__) || defined(__WIN64__) || defined(__WINNT__)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "pool.h"
+#include "../alloc/tracked.h"
+
+typedef struct {
+    pool_task task;
+    void *arg;
+    unsigned int task_count;
+    atomic_uint next_index;
+} pool_state;
+
+unsigned int pool_thread_count() {
+#if defined(__WIN32__) || defined(__WIN64__) || defined(__WINNT__)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long count = info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return count > 0 ? (unsigned int) count : 1;
+}
+
+static void *pool_worker(void *data) {
+    pool_state *state = data;
+    for (unsigned int index = atomic_fetch_add(&state->next_index, 1); index < state->task_count;
+         index = atomic_fetch_add(&state->next_index, 1)) {
+        state->task(state->arg, index);
+    }
+    return NULL;
+}
+
+int pool_run(unsigned int task_count, unsigned int thread_count, pool_task task, void *arg) {
+    int ret = 0;
+
+    if (thread_count == 0)
+        thread_count = pool_thread_count();
+    if (thread_count > task_count)
+        thread_count = task_count;
+
+    pool_state state = {task, arg, task_count};
+    atomic_init(&state.next_index, 0);
+
+    if (thread_count <= 1) {
+        pool_worker(&state);
+        return ret;
+    }
+
+    pthread_t *threads = t_calloc(thread_count, sizeof(pthread_t));
+    unsigned int started = 0;
+
+    for (; started < thread_count; started++) {
+        int err = pthread_create(&threads[started], NULL, pool_worker, &state);
+        if (err != 0) {
+            //not fatal, the threads that did start ( and the calling one ) will pick up the slack
+            fprintf(stderr, "Failed to start worker thread %d: code %d\n", started, err);
+            fflush(stderr);
+            break;
+        }
+    }
+
+    //the calling thread helps out with the remaining tasks
+    pool_worker(&state);
+
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    t_free(threads);
+    return ret;
+}
+
+typedef struct {
+    pool_graph_node *nodes;
+    unsigned int node_count;
+    void *arg;
+    uint64_t started;
+    uint64_t completed;
+    uint64_t failed;
+    unsigned int remaining;
+    int ret;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} pool_graph_state;
+
+static void *pool_graph_worker(void *data) {
+    pool_graph_state *state = data;
+    pthread_mutex_lock(&state->lock);
+    while (state->remaining > 0) {
+        //propagate the failures without running the nodes, a skipped node can fail nodes already visited
+        for (char changed = 1; changed;) {
+            changed = 0;
+            for (unsigned int i = 0; i < state->node_count; i++) {
+                uint64_t bit = 1ULL << i;
+                if (!(state->started & bit) && (state->nodes[i].dependencies & state->failed)) {
+                    state->started |= bit;
+                    state->failed |= bit;
+                    state->remaining--;
+                    changed = 1;
+                }
+            }
+        }
+
+        int next = -1;
+        for (unsigned int i = 0; i < state->node_count && next < 0; i++) {
+            uint64_t bit = 1ULL << i;
+            if (!(state->started & bit) && (state->nodes[i].dependencies & ~state->completed) == 0)
+                next = (int) i;
+        }
+
+        if (next < 0) {
+            if (state->remaining > 0)
+                pthread_cond_wait(&state->changed, &state->lock);
+            else
+                pthread_cond_broadcast(&state->changed);
+            continue;
+        }
+
+        uint64_t bit = 1ULL << next;
+        state->started |= bit;
+        pthread_mutex_unlock(&state->lock);
+
+        int ret = state->nodes[next].stage(state->arg);
+
+        pthread_mutex_lock(&state->lock);
+        if (ret == 0) {
+            state->completed |= bit;
+        } else {
+            state->failed |= bit;
+            if (state->ret == 0)
+                state->ret = ret;
+        }
+        state->remaining--;
+        pthread_cond_broadcast(&state->changed);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+int pool_graph_run(pool_graph_node *nodes, unsigned int node_count, unsigned int thread_count, void *arg) {
+    if (node_count > POOL_GRAPH_MAX_NODES) {
+        fprintf(stderr, "Graph of %d nodes exceeds the limit of %d\n", node_count, POOL_GRAPH_MAX_NODES);
+        fflush(stderr);
+        return 1;
+    }
+
+    if (thread_count == 0)
+        thread_count = pool_thread_count();
+    if (thread_count > node_count)
+        thread_count = node_count;
+
+    pool_graph_state state = {nodes, node_count, arg};
+    state.remaining = node_count;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.changed, NULL);
+
+    pthread_t *threads = NULL;
+    unsigned int started = 0;
+    if (thread_count > 1) {
+        threads = t_calloc(thread_count - 1, sizeof(pthread_t));
+        for (; started < thread_count - 1; started++) {
+            int err = pthread_create(&threads[started], NULL, pool_graph_worker, &state);
+            if (err != 0) {
+                //not fatal, the nodes just overlap less
+                fprintf(stderr, "Failed to start worker thread %d: code %d\n", started, err);
+                fflush(stderr);
+                break;
+            }
+        }
+    }
+
+    //the calling thread takes part in the graph too
+    pool_graph_worker(&state);
+
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (threads != NULL)
+        t_free(threads);
+
+    pthread_cond_destroy(&state.changed);
+    pthread_mutex_destroy(&state.lock);
+    return state.ret;
+}
@@ -0,0 +1,56 @@
+#ifndef POOL_DEF
+#define POOL_DEF
+
+#include <stdint.h>
+
+/// <summary>
+/// Task executed by the worker pool, called once for every index in [0, task_count)
+/// </summary>
+typedef void (*pool_task)(void *arg, unsigned int index);
+
+/// <summary>
+/// Returns the number of hardware threads available on this machine ( at least 1 )
+/// </summary>
+unsigned int pool_thread_count();
+
+/// <summary>
+/// Runs task_count tasks on a pool of thread_count worker threads and waits for all of them to complete.
+/// Workers pull the next free index from a shared counter so uneven tasks are balanced automatically
+/// </summary>
+/// <param name="task_count">number of tasks to run</param>
+/// <param name="thread_count">number of workers to use ( 0 means one per hardware thread )</param>
+/// <param name="task">function to call for each task index</param>
+/// <param name="arg">shared argument passed to each task</param>
+/// <returns>0 once all the tasks have completed</returns>
+int pool_run(unsigned int task_count, unsigned int thread_count, pool_task task, void *arg);
+
+/// <summary>
+/// Stage of a pool_graph_run, returns 0 on success or an error code
+/// </summary>
+typedef int (*pool_stage)(void *arg);
+
+/// <summary>
+/// Maximum number of stages in a graph ( one bit of the dependency mask each )
+/// </summary>
+#define POOL_GRAPH_MAX_NODES 64
+
+/// <summary>
+/// A node of the dependency graph
+/// </summary>
+typedef struct {
+    pool_stage stage;
+    uint64_t dependencies; // bit i is set if the node waits for node i
+} pool_graph_node;
+
+/// <summary>
+/// Runs a dependency graph on a pool of worker threads, each node starts as soon as all its dependencies succeeded.
+/// The nodes depending on a failed node are skipped
+/// </summary>
+/// <param name="nodes">the nodes of the graph ( at most POOL_GRAPH_MAX_NODES )</param>
+/// <param name="node_count">number of nodes</param>
+/// <param name="thread_count">number of workers to use ( 0 means one per hardware thread )</param>
+/// <param name="arg">shared argument passed to each stage</param>
+/// <returns>0 if every node succeeded, otherwise the code of the first node that failed</returns>
+int pool_graph_run(pool_graph_node *nodes, unsigned int node_count, unsigned int thread_count, void *arg);
+
+#endif
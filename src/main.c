@@ -1,4 +1,6 @@
 #define PROGRAM_NAME "mapartProcessor-v1.3.1"
+//bump when the host side of a cached stage changes its results, the kernel sources are hashed already
+#define CACHE_SALT 1
 
 #include <errno.h>
 #include <stdio.h>
@@ -6,6 +8,8 @@
 #include <getopt.h>
 #include <math.h>
 #include <float.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "libs/alloc/tracked.h"
 
@@ -24,6 +28,9 @@
 
 #include "libs/globaldefs.h"
 #include "libs/litematica/litematica.h"
+#include "libs/threads/pool.h"
+#include "libs/cache/cache.h"
+#include "libs/palette/palette.h"
 #include "opencl/gpu.h"
 
 
@@ -48,7 +55,20 @@ static struct option long_options[] = {
         {"maximum-height", required_argument, 0, 'h'},
         {"dithering",      required_argument, 0, 'd'},
         {"verbose",      no_argument, 0, 'v'},
-        {"y0-fix",      no_argument, 0, '0'}
+        {"y0-fix",      no_argument, 0, '0'},
+        {"split-maps",  no_argument, 0, 's'},
+        {"gather",      no_argument, 0, 'g'},
+        {"column-parallel", no_argument, 0, 'c'},
+        {"no-cache",    no_argument, 0, 'C'},
+        {"queues",      required_argument, 0, 'q'},
+        {"all-devices", no_argument, 0, 'a'},
+        {"compile-palette", required_argument, 0, 'P'},
+        {"metric",      required_argument, 0, 'm'},
+        {"preview",     required_argument, 0, 'x'},
+        {"half-lab",    no_argument, 0, 'H'},
+        {"progress-interval", required_argument, 0, 'I'},
+        {"checkpoint",  required_argument, 0, 'k'},
+        {"resume",      no_argument, 0, 'R'}
 };
 
 main_options config = {};
@@ -57,6 +77,7 @@ main_options config = {};
 #define RGBA_SIZE 4
 #define MULTIPLIER_SIZE 3
 #define MAX_PALETTE_SIZE 200
+#define MAP_SIZE 128
 
 //----------------DEFINITIONS---------------
 
@@ -69,7 +90,9 @@ typedef enum {
     Burkes,
     Sierra,
     Sierra2,
-    SierraL
+    SierraL,
+    Bayer,
+    BlueNoise
 } dither_algorithm;
 
 
@@ -79,11 +102,19 @@ void palette_cleanup(mapart_palette *palette);
 
 int load_image(image_data *image);
 
-char * gen_filename(char *prefix, char *extension);
+char * gen_filename(main_options *options, char *prefix, char *extension);
 
-int save_image(mapart_palette *palette, image_data *dither_image);
+int save_image(main_options *options, image_data *rgb_image);
 
-int get_palette(mapart_palette *palette_o);
+int save_map_tiles(main_options *options, mapart_palette *palette, image_data *rgb_image, image_uint_data *mapart_data, mapart_stats *stats, version_numbers versions);
+
+char *read_palette_source(const char *name, size_t *length, int *ret);
+
+int get_palette(mapart_palette *palette_o, const char *palette_str);
+
+int convert_palette(gpu_t *gpu, mapart_palette *palette, mapart_float_palette *lab_palette);
+
+int compile_palette(const char *output);
 
 //-------------IMPLEMENTATIONS---------------------
 
@@ -95,17 +126,231 @@ unsigned int str_hash(const char *word) {
     return hash;
 }
 
+dither_algorithm parse_dithering(const char *name, int *ret) {
+    dither_algorithm dither = none;
+    if (strcmp(name, "none") == 0) {
+        dither = none;
+    } else if ((strcmp(name, "floyd") == 0) ||
+               (strcmp(name, "floyd_steinberg") == 0)) {
+        dither = Floyd_Steinberg;
+    } else if ((strcmp(name, "jjnd") == 0)) {
+        dither = JJND;
+    } else if ((strcmp(name, "stucki") == 0)) {
+        dither = Stucki;
+    } else if ((strcmp(name, "atkinson") == 0)) {
+        dither = Atkinson;
+    } else if ((strcmp(name, "burkes") == 0)) {
+        dither = Burkes;
+    } else if ((strcmp(name, "sierra") == 0)) {
+        dither = Sierra;
+    } else if ((strcmp(name, "sierra2") == 0)) {
+        dither = Sierra2;
+    } else if ((strcmp(name, "sierraL") == 0)) {
+        dither = SierraL;
+    } else if ((strcmp(name, "bayer") == 0)) {
+        dither = Bayer;
+    } else if ((strcmp(name, "bluenoise") == 0) ||
+               (strcmp(name, "blue_noise") == 0)) {
+        dither = BlueNoise;
+    } else {
+        fprintf(stderr, "Not a valid dither algorithm %s", name);
+        *ret = 46;
+    }
+    return dither;
+}
+
+//distance used to match the palette, the values match the METRIC_* constants of dither.cl
+typedef enum {
+    Euclid,
+    OkLCh,
+    CIEDE2000
+} color_metric;
+
+color_metric parse_metric(const char *name, int *ret) {
+    color_metric metric = Euclid;
+    if (strcmp(name, "euclid") == 0) {
+        metric = Euclid;
+    } else if (strcmp(name, "oklch") == 0) {
+        metric = OkLCh;
+    } else if ((strcmp(name, "ciede2000") == 0) ||
+               (strcmp(name, "de2000") == 0)) {
+        metric = CIEDE2000;
+    } else {
+        fprintf(stderr, "Not a valid color metric %s", name);
+        *ret = 47;
+    }
+    return metric;
+}
+
+int parse_height(const char *value) {
+    unsigned int height = atoi(value);
+    if (height != 1)
+        return (int)height;
+    return -1;
+}
+
+//a single (dithering, maximum height, seed) combination of the run
+typedef struct {
+    main_options options;
+    dither_algorithm dither;
+    cache_key dither_key;
+    cache_key height_key;
+    image_uchar_data dithered_image;
+    char dither_cached;
+} pipeline_job;
+
+//data shared by all the combinations
+typedef struct {
+    pipeline_job *jobs;
+    unsigned int job_count;
+    mapart_palette *palette;
+    mapart_float_palette *processed_palette;
+    image_float_data *processed_image;
+    int width;
+    int height;
+    char use_cache;
+    atomic_int ret;
+} pipeline_sweep;
+
+int run_pipeline(pipeline_sweep *sweep, pipeline_job *job);
+
+void run_pipeline_task(void *arg, unsigned int index) {
+    pipeline_sweep *sweep = arg;
+    pipeline_job *job = &sweep->jobs[index];
+
+    //every combination gets its own command queue so they can overlap on the device
+    int ret = gpu_create_queue(&config.gpu, &job->options.gpu);
+    if (ret == 0) {
+        ret = run_pipeline(sweep, job);
+        gpu_release_queue(&job->options.gpu);
+    }
+    if (ret != 0)
+        atomic_store(&sweep->ret, ret);
+}
+
+//a host thread feeding one of the devices through its own queue
+typedef struct {
+    unsigned int device;
+    char active;
+    double expected_end;
+} device_worker;
+
+typedef struct {
+    pipeline_sweep *sweep;
+    gpu_t *devices;
+    device_worker *workers;
+    unsigned int worker_count;
+    double *throughput; // measured pixels per second of each device, 0 until its first job completes
+    unsigned int next_job;
+    pthread_mutex_t lock;
+} device_scheduler;
+
+double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+//true if the other devices would complete all the remaining jobs before this worker completes the next one
+char should_leave_to_others(device_scheduler *scheduler, device_worker *worker, double now, double own_end, double job_pixels) {
+    unsigned int remaining = scheduler->sweep->job_count - scheduler->next_job;
+    double others = 0;
+    for (unsigned int i = 0; i < scheduler->worker_count; i++) {
+        device_worker *other = &scheduler->workers[i];
+        double throughput = scheduler->throughput[other->device];
+        if (other == worker || !other->active || other->device == worker->device || throughput <= 0)
+            continue;
+        others += floor((own_end - MAX(other->expected_end, now)) / (job_pixels / throughput));
+    }
+    return others >= remaining;
+}
+
+void device_worker_task(void *arg, unsigned int index) {
+    device_scheduler *scheduler = arg;
+    device_worker *worker = &scheduler->workers[index];
+    pipeline_sweep *sweep = scheduler->sweep;
+    double job_pixels = (double)sweep->width * sweep->height;
+
+    gpu_t gpu = {};
+    int ret = gpu_create_queue(&scheduler->devices[worker->device], &gpu);
+    char has_queue = ret == 0;
+
+    pthread_mutex_lock(&scheduler->lock);
+    while (ret == 0 && scheduler->next_job < sweep->job_count) {
+        double now = now_seconds();
+        double throughput = scheduler->throughput[worker->device];
+        double own_end = now + (throughput > 0 ? job_pixels / throughput : 0);
+
+        //a device without measurements always takes a job, afterwards slow devices step aside at the tail of the sweep
+        if (throughput > 0 && should_leave_to_others(scheduler, worker, now, own_end, job_pixels))
+            break;
+
+        pipeline_job *job = &sweep->jobs[scheduler->next_job++];
+        worker->expected_end = own_end;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        job->options.gpu = gpu;
+        double start = now_seconds();
+        ret = run_pipeline(sweep, job);
+        double measured = job_pixels / MAX(now_seconds() - start, 1e-6);
+
+        pthread_mutex_lock(&scheduler->lock);
+        //exponential moving average, the first jobs also pay for the driver warm up
+        throughput = scheduler->throughput[worker->device];
+        scheduler->throughput[worker->device] = throughput > 0 ? (0.7 * throughput) + (0.3 * measured) : measured;
+        worker->expected_end = 0;
+    }
+    worker->active = 0;
+    pthread_mutex_unlock(&scheduler->lock);
+
+    if (has_queue)
+        gpu_release_queue(&gpu);
+    if (ret != 0)
+        atomic_store(&sweep->ret, ret);
+}
+
+int run_on_devices(pipeline_sweep *sweep, gpu_t *devices, unsigned int device_count) {
+    device_scheduler scheduler = {sweep, devices};
+    scheduler.worker_count = device_count * config.queues;
+    scheduler.workers = t_calloc(scheduler.worker_count, sizeof(device_worker));
+    scheduler.throughput = t_calloc(device_count, sizeof(double));
+    pthread_mutex_init(&scheduler.lock, NULL);
+
+    for (unsigned int i = 0; i < scheduler.worker_count; i++) {
+        scheduler.workers[i].device = i % device_count;
+        scheduler.workers[i].active = 1;
+    }
+
+    fprintf(stdout, "Running %d combinations on %d devices\n", sweep->job_count, device_count);
+    fflush(stdout);
+
+    pool_run(scheduler.worker_count, scheduler.worker_count, device_worker_task, &scheduler);
+
+    pthread_mutex_destroy(&scheduler.lock);
+    t_free(scheduler.workers);
+    t_free(scheduler.throughput);
+    return atomic_load(&sweep->ret);
+}
+
 int main(int argc, char **argv) {
     config.random_seed = str_hash("seed string");
     config.maximum_height = -1;
+    config.queues = 2;
 
     int ret = 0;
 
     int c;
     opterr = 0;
 
+    //values of the sweep, -d and -h take comma separated lists and -r can be repeated
+    char *dithering_list = NULL;
+    char *height_list = NULL;
+    char **seed_names = NULL;
+    unsigned int seed_count = 0;
+    char *compile_output = NULL;
+
     int option_index = 0;
-    while ((c = getopt_long(argc, argv, ":i:p:d:r:h:n:t:v0", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, ":i:p:d:r:h:n:t:q:P:m:x:I:k:v0sgcCaHR", long_options, &option_index)) != -1) {
         switch (c) {
             case 0:
                 /* If this option set a flag, do nothing else now. */
@@ -122,6 +367,21 @@ int main(int argc, char **argv) {
             case '0':
                 config.fix_y0  = 1;
                 break;
+            case 's':
+                config.split_maps = 1;
+                break;
+            case 'g':
+                config.gather_error = 1;
+                break;
+            case 'c':
+                config.column_height = 1;
+                break;
+            case 'C':
+                config.no_cache = 1;
+                break;
+            case 'a':
+                config.all_devices = 1;
+                break;
             case 'n':
                 config.project_name   = t_strdup(optarg);
                 break;
@@ -135,19 +395,49 @@ int main(int argc, char **argv) {
                 break;
 
             case 'd':
-                config.dithering      = t_strdup(optarg);
+                dithering_list        = t_strdup(optarg);
                 break;
 
             case 'r':
-                config.random_seed    = str_hash(optarg);
+                seed_names = t_realloc(seed_names, (seed_count + 1) * sizeof(char *));
+                seed_names[seed_count++] = t_strdup(optarg);
                 break;
 
-            case 'h': {
-                unsigned int height = atoi(optarg);
-                if (height != 1)
-                    config.maximum_height = height;
+            case 'h':
+                height_list           = t_strdup(optarg);
+                break;
+
+            case 'q':
+                config.queues         = MAX(atoi(optarg), 1);
+                break;
+
+            case 'P':
+                compile_output        = t_strdup(optarg);
+                break;
+
+            case 'm':
+                config.metric         = parse_metric(optarg, &ret);
+                break;
+
+            case 'x':
+                config.preview        = atoi(optarg) > 1 ? atoi(optarg) : 0;
+                break;
+
+            case 'H':
+                config.half_lab       = 1;
+                break;
+
+            case 'I':
+                config.progress_interval = (float)atof(optarg);
+                break;
+
+            case 'k':
+                config.checkpoint_interval = (float)atof(optarg);
+                break;
+
+            case 'R':
+                config.resume         = 1;
                 break;
-            }
 
             case ':':
                 printf("option needs a value\n");
@@ -160,63 +450,217 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (config.project_name == 0 || config.image_filename == 0 || config.palette_name == 0 || config.dithering == 0) {
+    //an option had an invalid value
+    if (ret != 0)
+        return ret;
+
+    //only build the binary palette
+    if (compile_output != NULL && config.palette_name != 0) {
+        ret = compile_palette(compile_output);
+        t_free(compile_output);
+        return ret;
+    }
+
+    if (config.project_name == 0 || config.image_filename == 0 || config.palette_name == 0 || dithering_list == 0) {
+        printf("missing required options\n");
+        return 11;
+    }
+
+    //split the lists of the sweep
+    char *ditherings[100] = {};
+    unsigned int dithering_count = 0;
+    for (char *token = strtok(dithering_list, ","); token != NULL && dithering_count < ARRAY_SIZE(ditherings); token = strtok(NULL, ","))
+        ditherings[dithering_count++] = token;
+
+    int heights[100] = {};
+    unsigned int height_count = 0;
+    if (height_list != NULL) {
+        for (char *token = strtok(height_list, ","); token != NULL && height_count < ARRAY_SIZE(heights); token = strtok(NULL, ","))
+            heights[height_count++] = parse_height(token);
+    }
+    if (height_count == 0)
+        heights[height_count++] = config.maximum_height;
+
+    unsigned int seeds[100] = {};
+    unsigned int seeds_given = seed_count;
+    for (unsigned int i = 0; i < seed_count && i < ARRAY_SIZE(seeds); i++)
+        seeds[i] = str_hash(seed_names[i]);
+    if (seed_count == 0)
+        seeds[seed_count++] = config.random_seed;
+    seed_count = MIN(seed_count, ARRAY_SIZE(seeds));
+
+    if (dithering_count == 0) {
         printf("missing required options\n");
         return 11;
     }
 
-    ret = gpu_init(&config, &config.gpu);
+    config.dithering = ditherings[0];
+    config.maximum_height = heights[0];
+    config.random_seed = seeds[0];
+
+    //the shared stages run on the first device
+    gpu_t *devices = NULL;
+    unsigned int device_count = 0;
+    if (config.all_devices) {
+        ret = gpu_init_all(&config, &devices, &device_count);
+        if (ret == 0)
+            config.gpu = devices[0];
+    } else
+        ret = gpu_init(&config, &config.gpu);
+
+    //one job for every combination
+    unsigned int job_count = dithering_count * height_count * seed_count;
+    pipeline_job *jobs = t_calloc(job_count, sizeof(pipeline_job));
+    char (*seed_labels)[20] = t_calloc(seed_count, sizeof(*seed_labels));
+
+    if (ret == 0) {
+        for (unsigned int d = 0; d < dithering_count && ret == 0; d++) {
+            for (unsigned int h = 0; h < height_count; h++) {
+                for (unsigned int r = 0; r < seed_count; r++) {
+                    pipeline_job *job = &jobs[(d * height_count + h) * seed_count + r];
+                    job->options = config;
+                    job->options.dithering = ditherings[d];
+                    job->options.maximum_height = heights[h];
+                    job->options.random_seed = seeds[r];
+                    //only label the outputs with the seed if there are many of them
+                    if (seeds_given > 1) {
+                        sprintf(seed_labels[r], "_%08x", seeds[r]);
+                        job->options.seed_label = seed_labels[r];
+                    }
+                    job->dither = parse_dithering(ditherings[d], &ret);
+                }
+            }
+        }
+    }else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+
+    if (job_count > 1 && device_count <= 1) {
+        fprintf(stdout, "Sweeping %d combinations on %d queues\n", job_count, MIN(config.queues, job_count));
+        fflush(stdout);
+    }
 
     image_data image = {};
 
     image_int_data int_image = {};
 
-    dither_algorithm dither = none;
-
     mapart_palette palette = {};
 
     image_float_data processed_image = {};
     mapart_float_palette processed_palette = {};
 
+    //load image palette, a compiled palette already holds its OK-L*ab values
+    uint64_t palette_hash = 0;
+    char palette_compiled = 0;
     if (ret == 0) {
-        if (strcmp(config.dithering, "none") == 0) {
-            dither = none;
-        } else if ((strcmp(config.dithering, "floyd") == 0) ||
-                   (strcmp(config.dithering, "floyd_steinberg") == 0)) {
-            dither = Floyd_Steinberg;
-        } else if ((strcmp(config.dithering, "jjnd") == 0)) {
-            dither = JJND;
-        } else if ((strcmp(config.dithering, "stucki") == 0)) {
-            dither = Stucki;
-        } else if ((strcmp(config.dithering, "atkinson") == 0)) {
-            dither = Atkinson;
-        } else if ((strcmp(config.dithering, "burkes") == 0)) {
-            dither = Burkes;
-        } else if ((strcmp(config.dithering, "sierra") == 0)) {
-            dither = Sierra;
-        } else if ((strcmp(config.dithering, "sierra2") == 0)) {
-            dither = Sierra2;
-        } else if ((strcmp(config.dithering, "sierraL") == 0)) {
-            dither = SierraL;
+        if (palette_is_binary(config.palette_name)) {
+            fprintf(stdout, "Loading compiled palette\n");
+            fflush(stdout);
+            palette_compiled = 1;
+            ret = palette_load(config.palette_name, &palette, &processed_palette, MULTIPLIER_SIZE * RGBA_SIZE, &palette_hash);
+            if (ret == 0 && palette.palette_size > MAX_PALETTE_SIZE) {
+                fprintf(stderr, "Palette is too large!!! %d/%d IDs\n", palette.palette_size, MAX_PALETTE_SIZE);
+                fflush(stderr);
+                ret = EXIT_FAILURE;
+            }
         } else {
-            fprintf(stderr, "Not a valid dither algorithm %s", config.dithering);
-            ret = 46;
+            size_t length = 0;
+            char *palette_str = read_palette_source(config.palette_name, &length, &ret);
+            if (ret == 0) {
+                palette_hash = cache_hash(CACHE_KEY_INIT, palette_str, length);
+                ret = get_palette(&palette, palette_str);
+            }
+            if (palette_str != NULL)
+                t_free(palette_str);
         }
     }else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
+    //reuse the stages of a previous run with the same inputs
+    cache_key lab_key = CACHE_KEY_INIT;
+    cache_key palette_key = CACHE_KEY_INIT;
+    char use_cache = 0;
+    char lab_cached = 0;
+    char all_dithered = 0;
+
+    if (ret == 0 && !config.no_cache) {
+        int hash_ret = 0;
+        //the OK-L*ab image depends only on the image ( and on the conversion code )
+        unsigned int salt = CACHE_SALT;
+        lab_key = cache_hash(lab_key, PROGRAM_NAME, strlen(PROGRAM_NAME));
+        lab_key = cache_hash(lab_key, &salt, sizeof(salt));
+        lab_key = gpu_hash_program_source(lab_key, 0);
+        lab_key = cache_hash_file(lab_key, config.image_filename, &hash_ret);
+        //the half precision image is a different entry, the full precision key stays the same
+        if (config.half_lab)
+            lab_key = cache_hash(lab_key, &config.half_lab, sizeof(config.half_lab));
+
+        //the dithering adds the palette and its own settings, a compiled palette shares the key of its json
+        palette_key = cache_hash(lab_key, &palette_hash, sizeof(palette_hash));
+        palette_key = gpu_hash_program_source(palette_key, 2);
+
+        for (unsigned int i = 0; i < job_count; i++) {
+            main_options *options = &jobs[i].options;
+            cache_key dither_key = cache_hash(palette_key, options->dithering, strlen(options->dithering));
+            dither_key = cache_hash(dither_key, &options->random_seed, sizeof(options->random_seed));
+            dither_key = cache_hash(dither_key, &options->maximum_height, sizeof(options->maximum_height));
+            dither_key = cache_hash(dither_key, &options->gather_error, sizeof(options->gather_error));
+            dither_key = cache_hash(dither_key, &options->metric, sizeof(options->metric));
+            //keep the keys of the full runs unchanged
+            if (options->preview)
+                dither_key = cache_hash(dither_key, &options->preview, sizeof(options->preview));
+            jobs[i].dither_key = dither_key;
+
+            //the heights depend only on the dithered image
+            jobs[i].height_key = cache_hash(dither_key, "height", strlen("height"));
+            jobs[i].height_key = gpu_hash_program_source(jobs[i].height_key, 1);
+        }
+
+        use_cache = hash_ret == 0;
+    }
+
+    if (!use_cache && (config.checkpoint_interval > 0 || config.resume))
+        fprintf(stderr, "Checkpoints are stored in the cache, ignoring them\n");
+
+    //look for the latest stage first
+    if (use_cache) {
+        all_dithered = 1;
+        for (unsigned int i = 0; i < job_count; i++) {
+            jobs[i].dither_cached = cache_load("dither", jobs[i].dither_key, &jobs[i].dithered_image, sizeof(unsigned char)) == 0;
+            all_dithered &= jobs[i].dither_cached;
+        }
+
+        if (!all_dithered)
+            lab_cached = cache_load("lab", lab_key, &processed_image, GPU_LAB_SIZE(&config.gpu)) == 0;
+
+        if (all_dithered)
+            fprintf(stdout, "Resuming from cached dithering\n");
+        else if (lab_cached)
+            fprintf(stdout, "Resuming from cached OK-L*ab image\n");
+        fflush(stdout);
+    }
 
     if (ret == 0) {
-        ret = load_image(&image);
+        if (all_dithered) {
+            image.width = jobs[0].dithered_image.width;
+            image.height = jobs[0].dithered_image.height;
+            image.channels = 4;
+        } else if (lab_cached) {
+            image.width = processed_image.width;
+            image.height = processed_image.height;
+            image.channels = processed_image.channels;
+        } else
+            ret = load_image(&image);
     }else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
     //if everything is ok
-    if (ret == 0) {
+    if (ret == 0 && image.image_data != NULL) {
         //convert to int array for GPU compatibility
         int_image.image_data = t_calloc((size_t)image.width * image.height * image.channels, sizeof(int));
         int_image.width = image.width;
@@ -226,20 +670,18 @@ int main(int argc, char **argv) {
         for (size_t i = 0; i < ((size_t)image.width * image.height * image.channels); i++) {
             ((int*)int_image.image_data)[i] = ((unsigned char*)image.image_data)[i];
         }
+    }
 
-        //load image palette
-        ret = get_palette(&palette);
-
-    }else{
+    if (ret != 0) {
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
     //if we're still fine
-    if (ret == 0) {
+    if (ret == 0 && !lab_cached && !all_dithered) {
         //convert image to CIE-L*ab values + alpha
         image_float_data *Lab_image = &processed_image;
-        Lab_image->image_data = t_calloc((size_t)image.width * image.height * image.channels, sizeof(float));
+        Lab_image->image_data = t_calloc((size_t)image.width * image.height * image.channels, GPU_LAB_SIZE(&config.gpu));
         Lab_image->width = image.width;
         Lab_image->height = image.height;
         Lab_image->channels = image.channels;
@@ -253,171 +695,351 @@ int main(int argc, char **argv) {
         if (ret == 0) {
             fprintf(stdout, "Converting image to OK-L*ab\n");
             fflush(stdout);
-            ret = gpu_rgb_to_ok(&config.gpu, composite_data, Lab_image->image_data, image.width, image.height);
+            ret = gpu_rgb_to_ok_image(&config.gpu, composite_data, Lab_image->image_data, image.width, image.height);
         }
         t_free(composite_data);
 
         image_cleanup(&int_image);
 
-        //convert palette to CIE-L*ab + alpha
-        if (ret == 0) {
-            mapart_float_palette *Lab_palette = &processed_palette;
-            Lab_palette->palette_size = palette.palette_size;
-            Lab_palette->palette_id_names = palette.palette_id_names;
-            Lab_palette->palette_block_ids = palette.palette_block_ids;
-            Lab_palette->support_block = palette.support_block;
-            Lab_palette->is_supported = palette.is_supported;
-            Lab_palette->is_usable = palette.is_usable;
-            Lab_palette->is_liquid = palette.is_liquid;
-            Lab_palette->minecraft_data_version = palette.minecraft_data_version;
-            Lab_palette->palette = t_calloc(palette.palette_size * MULTIPLIER_SIZE * RGBA_SIZE, sizeof(float));
-
-            fprintf(stdout, "Converting palette to OK-L*ab\n");
-            fflush(stdout);
-            ret = gpu_rgb_to_ok(&config.gpu,  palette.palette, Lab_palette->palette, MULTIPLIER_SIZE,
-                                palette.palette_size);
-        }
-    }else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
+        if (ret == 0 && use_cache)
+            cache_store("lab", lab_key, Lab_image, GPU_LAB_SIZE(&config.gpu));
     }
 
-    image_uchar_data dithered_image = {
-            NULL,
-            image.width,
-            image.height,
-            2
-    };
-    //do dithering
-    if (ret == 0) {
-        fprintf(stdout, "Generate noise image\n");
-        fflush(stdout);
-        float *noise = t_calloc((size_t)image.width * image.height, sizeof(float));
-
-        //if the image is smaller or equal to the worse case staircase
-        //compute as if there was no limit ( no random height drops )
-        if (config.maximum_height >= image.height) {
-            // fill the buffer with values outside the comparator function range
-            for (size_t i = 0; i < image.width * image.height; i++)
-                noise[i] = FLT_MAX;
-        }else{
-            // initialize the random
-            srand(config.random_seed);
-            // generate a random [0,1] value for each index
-            for (size_t i = 0; i < image.width * image.height; i++)
-                noise[i] = (float) rand() / (float) RAND_MAX;
-        }
+    //the preview dithers a smaller copy of the OK-L*ab image
+    if (ret == 0 && config.preview && !all_dithered) {
+        image_float_data preview_image = {};
+        preview_image.width = (processed_image.width + (int)config.preview - 1) / (int)config.preview;
+        preview_image.height = (processed_image.height + (int)config.preview - 1) / (int)config.preview;
+        preview_image.channels = processed_image.channels;
+        preview_image.image_data = t_calloc((size_t)preview_image.width * preview_image.height * preview_image.channels, GPU_LAB_SIZE(&config.gpu));
 
-        fprintf(stdout, "Do image dithering\n");
+        fprintf(stdout, "Downsampling image for the preview\n");
         fflush(stdout);
+        ret = gpu_downsample(&config.gpu, processed_image.image_data, preview_image.image_data, processed_image.width, processed_image.height, config.preview);
 
-        dither_function dither_func = &gpu_dither_none;
-
-        if (dither == Floyd_Steinberg) {
-            dither_func = &gpu_dither_floyd_steinberg;
-        } else if (dither == JJND) {
-            dither_func = &gpu_dither_JJND;
-        } else if (dither == Stucki) {
-            dither_func = &gpu_dither_Stucki;
-        } else if (dither == Atkinson) {
-            dither_func = &gpu_dither_Atkinson;
-        } else if (dither == Burkes) {
-            dither_func = &gpu_dither_Burkes;
-        } else if (dither == Sierra) {
-            dither_func = &gpu_dither_Sierra;
-        } else if (dither == Sierra2) {
-            dither_func = &gpu_dither_Sierra2;
-        } else if (dither == SierraL) {
-            dither_func = &gpu_dither_SierraL;
-        }
-
-        dithered_image.image_data = t_calloc((size_t)image.width * image.height * 2, sizeof(unsigned char));
-        ret = dither_func(&config.gpu, processed_image.image_data, dithered_image.image_data, processed_palette.palette, processed_palette.is_usable, processed_palette.is_liquid, noise, image.width, image.height, palette.palette_size, config.maximum_height);
+        image_cleanup(&processed_image);
+        processed_image = preview_image;
+        image.width = preview_image.width;
+        image.height = preview_image.height;
+    }
 
-        t_free(noise);
+    //convert palette to CIE-L*ab + alpha
+    if (ret == 0) {
+        if (!palette_compiled)
+            ret = convert_palette(&config.gpu, &palette, &processed_palette);
     }else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-    //save result
+    //run all the combinations on the shared image and palette
     if (ret == 0) {
-        ret = save_image(&palette, &dithered_image);
+        pipeline_sweep sweep = {jobs, job_count, &palette, &processed_palette, &processed_image, image.width, image.height, use_cache};
+        atomic_init(&sweep.ret, 0);
+
+        if (job_count == 1 && device_count <= 1) {
+            ret = run_pipeline(&sweep, &jobs[0]);
+        } else {
+            // compute the nbt crc table before the workers race to build it
+            nbt__make_crc_table();
+
+            if (device_count > 1) {
+                ret = run_on_devices(&sweep, devices, device_count);
+            } else {
+                pool_run(job_count, MIN(config.queues, job_count), run_pipeline_task, &sweep);
+                ret = atomic_load(&sweep.ret);
+            }
+        }
     }else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-    //convert from palette to block and height
-    image_uint_data mapart_data = {
-            t_calloc((size_t)image.width * (image.height + 1) * 3,
-                     sizeof (unsigned int)),
-                     image.width,
-                     image.height + 1,
-                     3};
-    unsigned int computed_max_height = 0;
-    if (ret == 0) {
+    palette_cleanup(&processed_palette);
+    palette_cleanup(&palette);
+
+    image_cleanup(&processed_image);
+    image_cleanup(&image);
+
+    for (unsigned int i = 0; i < job_count; i++)
+        image_cleanup(&jobs[i].dithered_image);
+    t_free(jobs);
+    t_free(seed_labels);
+    for (unsigned int i = 0; i < seeds_given; i++)
+        t_free(seed_names[i]);
+    if (seed_names != NULL)
+        t_free(seed_names);
+    t_free(dithering_list);
+    if (height_list != NULL)
+        t_free(height_list);
+
+    if (devices != NULL) {
+        for (unsigned int i = 0; i < device_count; i++)
+            gpu_clear(&devices[i]);
+        t_free(devices);
+    } else
+        gpu_clear(&config.gpu);
+    return ret;
+}
+
+//the data handed between the stages of a single combination
+typedef struct {
+    pipeline_sweep *sweep;
+    pipeline_job *job;
+    gpu_t image_gpu;
+    image_uchar_data dithered_image;
+    image_data rgb_image;
+    image_uint_data mapart_data;
+    char height_cached;
+    unsigned int computed_max_height;
+    uint64_t *count_by_layer_id;
+    uint64_t *count_by_layer;
+    uint64_t *count_by_id;
+    mapart_stats stats;
+    mapart_stats tile_stats;
+    version_numbers versions;
+} pipeline_state;
+
+//stages of a combination, in dependency order
+enum {
+    STAGE_DITHER,
+    STAGE_STORE_DITHER,
+    STAGE_TO_RGB,
+    STAGE_SAVE_IMAGE,
+    STAGE_HEIGHT,
+    STAGE_STORE_HEIGHT,
+    STAGE_STATS,
+    STAGE_LITEMATICA,
+    STAGE_TILES,
+    STAGE_COUNT
+};
+
+#define STAGE_BIT(stage) (1ULL << (stage))
+
+int stage_dither(void *arg) {
+    pipeline_state *state = arg;
+    pipeline_sweep *sweep = state->sweep;
+    pipeline_job *job = state->job;
+    main_options *options = &job->options;
+    mapart_palette *palette = sweep->palette;
+    mapart_float_palette *processed_palette = sweep->processed_palette;
+    int ret = 0;
+
+    if (job->dither_cached) {
+        if (sweep->use_cache && !options->preview) {
+            state->height_cached = cache_load("height", job->height_key, &state->mapart_data, sizeof(unsigned int)) == 0;
+            if (state->height_cached) {
+                fprintf(stdout, "Resuming from cached heights\n");
+                fflush(stdout);
+            }
+        }
+        return ret;
+    }
+
+    fprintf(stdout, "Do image dithering\n");
+    fflush(stdout);
+
+    dither_function dither_func = &gpu_dither_none;
+
+    if (job->dither == Floyd_Steinberg) {
+        dither_func = &gpu_dither_floyd_steinberg;
+    } else if (job->dither == JJND) {
+        dither_func = &gpu_dither_JJND;
+    } else if (job->dither == Stucki) {
+        dither_func = &gpu_dither_Stucki;
+    } else if (job->dither == Atkinson) {
+        dither_func = &gpu_dither_Atkinson;
+    } else if (job->dither == Burkes) {
+        dither_func = &gpu_dither_Burkes;
+    } else if (job->dither == Sierra) {
+        dither_func = &gpu_dither_Sierra;
+    } else if (job->dither == Sierra2) {
+        dither_func = &gpu_dither_Sierra2;
+    } else if (job->dither == SierraL) {
+        dither_func = &gpu_dither_SierraL;
+    } else if (job->dither == Bayer) {
+        dither_func = &gpu_dither_bayer;
+    } else if (job->dither == BlueNoise) {
+        dither_func = &gpu_dither_blue_noise;
+    }
+
+    //the checkpoints are named after the cache key of the dithering
+    options->gpu.checkpoint_key = sweep->use_cache ? job->dither_key : 0;
+
+    image_uchar_data *dithered_image = &state->dithered_image;
+    dithered_image->width = sweep->width;
+    dithered_image->height = sweep->height;
+    dithered_image->channels = 2;
+    dithered_image->image_data = t_calloc((size_t)sweep->width * sweep->height * 2, sizeof(unsigned char));
+    ret = dither_func(&options->gpu, sweep->processed_image->image_data, dithered_image->image_data, processed_palette->palette, processed_palette->is_usable, processed_palette->is_liquid, options->random_seed, sweep->width, sweep->height, palette->palette_size, options->maximum_height);
+
+    return ret;
+}
+
+int stage_store_dither(void *arg) {
+    pipeline_state *state = arg;
+    if (!state->job->dither_cached && state->sweep->use_cache)
+        cache_store("dither", state->job->dither_key, &state->dithered_image, sizeof(unsigned char));
+    return 0;
+}
+
+int stage_to_rgb(void *arg) {
+    pipeline_state *state = arg;
+    mapart_palette *palette = state->sweep->palette;
+    image_uchar_data *dithered_image = &state->dithered_image;
+    image_data *rgb_image = &state->rgb_image;
+
+    rgb_image->width = dithered_image->width;
+    rgb_image->height = dithered_image->height;
+    rgb_image->channels = 4;
+    rgb_image->image_data = t_calloc((size_t)dithered_image->width * dithered_image->height * 4, sizeof(unsigned char));
+
+    fprintf(stdout, "Convert dithered image back to rgb\n");
+    fflush(stdout);
+
+    //runs on its own queue so the device can overlap it with the height pass
+    return gpu_palette_to_rgb(&state->image_gpu, dithered_image->image_data, palette->palette,
+                              rgb_image->image_data, dithered_image->width, dithered_image->height, palette->palette_size, MULTIPLIER_SIZE);
+}
+
+int stage_save_image(void *arg) {
+    pipeline_state *state = arg;
+    return save_image(&state->job->options, &state->rgb_image);
+}
+
+int stage_height(void *arg) {
+    pipeline_state *state = arg;
+    pipeline_sweep *sweep = state->sweep;
+    main_options *options = &state->job->options;
+    mapart_palette *palette = sweep->palette;
+    image_uint_data *mapart_data = &state->mapart_data;
+    int ret = 0;
+
+    if (state->height_cached) {
+        //the stats are not cached, they are counted again by the stats stage
+        for (size_t i = 0; i < (size_t)mapart_data->width * mapart_data->height; i++)
+            state->computed_max_height = MAX(state->computed_max_height, ((unsigned int *)mapart_data->image_data)[(i * 3) + 2]);
+    } else {
+        mapart_data->image_data = t_calloc((size_t)sweep->width * (sweep->height + 1) * 3, sizeof (unsigned int));
+        mapart_data->width = sweep->width;
+        mapart_data->height = sweep->height + 1;
+        mapart_data->channels = 3;
+
         fprintf(stdout, "Convert from palette to BlockId and height\n");
         fflush(stdout);
-        ret = gpu_palette_to_height(&config.gpu, dithered_image.image_data, palette.is_liquid, mapart_data.image_data, palette.palette_size, image.width, image.height, config.maximum_height, &computed_max_height);
-    }else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
+        ret = gpu_palette_to_height(&options->gpu, state->dithered_image.image_data, palette->is_liquid, mapart_data->image_data, palette->palette_size, sweep->width, sweep->height, options->maximum_height, &state->computed_max_height, &state->count_by_layer_id);
     }
 
     if (ret == 0){
-        fprintf(stdout, "Computed max height is: %d\n", computed_max_height);
+        fprintf(stdout, "Computed max height is: %d\n", state->computed_max_height);
         fflush(stdout);
-    }else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
+    }
+    return ret;
+}
+
+int stage_store_height(void *arg) {
+    pipeline_state *state = arg;
+    if (!state->height_cached && state->sweep->use_cache)
+        cache_store("height", state->job->height_key, &state->mapart_data, sizeof(unsigned int));
+    return 0;
+}
+
+int stage_stats(void *arg) {
+    pipeline_state *state = arg;
+    image_uint_data *mapart_data = &state->mapart_data;
+    unsigned int computed_max_height = state->computed_max_height;
+    int ret = 0;
+
+    //the stats are counted by the height pass, the heights loaded from the cache are counted here
+    if (state->height_cached){
+        state->count_by_id = t_calloc(UCHAR_MAX + 1, sizeof (uint64_t));
+        state->count_by_layer = t_calloc(computed_max_height + 1, sizeof (uint64_t));
+        state->count_by_layer_id = t_calloc(( computed_max_height + 1 )  * ( UCHAR_MAX + 1 ), sizeof (uint64_t));
+        fprintf(stdout, "Generating Stats from converted image\n");
+        fflush(stdout);
+        ret = gpu_height_to_stats(&state->job->options.gpu, mapart_data->image_data, state->count_by_layer, state->count_by_layer_id, state->count_by_id, mapart_data->width, mapart_data->height, computed_max_height);
     }
 
-    unsigned int* count_by_layer = NULL;
-    unsigned int* count_by_layer_id = NULL;
-    unsigned int* count_by_id = NULL;
+    state->stats.x_length = mapart_data->width;
+    state->stats.z_length = mapart_data->height;
+    state->stats.y_length = computed_max_height + 1;
+    state->stats.layer_id_count = state->count_by_layer_id;
+    state->versions.litematica = 6;
+    state->versions.mc_data = state->sweep->palette->minecraft_data_version;
+    //the full litematic updates the stats so keep a copy for the tiles
+    state->tile_stats = state->stats;
+    return ret;
+}
 
-    count_by_id = t_calloc(UCHAR_MAX + 1, sizeof (unsigned int));
-    count_by_layer = t_calloc(computed_max_height + 1, sizeof (unsigned int));
-    count_by_layer_id = t_calloc(( computed_max_height + 1 )  * ( UCHAR_MAX + 1 ), sizeof (unsigned int));
-    fprintf(stdout, "Generating Stats from converted image\n");
-    fflush(stdout);
-    ret = gpu_height_to_stats(&config.gpu, mapart_data.image_data, count_by_layer, count_by_layer_id, count_by_id, mapart_data.width, mapart_data.height, computed_max_height);
+int stage_litematica(void *arg) {
+    pipeline_state *state = arg;
+    main_options *options = &state->job->options;
+    char * folder = "litematica/";
+    MKDIR(folder);
+    char * filename = gen_filename(options, folder ,"");
 
-    if (ret == 0){
-        mapart_stats stats = {};
-        stats.x_length = mapart_data.width;
-        stats.z_length = mapart_data.height;
-        stats.y_length = computed_max_height + 1;
-        stats.layer_id_count = count_by_layer_id;
-        version_numbers versions = {};
-        versions.litematica = 6;
-        versions.mc_data = palette.minecraft_data_version;
-        char * folder = "litematica/";
-        MKDIR(folder);
-        char * filename = gen_filename(folder ,"");
-
-        //TODO: add config.fix_y0 boolean to litematica function parameters
-        //TODO: add debug lines toggled with config.verbose to litematica code
-        litematica_create(PROGRAM_NAME, config, filename, &stats, versions, &palette, &mapart_data);
-    }else{
+    //TODO: add config.fix_y0 boolean to litematica function parameters
+    //TODO: add debug lines toggled with config.verbose to litematica code
+    litematica_create(PROGRAM_NAME, *options, filename, &state->stats, state->versions, state->sweep->palette, &state->mapart_data);
+    t_free(filename);
+    return 0;
+}
+
+int stage_tiles(void *arg) {
+    pipeline_state *state = arg;
+    main_options *options = &state->job->options;
+    if (!options->split_maps)
+        return 0;
+    return save_map_tiles(options, state->sweep->palette, &state->rgb_image, &state->mapart_data, &state->tile_stats, state->versions);
+}
+
+int run_pipeline(pipeline_sweep *sweep, pipeline_job *job) {
+    pipeline_state state = {sweep, job};
+    state.dithered_image = job->dithered_image;
+
+    pool_graph_node graph[STAGE_COUNT] = {
+            [STAGE_DITHER]       = {stage_dither, 0},
+            [STAGE_STORE_DITHER] = {stage_store_dither, STAGE_BIT(STAGE_DITHER)},
+            [STAGE_TO_RGB]       = {stage_to_rgb, STAGE_BIT(STAGE_DITHER)},
+            [STAGE_SAVE_IMAGE]   = {stage_save_image, STAGE_BIT(STAGE_TO_RGB)},
+            [STAGE_HEIGHT]       = {stage_height, STAGE_BIT(STAGE_DITHER)},
+            [STAGE_STORE_HEIGHT] = {stage_store_height, STAGE_BIT(STAGE_HEIGHT)},
+            [STAGE_STATS]        = {stage_stats, STAGE_BIT(STAGE_HEIGHT)},
+            [STAGE_LITEMATICA]   = {stage_litematica, STAGE_BIT(STAGE_STATS)},
+            [STAGE_TILES]        = {stage_tiles, STAGE_BIT(STAGE_STATS) | STAGE_BIT(STAGE_TO_RGB)},
+    };
+
+    //the preview stops at the image, the stages are in dependency order so it is a prefix of the graph
+    unsigned int stage_count = job->options.preview ? STAGE_SAVE_IMAGE + 1 : STAGE_COUNT;
+
+    int ret = gpu_create_queue(&job->options.gpu, &state.image_gpu);
+
+    // compute the nbt crc table before the litematic and the tiles race to build it
+    if (ret == 0 && !job->options.preview && !nbt__crc_table_computed)
+        nbt__make_crc_table();
+
+    if (ret == 0) {
+        ret = pool_graph_run(graph, stage_count, 0, &state);
+        gpu_release_queue(&state.image_gpu);
+    }
+
+    if (ret != 0){
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-    palette_cleanup(&processed_palette);
-    palette_cleanup(&palette);
-
-    image_cleanup(&processed_image);
-    image_cleanup(&mapart_data);
-    image_cleanup(&image);
-    image_cleanup(&dithered_image);
+    image_cleanup(&state.mapart_data);
+    image_cleanup(&state.rgb_image);
+    //the cached dithering is owned by the job
+    if (!job->dither_cached)
+        image_cleanup(&state.dithered_image);
 
-    t_free(count_by_id);
-    t_free(count_by_layer_id);
-    t_free(count_by_layer);
+    if (state.count_by_id != NULL)
+        t_free(state.count_by_id);
+    t_free(state.count_by_layer_id);
+    if (state.count_by_layer != NULL)
+        t_free(state.count_by_layer);
 
-    gpu_clear(&config.gpu);
     return ret;
 }
 
@@ -439,76 +1061,176 @@ int load_image(image_data *image) {
     }
 }
 
-char * gen_filename(char *prefix, char *extension){
+char * gen_filename(main_options *options, char *prefix, char *extension){
     char filename[1000] = {};
     char *appendix = "";
+    char smallbuff[20] = {};
 
-    if (config.maximum_height == 0)
+    if (options->maximum_height == 0)
         appendix = "_flat";
-    else if (config.maximum_height < 0)
+    else if (options->maximum_height < 0)
         appendix = "_unlimited";
     else {
-        char smallbuff[20] = {};
-        sprintf(smallbuff, "_%d", config.maximum_height);
+        sprintf(smallbuff, "_%d", options->maximum_height);
         appendix = smallbuff;
     }
 
-    sprintf(filename, "%s%s_%s%s%s", prefix, config.project_name, config.dithering, appendix, extension);
+    sprintf(filename, "%s%s_%s%s%s%s%s", prefix, options->project_name, options->dithering, appendix,
+            options->seed_label != NULL ? options->seed_label : "", options->preview ? "_preview" : "", extension);
     return t_strdup(filename);
 }
 
-int save_image(mapart_palette *palette, image_data *dither_image) {
+int save_image(main_options *options, image_data *rgb_image) {
     int ret = 0;
-    image_data converted_image = {NULL, dither_image->width, dither_image->height, 4};
-
-    converted_image.image_data = t_calloc((size_t)dither_image->width * dither_image->height * 4, sizeof(unsigned char));
-
-    fprintf(stdout, "Convert dithered image back to rgb\n");
-    fflush(stdout);
-
-    ret = gpu_palette_to_rgb(&config.gpu, dither_image->image_data, palette->palette,
-                             converted_image.image_data, dither_image->width, dither_image->height, palette->palette_size, MULTIPLIER_SIZE);
     char * folder = "images/";
     MKDIR(folder);
-    char * filename = gen_filename(folder, ".png");
+    char * filename = gen_filename(options, folder, ".png");
+    fprintf(stdout, "Save image\n");
+    fflush(stdout);
+    ret = stbi_write_png(filename, rgb_image->width, rgb_image->height, rgb_image->channels,
+                         rgb_image->image_data, 0);
     if (ret == 0) {
-        fprintf(stdout, "Save image\n");
+        fprintf(stderr, "Failed to save image %s:\n%s\n", filename, stbi_failure_reason());
+        ret = 13;
+    } else {
+        fprintf(stdout, "Image saved: %s\n", filename);
         fflush(stdout);
-        ret = stbi_write_png(filename, converted_image.width, converted_image.height, converted_image.channels,
-                             converted_image.image_data, 0);
-        if (ret == 0) {
-            fprintf(stderr, "Failed to save image %s:\n%s\n", filename, stbi_failure_reason());
-            ret = 13;
-        } else {
-            fprintf(stdout, "Image saved: %s\n", filename);
-            fflush(stdout);
-            ret = 0;
-        }
+        ret = 0;
     }
     t_free(filename);
-
-    t_free(converted_image.image_data);
     return ret;
 }
 
+typedef struct {
+    main_options *options;
+    mapart_palette *palette;
+    image_data *rgb_image;
+    image_uint_data *mapart_data;
+    mapart_stats *stats;
+    version_numbers versions;
+    unsigned int maps_x;
+    atomic_int ret;
+} map_tiles_job;
+
+void save_map_tile(void *arg, unsigned int index) {
+    map_tiles_job *job = arg;
+    int map_x = (int)(index % job->maps_x);
+    int map_z = (int)(index / job->maps_x);
+
+    // the window of the map inside the image ( the litematica 'header' row is the one just above it )
+    mapart_window window = {
+            map_x * MAP_SIZE,
+            map_z * MAP_SIZE,
+            MIN(MAP_SIZE, job->rgb_image->width - map_x * MAP_SIZE),
+            MIN(MAP_SIZE, job->rgb_image->height - map_z * MAP_SIZE)
+    };
+
+    char suffix[100] = {};
+
+    // the png is written straight out of the full image using its row stride
+    sprintf(suffix, "_map_%d_%d.png", map_z + 1, map_x + 1);
+    char * filename = gen_filename(job->options, "images/", suffix);
+    size_t stride = (size_t)job->rgb_image->width * job->rgb_image->channels;
+    unsigned char *tile_start = (unsigned char *)job->rgb_image->image_data + (size_t)window.z * stride + (size_t)window.x * job->rgb_image->channels;
+    if (stbi_write_png(filename, window.width, window.height, job->rgb_image->channels, tile_start, (int)stride) == 0) {
+        fprintf(stderr, "Failed to save image %s:\n%s\n", filename, stbi_failure_reason());
+        fflush(stderr);
+        atomic_store(&job->ret, 13);
+    }
+    t_free(filename);
+
+    sprintf(suffix, "_map_%d_%d", map_z + 1, map_x + 1);
+    filename = gen_filename(job->options, "litematica/", suffix);
+    mapart_stats stats = *job->stats;
+    stats.x_length = window.width;
+    stats.z_length = window.height + 1;
+    litematica_create_window(PROGRAM_NAME, *job->options, filename, &stats, job->versions, job->palette, job->mapart_data, window);
+    t_free(filename);
+}
+
+int save_map_tiles(main_options *options, mapart_palette *palette, image_data *rgb_image, image_uint_data *mapart_data, mapart_stats *stats, version_numbers versions) {
+    unsigned int maps_x = (rgb_image->width + MAP_SIZE - 1) / MAP_SIZE;
+    unsigned int maps_z = (rgb_image->height + MAP_SIZE - 1) / MAP_SIZE;
+
+    fprintf(stdout, "Saving %d maps separately\n", maps_x * maps_z);
+    fflush(stdout);
+
+    map_tiles_job job = {options, palette, rgb_image, mapart_data, stats, versions, maps_x};
+    atomic_init(&job.ret, 0);
+
+    // compute the nbt crc table before the workers race to build it
+    if (!nbt__crc_table_computed)
+        nbt__make_crc_table();
+
+    pool_run(maps_x * maps_z, 0, save_map_tile, &job);
+
+    return atomic_load(&job.ret);
+}
+
 #include "libs/json/cJSON.h"
 
-int get_palette(mapart_palette *palette_o) {
-    int ret = 0;
+//the palettes bundled in the executable, selected with "builtin:<name>"
+typedef struct {
+    const char *name;
+    const char *start;
+    const char *end;
+} builtin_palette;
+
+char *read_palette_source(const char *name, size_t *length, int *ret) {
+    extern char palette_all_start[] asm("_binary_resources_palette_palette_all_json_start");
+    extern char palette_all_end[] asm("_binary_resources_palette_palette_all_json_end");
+    extern char palette_bw_start[] asm("_binary_resources_palette_palette_bw_json_start");
+    extern char palette_bw_end[] asm("_binary_resources_palette_palette_bw_json_end");
+    extern char palette_gray_start[] asm("_binary_resources_palette_palette_gray_json_start");
+    extern char palette_gray_end[] asm("_binary_resources_palette_palette_gray_json_end");
+    extern char palette_skyblock_start[] asm("_binary_resources_palette_palette_skyblock_json_start");
+    extern char palette_skyblock_end[] asm("_binary_resources_palette_palette_skyblock_json_end");
+
+    builtin_palette builtins[] = {
+            {"all",      palette_all_start,      palette_all_end},
+            {"bw",       palette_bw_start,       palette_bw_end},
+            {"gray",     palette_gray_start,     palette_gray_end},
+            {"skyblock", palette_skyblock_start, palette_skyblock_end},
+    };
 
     printf("Loading palette\n");
 
-    FILE *palette_f = fopen(config.palette_name, "r");
+    char *palette_str = NULL;
+    *ret = 0;
+    if (strncmp(name, "builtin:", strlen("builtin:")) == 0) {
+        const char *builtin_name = name + strlen("builtin:");
+        for (int i = 0; i < ARRAY_SIZE(builtins) && palette_str == NULL; i++) {
+            if (strcmp(builtins[i].name, builtin_name) == 0) {
+                *length = builtins[i].end - builtins[i].start;
+                palette_str = t_calloc(*length + 1, sizeof (char));
+                memcpy(palette_str, builtins[i].start, *length);
+            }
+        }
+        if (palette_str == NULL) {
+            fprintf(stderr, "Unknown builtin palette %s\n", builtin_name);
+            *ret = 100;
+        }
+        return palette_str;
+    }
+
+    FILE *palette_f = fopen(name, "r");
     if (!palette_f){
-        fprintf(stderr, "Error Opening palette file %s: %s\n", config.palette_name, strerror(errno));
-        return 100;
+        fprintf(stderr, "Error Opening palette file %s: %s\n", name, strerror(errno));
+        *ret = 100;
+        return NULL;
     }
     fseek(palette_f,0,SEEK_END);
-    size_t lenght = ftell(palette_f);
-    char* palette_str = t_calloc(lenght, sizeof (char));
+    *length = ftell(palette_f);
+    //keep a terminator for the parser
+    palette_str = t_calloc(*length + 1, sizeof (char));
     rewind(palette_f);
-    (void)!fread(palette_str, sizeof (char), lenght, palette_f);
+    *length = fread(palette_str, sizeof (char), *length, palette_f);
     fclose(palette_f);
+    return palette_str;
+}
+
+int get_palette(mapart_palette *palette_o, const char *palette_str) {
+    int ret = 0;
 
     cJSON_Hooks hooks = {
             t_malloc,
@@ -518,8 +1240,6 @@ int get_palette(mapart_palette *palette_o) {
     cJSON_InitHooks(&hooks);
     cJSON *palette_json = cJSON_Parse(palette_str);
 
-    t_free(palette_str);
-
     if (palette_json == NULL)
     {
         const char *error_ptr = cJSON_GetErrorPtr();
@@ -689,6 +1409,63 @@ int get_palette(mapart_palette *palette_o) {
     return ret;
 }
 
+int convert_palette(gpu_t *gpu, mapart_palette *palette, mapart_float_palette *lab_palette) {
+    lab_palette->palette_size = palette->palette_size;
+    lab_palette->palette_id_names = palette->palette_id_names;
+    lab_palette->palette_block_ids = palette->palette_block_ids;
+    lab_palette->support_block = palette->support_block;
+    lab_palette->is_supported = palette->is_supported;
+    lab_palette->is_usable = palette->is_usable;
+    lab_palette->is_liquid = palette->is_liquid;
+    lab_palette->minecraft_data_version = palette->minecraft_data_version;
+    lab_palette->palette = t_calloc(palette->palette_size * MULTIPLIER_SIZE * RGBA_SIZE, sizeof(float));
+
+    fprintf(stdout, "Converting palette to OK-L*ab\n");
+    fflush(stdout);
+    return gpu_rgb_to_ok(gpu, palette->palette, lab_palette->palette, MULTIPLIER_SIZE, palette->palette_size);
+}
+
+int compile_palette(const char *output) {
+    mapart_palette palette = {};
+    mapart_float_palette lab_palette = {};
+    size_t length = 0;
+    int ret = 0;
+
+    char *palette_str = read_palette_source(config.palette_name, &length, &ret);
+    uint64_t source_hash = 0;
+    if (ret == 0) {
+        source_hash = cache_hash(CACHE_KEY_INIT, palette_str, length);
+        ret = get_palette(&palette, palette_str);
+    }
+    if (palette_str != NULL)
+        t_free(palette_str);
+
+    if (ret == 0) {
+        ret = gpu_init(&config, &config.gpu);
+        if (ret == 0) {
+            ret = convert_palette(&config.gpu, &palette, &lab_palette);
+            gpu_clear(&config.gpu);
+        }
+    }
+
+    if (ret == 0) {
+        fprintf(stdout, "Writing compiled palette %s\n", output);
+        fflush(stdout);
+        ret = palette_compile(output, &palette, &lab_palette, MULTIPLIER_SIZE * RGBA_SIZE, source_hash);
+    }
+
+    if (ret != 0) {
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        fflush(stderr);
+    }
+
+    //the two palettes share everything but the colors
+    if (lab_palette.palette != NULL)
+        t_free(lab_palette.palette);
+    palette_cleanup(&palette);
+    return ret;
+}
+
 void image_cleanup(image_data *image) {
     if (image->image_data != NULL)
         t_free(image->image_data);
@@ -729,5 +1506,7 @@ void palette_cleanup(mapart_palette *palette){
             t_free(palette->palette_block_ids);
             palette->palette_block_ids = NULL;
         }
+
+        palette_unmap(palette);
     }
 }
\ No newline at end of file
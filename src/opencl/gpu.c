@@ -1,7 +1,12 @@
 #include <stdio.h>
 #include <limits.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 #include "gpu.h"
 #include "../libs/alloc/tracked.h"
+#include "../libs/cache/cache.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
@@ -9,99 +14,176 @@
 #define RGBA_SIZE 4
 #define MULTIPLIER_SIZE 3
 
+//sizes of the perceptual metric tables ( must match dither.cl )
+#define METRIC_G_LEVELS 16
+#define METRIC_STRIDE (4 + METRIC_G_LEVELS * 3)
+#define METRIC_LUT_BINS 256
+#define METRIC_LUT_COUNT 7
+
+//staircase diagnostics of the dither kernels ( must match dither.cl )
+#define DIAG_RESTRICTED   0
+#define DIAG_TRANSPARENT  1
+#define DIAG_DROPS        2
+#define DIAG_RETRIES      3
+#define DIAG_RETRY_BINS   4
+#define DIAG_COUNTERS     (DIAG_RETRIES + DIAG_RETRY_BINS)
+#define DIAG_SAMPLE_COUNT DIAG_COUNTERS
+#define DIAG_SAMPLES      16
+#define DIAG_SIZE         (DIAG_SAMPLE_COUNT + 1 + DIAG_SAMPLES * 2)
+
+//host side copy of column_state in mapart.cl
 typedef struct {
-    unsigned int * indexes;
-    unsigned int * diagonals;
-    unsigned int diagonal_count;
-} index_holder;
-
-index_holder generate_indexes(unsigned int width, unsigned int height, unsigned int steepness);
+    cl_int mc_height;
+    cl_uint start_index;
+    cl_int start_padding;
+    cl_uint flat_count;
+    cl_int max_height;
+    cl_uint stair_lifts;
+    cl_uint pad_lifts;
+    cl_int stair_max;
+    cl_int pad_max;
+    cl_uint counted_rows;
+} gpu_column_state;
+
+unsigned int diagonal_count(unsigned int width, unsigned int height, unsigned int steepness);
+
+unsigned int diagonal_length(unsigned int diagonal, unsigned int width, unsigned int height, unsigned int steepness);
 
 cl_program gpu_compile_program(main_options *config, gpu_t *gpu_holder, char *filename, cl_int *ret);
 
-cl_program gpu_compile_embedded_program(main_options *config, gpu_t *gpu_holder, char *filename, char * data, size_t size, cl_int *ret);
+cl_program gpu_compile_embedded_program(main_options *config, gpu_t *gpu_holder, char *filename, char * data, size_t size, const char *build_options, cl_int *ret);
 
-int gpu_init(main_options *config, gpu_t *gpu_holder) {
-    cl_platform_id platform_id[3] = {};
-    cl_device_id device_id[3][10] = {};
-    char platform_names[3][301] = {};
-    char device_names[3][10][301] = {};
-    cl_uint ret_num_devices[3] = {};
-    cl_uint ret_num_platforms = 0;
+//a kernel or buffer owned by the cache, handed out to one caller at a time
+typedef struct {
+    cl_program program;
+    const char *name;
+    cl_kernel kernel;
+    char in_use;
+} gpu_cached_kernel;
 
-    gpu_holder->verbose = config->verbose;
+//a program rebuilt with extra build options, shared by every queue of the context
+typedef struct {
+    int base;
+    char *build_options;
+    cl_program program; // the base program if the variant did not build
+} gpu_cached_variant;
+
+typedef struct {
+    cl_mem_flags flags;
+    size_t capacity;
+    cl_mem buffer;
+    char in_use;
+} gpu_cached_buffer;
+
+struct gpu_object_cache {
+    pthread_mutex_t lock;
+    pthread_mutex_t build_lock;
+    gpu_cached_kernel *kernels;
+    unsigned int kernel_count;
+    gpu_cached_buffer *buffers;
+    unsigned int buffer_count;
+    gpu_cached_variant *variants;
+    unsigned int variant_count;
+};
 
-    unsigned int total_devices = 0;
+gpu_object_cache *gpu_cache_create();
 
-    cl_int ret = clGetPlatformIDs(3, platform_id, &ret_num_platforms);
+void gpu_cache_release(gpu_object_cache *cache);
+
+cl_kernel gpu_acquire_kernel(gpu_t *gpu, int program, const char *name, cl_int *ret);
+
+cl_kernel gpu_acquire_variant_kernel(gpu_t *gpu, int program, const char *build_options, const char *name, cl_int *ret);
+
+void gpu_release_kernel(gpu_t *gpu, cl_kernel kernel);
+
+cl_mem gpu_acquire_buffer(gpu_t *gpu, cl_mem_flags flags, size_t size, void *host_ptr, cl_int *ret);
+
+void gpu_release_buffer(gpu_t *gpu, cl_mem buffer);
+
+//lists the available platforms and devices
+typedef struct {
+    cl_platform_id platform_id[3];
+    cl_device_id device_id[3][10];
+    char platform_names[3][301];
+    char device_names[3][10][301];
+    cl_uint ret_num_devices[3];
+    cl_uint ret_num_platforms;
+    unsigned int total_devices;
+} gpu_device_list;
+
+int gpu_list_devices(gpu_device_list *list) {
+    cl_int ret = clGetPlatformIDs(3, list->platform_id, &list->ret_num_platforms);
     if (ret == CL_SUCCESS) {
-        for (int i = 0; i < ret_num_platforms; i++) {
-            ret = clGetPlatformInfo(platform_id[i], CL_PLATFORM_NAME, sizeof(char) * 300, platform_names[i], NULL);
-            ret = clGetDeviceIDs(platform_id[i], CL_DEVICE_TYPE_ALL, 10,
-                                 device_id[i], &ret_num_devices[i]);
-            for (int j = 0; j < ret_num_devices[i]; j++) {
-                ret = clGetDeviceInfo(device_id[i][j], CL_DEVICE_NAME, sizeof(char) * 300, device_names[i][j],
+        for (int i = 0; i < list->ret_num_platforms; i++) {
+            ret = clGetPlatformInfo(list->platform_id[i], CL_PLATFORM_NAME, sizeof(char) * 300, list->platform_names[i], NULL);
+            ret = clGetDeviceIDs(list->platform_id[i], CL_DEVICE_TYPE_ALL, 10,
+                                 list->device_id[i], &list->ret_num_devices[i]);
+            for (int j = 0; j < list->ret_num_devices[i]; j++) {
+                ret = clGetDeviceInfo(list->device_id[i][j], CL_DEVICE_NAME, sizeof(char) * 300, list->device_names[i][j],
                                       NULL);
             }
-            total_devices += ret_num_devices[i];
+            list->total_devices += list->ret_num_devices[i];
         }
     }else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-
-    int platform_index = -1;
-    int device_index = -1;
-
-    if (total_devices > 0) {
+    if (list->total_devices > 0) {
         fprintf(stdout, "found %d devices on %d platforms: \n",
-                total_devices, ret_num_platforms);
-        for (int i = 0; i < ret_num_platforms; i++) {
-            fprintf(stdout, "\t%s: \n", platform_names[i]);
-            for (int j = 0; j < ret_num_devices[i]; j++) {
-                fprintf(stdout, "\t%2d %2d - %s\n", i, j, device_names[i][j]);
+                list->total_devices, list->ret_num_platforms);
+        for (int i = 0; i < list->ret_num_platforms; i++) {
+            fprintf(stdout, "\t%s: \n", list->platform_names[i]);
+            for (int j = 0; j < list->ret_num_devices[i]; j++) {
+                fprintf(stdout, "\t%2d %2d - %s\n", i, j, list->device_names[i][j]);
             }
         }
-        while (platform_index < 0 || platform_index >= ret_num_platforms || device_index < 0 ||
-               device_index >= ret_num_devices[platform_index]) {
-            fprintf(stdout, "please select a device to use (%%d %%d):\n");
-            fflush(stdout);
-            fflush(stdin);
-            (void)!fscanf(stdin, "%d %d", &platform_index, &device_index);
-        }
-
-        fprintf(stdout, "Selected %s from %s\n", device_names[platform_index][device_index],
-                platform_names[platform_index]);
-        fflush(stdout);
-
-        gpu_holder->platformId = platform_id[platform_index];
-        gpu_holder->deviceId = device_id[platform_index][device_index];
-
-        ret = clGetDeviceInfo(gpu_holder->deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t),
-                              &gpu_holder->max_parallelism, NULL);
     }else{
         fprintf(stderr, "No OpenCL compatible devices found!\n");
         fflush(stderr);
         ret = EXIT_FAILURE;
     }
+    return ret;
+}
+
+//creates the context, the queue and the programs for the device in gpu_holder->deviceId
+int gpu_setup_device(main_options *config, gpu_t *gpu_holder) {
+    gpu_holder->verbose = config->verbose;
+    gpu_holder->gather_error = config->gather_error;
+    gpu_holder->column_height = config->column_height;
+    gpu_holder->metric = config->metric;
+    gpu_holder->half_lab = config->half_lab;
+    gpu_holder->progress_interval = config->progress_interval > 0 ? config->progress_interval : 1.f;
+    gpu_holder->checkpoint_interval = config->checkpoint_interval;
+    gpu_holder->resume = config->resume;
 
-    cl_context context;
+    cl_int ret = clGetDeviceInfo(gpu_holder->deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t),
+                                 &gpu_holder->max_parallelism, NULL);
     if (ret == CL_SUCCESS)
-        context = gpu_holder->context = clCreateContext(NULL, 1, &device_id[platform_index][device_index], NULL, NULL,
-                                                        &ret);
-    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
-    }
+        ret = clGetDeviceInfo(gpu_holder->deviceId, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong),
+                              &gpu_holder->local_memory, NULL);
+    if (ret == CL_SUCCESS)
+        ret = clGetDeviceInfo(gpu_holder->deviceId, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint),
+                              &gpu_holder->compute_units, NULL);
+    if (ret == CL_SUCCESS)
+        ret = clGetDeviceInfo(gpu_holder->deviceId, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong),
+                              &gpu_holder->max_alloc, NULL);
+    cl_ulong global_memory = 0;
+    if (ret == CL_SUCCESS)
+        ret = clGetDeviceInfo(gpu_holder->deviceId, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong),
+                              &global_memory, NULL);
+    //the queues of a sweep share the device, keep half of it for the cached buffers and the driver
+    gpu_holder->memory_budget = global_memory / (2 * MAX(config->queues, 1));
+
+    if (ret == CL_SUCCESS)
+        gpu_holder->context = clCreateContext(NULL, 1, &gpu_holder->deviceId, NULL, NULL, &ret);
+
+    if (ret == CL_SUCCESS)
+        gpu_holder->cache = gpu_cache_create();
 
     //if all is ok
-    if (ret == CL_SUCCESS) {
-        gpu_holder->commandQueue = clCreateCommandQueueWithProperties(context, device_id[platform_index][device_index],NULL, &ret);
-    }else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
-    }
+    if (ret == CL_SUCCESS)
+        gpu_holder->commandQueue = clCreateCommandQueueWithProperties(gpu_holder->context, gpu_holder->deviceId, NULL, &ret);
 
     //compile programs
     if (ret == CL_SUCCESS) {
@@ -113,14 +195,11 @@ int gpu_init(main_options *config, gpu_t *gpu_holder) {
         gpu_program program = {
                 "color_conversion",
                 gpu_compile_embedded_program(config, gpu_holder, "resources/opencl/color_conversions.cl",
-                                             color_cl_start, file_size, &ret)
+                                             color_cl_start, file_size, NULL, &ret)
         };
 
         gpu_holder->programs[0] = program;
 
-    }else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
     }
 
     if (ret == CL_SUCCESS) {
@@ -132,14 +211,11 @@ int gpu_init(main_options *config, gpu_t *gpu_holder) {
         gpu_program program = {
                 "mapart",
                 gpu_compile_embedded_program(config, gpu_holder, "resources/opencl/mapart.cl", mapart_cl_start,
-                                             file_size, &ret)
+                                             file_size, NULL, &ret)
         };
 
         gpu_holder->programs[1] = program;
 
-    }else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
     }
 
     if (ret == CL_SUCCESS) {
@@ -151,31 +227,63 @@ int gpu_init(main_options *config, gpu_t *gpu_holder) {
         gpu_program program = {
                 "gen_dithering",
                 gpu_compile_embedded_program(config, gpu_holder, "resources/opencl/dither.cl", dither_cl_start,
-                                             file_size, &ret)
+                                             file_size, config->half_lab ? "-DHALF_LAB" : NULL, &ret)
         };
 
         gpu_holder->programs[2] = program;
 
-    }else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
     }
 
-    if (ret == CL_SUCCESS) {
+    return ret;
+}
 
-        extern char progress_cl_start[] asm("_binary_resources_opencl_progress_cl_start");
-        extern char progress_cl_end[] asm("_binary_resources_opencl_progress_cl_end");
-        size_t file_size = progress_cl_end - progress_cl_start;
+//adds the embedded source of a program ( same slots as gpu_t.programs ) to a cache key,
+//so the cached stages are computed again after a kernel change
+uint64_t gpu_hash_program_source(uint64_t key, unsigned int program) {
+    extern char color_cl_start[] asm("_binary_resources_opencl_color_conversions_cl_start");
+    extern char color_cl_end[] asm("_binary_resources_opencl_color_conversions_cl_end");
+    extern char mapart_cl_start[] asm("_binary_resources_opencl_mapart_cl_start");
+    extern char mapart_cl_end[] asm("_binary_resources_opencl_mapart_cl_end");
+    extern char dither_cl_start[] asm("_binary_resources_opencl_dither_cl_start");
+    extern char dither_cl_end[] asm("_binary_resources_opencl_dither_cl_end");
+
+    if (program == 0)
+        return cache_hash(key, color_cl_start, color_cl_end - color_cl_start);
+    if (program == 1)
+        return cache_hash(key, mapart_cl_start, mapart_cl_end - mapart_cl_start);
+    if (program == 2)
+        return cache_hash(key, dither_cl_start, dither_cl_end - dither_cl_start);
+    return key;
+}
 
-        gpu_program program = {
-                "progress",
-                gpu_compile_embedded_program(config, gpu_holder, "resources/opencl/progress.cl", progress_cl_start,
-                                             file_size, &ret)
-        };
+int gpu_init(main_options *config, gpu_t *gpu_holder) {
+    gpu_device_list list = {};
 
-        gpu_holder->programs[3] = program;
+    int platform_index = -1;
+    int device_index = -1;
 
-    }else{
+    cl_int ret = gpu_list_devices(&list);
+
+    if (ret == CL_SUCCESS) {
+        while (platform_index < 0 || platform_index >= list.ret_num_platforms || device_index < 0 ||
+               device_index >= list.ret_num_devices[platform_index]) {
+            fprintf(stdout, "please select a device to use (%%d %%d):\n");
+            fflush(stdout);
+            fflush(stdin);
+            (void)!fscanf(stdin, "%d %d", &platform_index, &device_index);
+        }
+
+        fprintf(stdout, "Selected %s from %s\n", list.device_names[platform_index][device_index],
+                list.platform_names[platform_index]);
+        fflush(stdout);
+
+        gpu_holder->platformId = list.platform_id[platform_index];
+        gpu_holder->deviceId = list.device_id[platform_index][device_index];
+    }
+
+    if (ret == CL_SUCCESS)
+        ret = gpu_setup_device(config, gpu_holder);
+    else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
@@ -184,15 +292,298 @@ int gpu_init(main_options *config, gpu_t *gpu_holder) {
 
 }
 
+int gpu_init_all(main_options *config, gpu_t **gpu_holders, unsigned int *gpu_count) {
+    gpu_device_list list = {};
+
+    cl_int ret = gpu_list_devices(&list);
+
+    *gpu_holders = NULL;
+    *gpu_count = 0;
+
+    if (ret == CL_SUCCESS) {
+        *gpu_holders = t_calloc(list.total_devices, sizeof(gpu_t));
+        for (int i = 0; i < list.ret_num_platforms; i++) {
+            for (int j = 0; j < list.ret_num_devices[i]; j++) {
+                gpu_t *gpu_holder = &(*gpu_holders)[*gpu_count];
+                gpu_holder->platformId = list.platform_id[i];
+                gpu_holder->deviceId = list.device_id[i][j];
+
+                //devices that cannot run the kernels are left out
+                if (gpu_setup_device(config, gpu_holder) == CL_SUCCESS) {
+                    fprintf(stdout, "Using %s from %s\n", list.device_names[i][j], list.platform_names[i]);
+                    (*gpu_count)++;
+                } else {
+                    fprintf(stdout, "Skipping %s from %s\n", list.device_names[i][j], list.platform_names[i]);
+                    if (gpu_holder->context != NULL)
+                        gpu_clear(gpu_holder);
+                    *gpu_holder = (gpu_t){};
+                }
+                fflush(stdout);
+            }
+        }
+    }
+
+    if (ret == CL_SUCCESS && *gpu_count == 0) {
+        fprintf(stderr, "No usable OpenCL device found!\n");
+        fflush(stderr);
+        ret = EXIT_FAILURE;
+    }
+
+    return ret;
+}
+
 void gpu_clear(gpu_t *gpu_holder) {
     clFlush(gpu_holder->commandQueue);
     clFinish(gpu_holder->commandQueue);
+    //the cached kernels keep the programs alive, release them first
+    if (gpu_holder->cache != NULL)
+        gpu_cache_release(gpu_holder->cache);
+    gpu_holder->cache = NULL;
     for (int i = 0; i < ARRAY_SIZE(gpu_holder->programs); i++)
         clReleaseProgram((gpu_holder->programs)[i].program);
     clReleaseCommandQueue(gpu_holder->commandQueue);
     clReleaseContext(gpu_holder->context);
 }
 
+int gpu_create_queue(gpu_t *gpu_holder, gpu_t *queue_holder) {
+    cl_int ret = CL_SUCCESS;
+    //share the context and the programs, only the queue is new
+    *queue_holder = *gpu_holder;
+    queue_holder->commandQueue = clCreateCommandQueueWithProperties(gpu_holder->context, gpu_holder->deviceId, NULL, &ret);
+    if (ret != CL_SUCCESS)
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+    return ret;
+}
+
+void gpu_release_queue(gpu_t *queue_holder) {
+    clFlush(queue_holder->commandQueue);
+    clFinish(queue_holder->commandQueue);
+    clReleaseCommandQueue(queue_holder->commandQueue);
+}
+
+gpu_object_cache *gpu_cache_create() {
+    gpu_object_cache *cache = t_calloc(1, sizeof(gpu_object_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_mutex_init(&cache->build_lock, NULL);
+    return cache;
+}
+
+void gpu_cache_release(gpu_object_cache *cache) {
+    for (unsigned int i = 0; i < cache->kernel_count; i++)
+        clReleaseKernel(cache->kernels[i].kernel);
+    for (unsigned int i = 0; i < cache->buffer_count; i++)
+        clReleaseMemObject(cache->buffers[i].buffer);
+    //the kernels are gone, the variants can be released ( the fallbacks belong to the gpu )
+    for (unsigned int i = 0; i < cache->variant_count; i++) {
+        if (cache->variants[i].program != NULL)
+            clReleaseProgram(cache->variants[i].program);
+        t_free(cache->variants[i].build_options);
+    }
+    if (cache->kernels != NULL)
+        t_free(cache->kernels);
+    if (cache->buffers != NULL)
+        t_free(cache->buffers);
+    if (cache->variants != NULL)
+        t_free(cache->variants);
+    pthread_mutex_destroy(&cache->build_lock);
+    pthread_mutex_destroy(&cache->lock);
+    t_free(cache);
+}
+
+cl_kernel gpu_acquire_program_kernel(gpu_t *gpu, cl_program program, const char *name, cl_int *ret) {
+    gpu_object_cache *cache = gpu->cache;
+    cl_kernel kernel = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    for (unsigned int i = 0; i < cache->kernel_count && kernel == NULL; i++) {
+        gpu_cached_kernel *entry = &cache->kernels[i];
+        if (!entry->in_use && entry->program == program && strcmp(entry->name, name) == 0) {
+            entry->in_use = 1;
+            kernel = entry->kernel;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (kernel != NULL) {
+        *ret = CL_SUCCESS;
+        return kernel;
+    }
+
+    //a kernel holds its arguments, so concurrent callers each get their own instance
+    kernel = clCreateKernel(program, name, ret);
+    if (*ret != CL_SUCCESS)
+        return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->kernels = t_realloc(cache->kernels, (cache->kernel_count + 1) * sizeof(gpu_cached_kernel));
+    cache->kernels[cache->kernel_count++] = (gpu_cached_kernel) {program, name, kernel, 1};
+    pthread_mutex_unlock(&cache->lock);
+    return kernel;
+}
+
+cl_kernel gpu_acquire_kernel(gpu_t *gpu, int program, const char *name, cl_int *ret) {
+    return gpu_acquire_program_kernel(gpu, gpu->programs[program].program, name, ret);
+}
+
+//builds the program again from its own source with the extra options, once per context
+cl_program gpu_get_variant(gpu_t *gpu, int base, const char *build_options, cl_int *ret) {
+    gpu_object_cache *cache = gpu->cache;
+    cl_program program = NULL;
+    *ret = CL_SUCCESS;
+
+    //the builds are slow, keep them out of the lock of the kernels and buffers
+    pthread_mutex_lock(&cache->build_lock);
+    for (unsigned int i = 0; i < cache->variant_count && program == NULL; i++)
+        if (cache->variants[i].base == base && strcmp(cache->variants[i].build_options, build_options) == 0)
+            program = cache->variants[i].program != NULL ? cache->variants[i].program : gpu->programs[base].program;
+
+    if (program == NULL) {
+        size_t length = 0;
+        char *source = NULL;
+        *ret = clGetProgramInfo(gpu->programs[base].program, CL_PROGRAM_SOURCE, 0, NULL, &length);
+        if (*ret == CL_SUCCESS) {
+            source = t_calloc(length + 1, sizeof(char));
+            *ret = clGetProgramInfo(gpu->programs[base].program, CL_PROGRAM_SOURCE, length, source, NULL);
+        }
+
+        cl_program variant = NULL;
+        if (*ret == CL_SUCCESS) {
+            if (gpu->verbose) {
+                fprintf(stdout, "Building %s with %s\n", gpu->programs[base].name, build_options);
+                fflush(stdout);
+            }
+            //the source is null terminated, let the driver measure it
+            variant = gpu_compile_embedded_program(NULL, gpu, (char *) gpu->programs[base].name, source, 0, build_options, ret);
+        }
+        if (source != NULL)
+            t_free(source);
+
+        //a driver that cannot build the variant still runs the generic kernels, which take the same arguments
+        if (*ret != CL_SUCCESS || variant == NULL) {
+            fprintf(stderr, "Using the generic %s kernels\n", gpu->programs[base].name);
+            if (variant != NULL)
+                clReleaseProgram(variant);
+            variant = NULL;
+            *ret = CL_SUCCESS;
+        }
+
+        cache->variants = t_realloc(cache->variants, (cache->variant_count + 1) * sizeof(gpu_cached_variant));
+        cache->variants[cache->variant_count++] = (gpu_cached_variant) {base, t_strdup(build_options), variant};
+        program = variant != NULL ? variant : gpu->programs[base].program;
+    }
+    pthread_mutex_unlock(&cache->build_lock);
+    return program;
+}
+
+cl_kernel gpu_acquire_variant_kernel(gpu_t *gpu, int program, const char *build_options, const char *name, cl_int *ret) {
+    cl_program variant = gpu_get_variant(gpu, program, build_options, ret);
+    if (*ret != CL_SUCCESS)
+        return NULL;
+    return gpu_acquire_program_kernel(gpu, variant, name, ret);
+}
+
+void gpu_release_kernel(gpu_t *gpu, cl_kernel kernel) {
+    gpu_object_cache *cache = gpu->cache;
+    pthread_mutex_lock(&cache->lock);
+    for (unsigned int i = 0; i < cache->kernel_count; i++)
+        if (cache->kernels[i].kernel == kernel)
+            cache->kernels[i].in_use = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+//rounds up to eighths of the next power of two, so a reused buffer wastes at most 1/8 of its size
+size_t gpu_buffer_bucket(size_t size) {
+    size_t power = 4096;
+    while (power < size)
+        power <<= 1;
+    size_t step = MAX(power / 8, 4096);
+    return ((size + step - 1) / step) * step;
+}
+
+//frees the buffers nobody is using, called when the device runs out of memory
+void gpu_trim_buffers(gpu_object_cache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < cache->buffer_count; i++) {
+        if (cache->buffers[i].in_use)
+            cache->buffers[kept++] = cache->buffers[i];
+        else
+            clReleaseMemObject(cache->buffers[i].buffer);
+    }
+    cache->buffer_count = kept;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+cl_mem gpu_acquire_buffer(gpu_t *gpu, cl_mem_flags flags, size_t size, void *host_ptr, cl_int *ret) {
+    gpu_object_cache *cache = gpu->cache;
+    *ret = CL_SUCCESS;
+
+    //wrapped host memory cannot be shared, it gets a private buffer released together with the others
+    if (flags & CL_MEM_USE_HOST_PTR)
+        return clCreateBuffer(gpu->context, flags, size, host_ptr, ret);
+
+    cl_mem_flags pool_flags = flags & ~CL_MEM_COPY_HOST_PTR;
+    cl_mem buffer = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    gpu_cached_buffer *best = NULL;
+    for (unsigned int i = 0; i < cache->buffer_count; i++) {
+        gpu_cached_buffer *entry = &cache->buffers[i];
+        if (!entry->in_use && entry->flags == pool_flags && entry->capacity >= size &&
+            (best == NULL || entry->capacity < best->capacity))
+            best = entry;
+    }
+    if (best != NULL) {
+        best->in_use = 1;
+        buffer = best->buffer;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (buffer == NULL) {
+        //the rounding must not push a tile planned just under the allocation limit over it
+        size_t capacity = gpu_buffer_bucket(size);
+        if (gpu->max_alloc > 0)
+            capacity = MIN(capacity, MAX(size, gpu->max_alloc));
+        buffer = clCreateBuffer(gpu->context, pool_flags, capacity, NULL, ret);
+        if (*ret == CL_MEM_OBJECT_ALLOCATION_FAILURE || *ret == CL_OUT_OF_RESOURCES) {
+            gpu_trim_buffers(cache);
+            buffer = clCreateBuffer(gpu->context, pool_flags, capacity, NULL, ret);
+        }
+        if (*ret != CL_SUCCESS)
+            return NULL;
+
+        pthread_mutex_lock(&cache->lock);
+        cache->buffers = t_realloc(cache->buffers, (cache->buffer_count + 1) * sizeof(gpu_cached_buffer));
+        cache->buffers[cache->buffer_count++] = (gpu_cached_buffer) {pool_flags, capacity, buffer, 1};
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    //blocking like clCreateBuffer's own copy: the callers pass stack arrays and free their host memory right after
+    if (flags & CL_MEM_COPY_HOST_PTR)
+        *ret = clEnqueueWriteBuffer(gpu->commandQueue, buffer, CL_TRUE, 0, size, host_ptr, 0, NULL, NULL);
+    if (*ret != CL_SUCCESS) {
+        gpu_release_buffer(gpu, buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+void gpu_release_buffer(gpu_t *gpu, cl_mem buffer) {
+    gpu_object_cache *cache = gpu->cache;
+    char pooled = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (unsigned int i = 0; i < cache->buffer_count && !pooled; i++) {
+        if (cache->buffers[i].buffer == buffer) {
+            cache->buffers[i].in_use = 0;
+            pooled = 1;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!pooled)
+        clReleaseMemObject(buffer);
+}
+
 cl_program gpu_compile_program(main_options *config, gpu_t *gpu_holder, char *filename, cl_int *ret) {
     char *source_str = NULL;
     size_t length = 0;
@@ -235,13 +626,13 @@ cl_program gpu_compile_program(main_options *config, gpu_t *gpu_holder, char *fi
 }
 
 
-cl_program gpu_compile_embedded_program(main_options *config, gpu_t *gpu_holder, char *filename, char * data, size_t size, cl_int *ret) {
+cl_program gpu_compile_embedded_program(main_options *config, gpu_t *gpu_holder, char *filename, char * data, size_t size, const char *build_options, cl_int *ret) {
 
     if (*ret == CL_SUCCESS) {
         cl_program program = clCreateProgramWithSource(gpu_holder->context, 1, (const char **) &data, &size,
                                                        ret);
         if (*ret == CL_SUCCESS) {
-            *ret = clBuildProgram(program, 1, &gpu_holder->deviceId, NULL, NULL, NULL);
+            *ret = clBuildProgram(program, 1, &gpu_holder->deviceId, build_options, NULL, NULL);
         }
 
         if (*ret == CL_SUCCESS) {
@@ -271,10 +662,10 @@ int gpu_rgba_to_composite(gpu_t *gpu, int *input, int *output, unsigned int widt
 
     //create memory objects
 
-    input_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY,
+    input_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY,
                                    buffer_size * sizeof(int), NULL, &ret);
     if (ret == CL_SUCCESS)
-        output_mem_obj = clCreateBuffer(gpu->context, CL_MEM_WRITE_ONLY,
+        output_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_WRITE_ONLY,
                                         buffer_size * sizeof(int), NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
@@ -292,7 +683,7 @@ int gpu_rgba_to_composite(gpu_t *gpu, int *input, int *output, unsigned int widt
 
     //create kernel
     if (ret == CL_SUCCESS)
-        kernel = clCreateKernel(gpu->programs[0].program, "rgba_composite", &ret);
+        kernel = gpu_acquire_kernel(gpu, 0, "rgba_composite", &ret);
     else{
     fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
     exit(ret);
@@ -351,17 +742,17 @@ int gpu_rgba_to_composite(gpu_t *gpu, int *input, int *output, unsigned int widt
     }
 
     if (kernel != NULL)
-        clReleaseKernel(kernel);
+        gpu_release_kernel(gpu, kernel);
 
     if (input_mem_obj != NULL)
-        clReleaseMemObject(input_mem_obj);
+        gpu_release_buffer(gpu, input_mem_obj);
     if (output_mem_obj != NULL)
-        clReleaseMemObject(output_mem_obj);
+        gpu_release_buffer(gpu, output_mem_obj);
 
     return ret;
 }
 
-int gpu_rgb_to_ok(gpu_t *gpu, int *input, float *output, unsigned int width, unsigned int height) {
+int gpu_internal_rgb_to_ok(gpu_t *gpu, int *input, void *output, unsigned int width, unsigned int height, const char *kernel_name, size_t output_element) {
     size_t buffer_size = (size_t)width * height * 4;
     cl_int ret = 0;
     cl_mem input_mem_obj = NULL;
@@ -372,11 +763,11 @@ int gpu_rgb_to_ok(gpu_t *gpu, int *input, float *output, unsigned int width, uns
 
     //create memory objects
 
-    input_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY,
+    input_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY,
                                    buffer_size * sizeof(int), NULL, &ret);
     if (ret == CL_SUCCESS)
-        output_mem_obj = clCreateBuffer(gpu->context, CL_MEM_WRITE_ONLY,
-                                        buffer_size * sizeof(float), NULL, &ret);
+        output_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_WRITE_ONLY,
+                                        buffer_size * output_element, NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
@@ -392,7 +783,7 @@ int gpu_rgb_to_ok(gpu_t *gpu, int *input, float *output, unsigned int width, uns
     }
     //create kernel
     if (ret == CL_SUCCESS)
-        kernel = clCreateKernel(gpu->programs[0].program, "rgb_to_ok", &ret);
+        kernel = gpu_acquire_kernel(gpu, 0, kernel_name, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
@@ -426,7 +817,7 @@ int gpu_rgb_to_ok(gpu_t *gpu, int *input, float *output, unsigned int width, uns
 
     //read the outputs
     if (ret == CL_SUCCESS)
-        ret = clEnqueueReadBuffer(gpu->commandQueue, output_mem_obj, CL_TRUE, 0, buffer_size * sizeof(float), output, 1,
+        ret = clEnqueueReadBuffer(gpu->commandQueue, output_mem_obj, CL_TRUE, 0, buffer_size * output_element, output, 1,
                                   &event[1], &event[2]);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
@@ -450,202 +841,695 @@ int gpu_rgb_to_ok(gpu_t *gpu, int *input, float *output, unsigned int width, uns
     }
 
     if (kernel != NULL)
-        clReleaseKernel(kernel);
+        gpu_release_kernel(gpu, kernel);
 
     if (input_mem_obj != NULL)
-        clReleaseMemObject(input_mem_obj);
+        gpu_release_buffer(gpu, input_mem_obj);
     if (output_mem_obj != NULL)
-        clReleaseMemObject(output_mem_obj);
+        gpu_release_buffer(gpu, output_mem_obj);
 
     return ret;
 }
 
-//Dithering
-
-int gpu_internal_dither_error_bleed(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise,
-                                    unsigned int width, unsigned int height, unsigned char palette_indexes, int *bleeding_params,
-                                    unsigned char bleeding_count, unsigned char min_required_pixels,
-                                    int max_minecraft_y) {
-    size_t buffer_size = (size_t)width * height * RGBA_SIZE;
-    size_t palette_size = palette_indexes * MULTIPLIER_SIZE * RGBA_SIZE;
-    size_t output_size = (size_t)width * height * 2;
-    size_t noise_size = (size_t)width * height;
-    size_t bleeding_size = bleeding_count * RGBA_SIZE;
-    //iterate vertically for mc compatibility
-    size_t global_workgroup_size = width * height;
-
-    //generate diagonals
+int gpu_rgb_to_ok(gpu_t *gpu, int *input, float *output, unsigned int width, unsigned int height) {
+    return gpu_internal_rgb_to_ok(gpu, input, output, width, height, "rgb_to_ok", sizeof(float));
+}
 
-    index_holder index_holder = generate_indexes(width, height, min_required_pixels);
+//the image to dither, stored compact if requested
+int gpu_rgb_to_ok_image(gpu_t *gpu, int *input, void *output, unsigned int width, unsigned int height) {
+    return gpu_internal_rgb_to_ok(gpu, input, output, width, height, gpu->half_lab ? "rgb_to_ok_half" : "rgb_to_ok", GPU_LAB_SIZE(gpu));
+}
 
-    cl_event event[5];
+//lines ( rows or columns ) of a tile so that every buffer fits the device: line_bytes is what all the buffers
+//growing with the tile need for each line, largest_line the share of the biggest of them, fixed the size of the others.
+//gpu_acquire_buffer rounds the buffers up by at most 1/8 ( never past max_alloc ), the budget leaves room for it
+unsigned int gpu_plan_tile(gpu_t *gpu, unsigned int lines, size_t line_bytes, size_t largest_line, size_t fixed) {
+    cl_ulong budget = gpu->memory_budget / 9 * 8;
+    cl_ulong by_alloc = gpu->max_alloc / MAX(largest_line, 1);
+    cl_ulong by_memory = budget > fixed ? (budget - fixed) / MAX(line_bytes, 1) : 0;
+    return (unsigned int)MIN(MIN(by_alloc, by_memory), (cl_ulong)lines);
+}
 
-    cl_int ret = CL_SUCCESS;
+int gpu_downsample(gpu_t *gpu, void *input, void *output, unsigned int width, unsigned int height, unsigned int factor) {
+    unsigned int out_width = (width + factor - 1) / factor;
+    unsigned int out_height = (height + factor - 1) / factor;
+    size_t row_input = (size_t)width * 4 * GPU_LAB_SIZE(gpu);
+    size_t row_output = (size_t)out_width * 4 * GPU_LAB_SIZE(gpu);
+    cl_int ret = 0;
     cl_mem input_mem_obj = NULL;
     cl_mem output_mem_obj = NULL;
-    cl_mem error_buf_mem_obj = NULL;
-    cl_mem palette_mem_obj = NULL;
-    cl_mem palette_id_mem_obj = NULL;
-    cl_mem palette_liquid_mem_obj = NULL;
-    cl_mem noise_mem_obj = NULL;
-    cl_mem height_mem_obj = NULL;
-    cl_mem coord_mem_obj = NULL;
-    cl_mem bleeding_mem_obj = NULL;
     cl_kernel kernel = NULL;
-    cl_kernel progress_kernel = NULL;
+
+    //large images run in bands of output rows, each one reads factor rows of the input
+    unsigned int band_rows = gpu_plan_tile(gpu, out_height, factor * row_input + row_output, factor * row_input, 0);
+    if (band_rows == 0) {
+        fprintf(stderr, "The image is too wide for the memory of the device\n");
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
 
     //create memory objects
 
-    input_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                   buffer_size * sizeof(float), input, &ret);
+    input_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY,
+                                   MIN((size_t)band_rows * factor, height) * row_input, NULL, &ret);
     if (ret == CL_SUCCESS)
-        output_mem_obj = clCreateBuffer(gpu->context, CL_MEM_WRITE_ONLY,
-                                        output_size * sizeof(unsigned char), NULL, &ret);
-    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
-    }
-    if (ret == CL_SUCCESS)
-        error_buf_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,
-                                           buffer_size * sizeof(int), NULL, &ret);
+        output_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_WRITE_ONLY,
+                                        band_rows * row_output, NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
+    //create kernel
     if (ret == CL_SUCCESS)
-        palette_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                         palette_size * sizeof(float), palette, &ret);
+        kernel = gpu_acquire_kernel(gpu, 0, gpu->half_lab ? "downsample_half" : "downsample", &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
+    //set kernel arguments
     if (ret == CL_SUCCESS)
-        palette_id_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                            palette_indexes * sizeof(unsigned char), valid_palette_ids, &ret);
+        ret = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &input_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        palette_liquid_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                            palette_indexes * sizeof(unsigned char), liquid_palette_ids, &ret);
+        ret = clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &output_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        noise_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                       noise_size * sizeof(float), noise, &ret);
+        ret = clSetKernelArg(kernel, 2, sizeof(const unsigned int), (void *) &width);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        height_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,
-                                       width * sizeof(int), NULL, &ret);
+        ret = clSetKernelArg(kernel, 3, sizeof(const unsigned int), (void *) &height);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        coord_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
-                                       width * height * 2 * sizeof(unsigned int), index_holder.indexes, &ret);
+        ret = clSetKernelArg(kernel, 4, sizeof(const unsigned int), (void *) &factor);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
-    if (ret == CL_SUCCESS) {
-        if (bleeding_count > 0)
-            bleeding_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                              bleeding_size * sizeof(int), bleeding_params, &ret);
+
+    //request the gpu process, one band at a time
+    if (ret == CL_SUCCESS){
+        for (unsigned int band_first = 0; band_first < out_height && ret == CL_SUCCESS; band_first += band_rows){
+            unsigned int band_end = MIN(band_first + band_rows, out_height);
+            size_t in_first = (size_t)band_first * factor;
+            size_t in_rows = MIN((size_t)band_end * factor, height) - in_first;
+            size_t global_item_size = (size_t)out_width * (band_end - band_first);
+
+            ret = clEnqueueWriteBuffer(gpu->commandQueue, input_mem_obj, CL_FALSE, 0, in_rows * row_input,
+                                       (unsigned char *)input + in_first * row_input, 0, NULL, NULL);
+            if (ret == CL_SUCCESS)
+                ret = clSetKernelArg(kernel, 5, sizeof(const unsigned int), (void *) &band_first);
+            if (ret == CL_SUCCESS)
+                ret = clEnqueueNDRangeKernel(gpu->commandQueue, kernel, 1, NULL, &global_item_size, NULL, 0, NULL, NULL);
+            //read the outputs of the band
+            if (ret == CL_SUCCESS)
+                ret = clEnqueueReadBuffer(gpu->commandQueue, output_mem_obj, CL_TRUE, 0, (band_end - band_first) * row_output,
+                                          (unsigned char *)output + band_first * row_output, 0, NULL, NULL);
+        }
     }else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-    //request clean the error buffer
-    float pattern = 0;
-    int i_pattern = 0;
-
+    //flush remaining tasks
     if (ret == CL_SUCCESS)
-        ret = clEnqueueFillBuffer(gpu->commandQueue, error_buf_mem_obj, &i_pattern, sizeof (int), 0, buffer_size * sizeof(int), 0, NULL, NULL);
+        ret = clFlush(gpu->commandQueue);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
+
+    if (kernel != NULL)
+        gpu_release_kernel(gpu, kernel);
+
+    if (input_mem_obj != NULL)
+        gpu_release_buffer(gpu, input_mem_obj);
+    if (output_mem_obj != NULL)
+        gpu_release_buffer(gpu, output_mem_obj);
+
+    return ret;
+}
+
+//Dithering
+
+//fills the palette side terms and the lookup tables of the selected metric, nothing to do for the plain distance
+int gpu_prepare_metric(gpu_t *gpu, cl_mem palette_mem_obj, size_t palette_entries, cl_mem *metric_palette_mem_obj, cl_mem *metric_lut_mem_obj) {
+    cl_int ret = CL_SUCCESS;
+    cl_kernel palette_kernel = NULL;
+    cl_kernel lut_kernel = NULL;
+
+    if (gpu->metric == 0)
+        return ret;
+
+    *metric_palette_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,
+                                                 palette_entries * METRIC_STRIDE * sizeof(float), NULL, &ret);
     if (ret == CL_SUCCESS)
-            ret = clEnqueueFillBuffer(gpu->commandQueue, height_mem_obj, &i_pattern, sizeof (int), 0, width * sizeof(int), 0, NULL, NULL);
+        *metric_lut_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,
+                                                 METRIC_LUT_BINS * METRIC_LUT_COUNT * sizeof(float), NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-    //create kernel
     if (ret == CL_SUCCESS)
-        kernel = clCreateKernel(gpu->programs[2].program, "error_bleed", &ret);
+        palette_kernel = gpu_acquire_kernel(gpu, 2, "prepare_metric_palette", &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        progress_kernel = clCreateKernel(gpu->programs[3].program, "progress", &ret);
+        lut_kernel = gpu_acquire_kernel(gpu, 2, "prepare_metric_luts", &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-    unsigned char arg_index = 0;
-    //set kernel arguments
-    if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &input_mem_obj);
-    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
-    }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &output_mem_obj);
+        ret = clSetKernelArg(palette_kernel, 0, sizeof(cl_mem), (void *) &palette_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &error_buf_mem_obj);
+        ret = clSetKernelArg(palette_kernel, 1, sizeof(cl_mem), (void *) metric_palette_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &palette_mem_obj);
+        ret = clSetKernelArg(lut_kernel, 0, sizeof(cl_mem), (void *) metric_lut_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
+
+    //the queue is in order, the dithering kernels will see the finished tables
+    size_t lut_items = METRIC_LUT_BINS;
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &palette_id_mem_obj);
+        ret = clEnqueueNDRangeKernel(gpu->commandQueue, palette_kernel, 1, NULL, &palette_entries, NULL, 0, NULL, NULL);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &palette_liquid_mem_obj);
+        ret = clEnqueueNDRangeKernel(gpu->commandQueue, lut_kernel, 1, NULL, &lut_items, NULL, 0, NULL, NULL);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
-    if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &noise_mem_obj);
-    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
+
+    //the kernels can go back to the cache once the launches are enqueued, the arguments were captured
+    if (palette_kernel != NULL)
+        gpu_release_kernel(gpu, palette_kernel);
+    if (lut_kernel != NULL)
+        gpu_release_kernel(gpu, lut_kernel);
+
+    return ret;
+}
+
+//markers placed in a long chain of launches, the host polls them to report the progress
+#define GPU_PROGRESS_STEPS 100
+
+typedef struct {
+    cl_event markers[GPU_PROGRESS_STEPS + 1];
+    size_t done[GPU_PROGRESS_STEPS + 1];
+    unsigned int count;
+    size_t total;
+    size_t next; // work queued before the next marker
+    double start;
+} gpu_progress;
+
+static double gpu_now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+void gpu_progress_start(gpu_progress *progress, size_t total) {
+    progress->count = 0;
+    progress->total = total;
+    progress->next = total / GPU_PROGRESS_STEPS + 1;
+    progress->start = gpu_now_seconds();
+}
+
+//enqueues a marker each time another 1% of the work is queued, nothing runs on the device
+cl_int gpu_progress_mark(gpu_t *gpu, gpu_progress *progress, size_t done) {
+    if (!gpu->verbose || progress->count > GPU_PROGRESS_STEPS || (done < progress->next && done < progress->total))
+        return CL_SUCCESS;
+    cl_int ret = clEnqueueMarkerWithWaitList(gpu->commandQueue, 0, NULL, &progress->markers[progress->count]);
+    if (ret == CL_SUCCESS) {
+        progress->done[progress->count++] = done;
+        progress->next = done + progress->total / GPU_PROGRESS_STEPS + 1;
     }
-    if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &height_mem_obj);
-    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
+    return ret;
+}
+
+//waits for the queued work printing the progress every progress_interval seconds, then frees the markers
+void gpu_progress_wait(gpu_t *gpu, gpu_progress *progress, const char *label) {
+    if (progress->count == 0)
+        return;
+    clFlush(gpu->commandQueue);
+
+    double last_report = progress->start;
+    unsigned int reached = 0;
+    cl_int status = CL_COMPLETE;
+    while (reached < progress->count) {
+        struct timespec poll = {0, 10000000};
+        nanosleep(&poll, NULL);
+
+        //the markers complete in order
+        while (reached < progress->count) {
+            cl_int info = clGetEventInfo(progress->markers[reached], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+            if (info != CL_SUCCESS)
+                status = info;
+            if (status != CL_COMPLETE)
+                break;
+            reached++;
+        }
+        //a failed command is reported by the read that follows
+        if (status < 0)
+            break;
+
+        double now = gpu_now_seconds();
+        if (reached > 0 && (now - last_report >= gpu->progress_interval || reached == progress->count)) {
+            size_t done = progress->done[reached - 1];
+            double speed = done / MAX(now - progress->start, 1e-6);
+            fprintf(stdout, "%s: %.1f%% %zu/%zu pixels, %.0f pixels/s, ETA %.1fs\n", label,
+                    100. * done / MAX(progress->total, 1), done, progress->total, speed,
+                    speed > 0 ? (progress->total - done) / speed : 0.);
+            fflush(stdout);
+            last_report = now;
+        }
+    }
+
+    for (unsigned int i = 0; i < progress->count; i++)
+        clReleaseEvent(progress->markers[i]);
+    progress->count = 0;
+}
+
+//reads back the diagnostics of a dithering, the summary is verbose only but the transparent pixels are always reported
+cl_int gpu_report_diagnostics(gpu_t *gpu, cl_mem diagnostics_mem_obj) {
+    unsigned int diagnostics[DIAG_SIZE] = {};
+    cl_int ret = clEnqueueReadBuffer(gpu->commandQueue, diagnostics_mem_obj, CL_TRUE, 0, sizeof(diagnostics), diagnostics, 0, NULL, NULL);
+    if (ret != CL_SUCCESS)
+        return ret;
+
+    unsigned int *retries = &diagnostics[DIAG_RETRIES];
+    if (gpu->verbose) {
+        fprintf(stdout, "Staircase: %u restricted retries, %u random drops, retries per pixel 0:%u 1:%u 2:%u 3+:%u\n",
+                diagnostics[DIAG_RESTRICTED], diagnostics[DIAG_DROPS], retries[0], retries[1], retries[2], retries[3]);
+    }
+    if (diagnostics[DIAG_TRANSPARENT] > 0) {
+        fprintf(stdout, "%u visible pixels defaulted to transparent, no palette entry was allowed:", diagnostics[DIAG_TRANSPARENT]);
+        unsigned int samples = MIN(diagnostics[DIAG_SAMPLE_COUNT], DIAG_SAMPLES);
+        for (unsigned int i = 0; i < samples; i++)
+            fprintf(stdout, " %u,%u", diagnostics[DIAG_SAMPLE_COUNT + 1 + i * 2], diagnostics[DIAG_SAMPLE_COUNT + 2 + i * 2]);
+        fprintf(stdout, samples < diagnostics[DIAG_TRANSPARENT] ? " ...\n" : "\n");
+    }
+    fflush(stdout);
+    return ret;
+}
+
+//state of an error diffusion between two diagonals, saved in the cache folder as a single blob:
+//this header, the output, the error ring, the column heights and the diagnostics
+typedef struct {
+    cl_uint version;
+    cl_uint width;
+    cl_uint height;
+    cl_uint err_rows;
+    cl_uint band_rows;  // rows dithered by each band
+    cl_uint band_start; // first row of the band
+    cl_ulong diagonal;  // first diagonal of the band still to run
+    cl_ulong done;      // pixels dithered so far
+} gpu_checkpoint;
+
+#define GPU_CHECKPOINT_VERSION 2
+#define GPU_CHECKPOINT_BLOCK 4096
+//diagonals run before the first checkpoint to measure the speed
+#define GPU_CHECKPOINT_PROBE 64
+
+//either a device buffer or, when buffer is NULL, host memory
+typedef struct {
+    cl_mem buffer;
+    void *host;
+    size_t size;
+} gpu_checkpoint_section;
+
+static image_data gpu_checkpoint_blob(size_t size) {
+    image_data blob = {};
+    blob.width = GPU_CHECKPOINT_BLOCK;
+    blob.height = (int)((size + GPU_CHECKPOINT_BLOCK - 1) / GPU_CHECKPOINT_BLOCK);
+    blob.channels = 1;
+    return blob;
+}
+
+//waits for the queued diagonals and saves everything the following ones read
+cl_int gpu_checkpoint_store(gpu_t *gpu, gpu_checkpoint *header, gpu_checkpoint_section *sections, unsigned int section_count) {
+    size_t size = sizeof(gpu_checkpoint);
+    for (unsigned int i = 0; i < section_count; i++)
+        size += sections[i].size;
+
+    image_data blob = gpu_checkpoint_blob(size);
+    blob.image_data = t_calloc((size_t)blob.width * blob.height, sizeof(unsigned char));
+    memcpy(blob.image_data, header, sizeof(gpu_checkpoint));
+
+    //the queue is in order, the blocking reads also wait for the kernels
+    cl_int ret = CL_SUCCESS;
+    size_t offset = sizeof(gpu_checkpoint);
+    for (unsigned int i = 0; i < section_count && ret == CL_SUCCESS; i++) {
+        if (sections[i].buffer != NULL)
+            ret = clEnqueueReadBuffer(gpu->commandQueue, sections[i].buffer, CL_TRUE, 0, sections[i].size,
+                                      (unsigned char *)blob.image_data + offset, 0, NULL, NULL);
+        else
+            memcpy((unsigned char *)blob.image_data + offset, sections[i].host, sections[i].size);
+        offset += sections[i].size;
+    }
+
+    if (ret == CL_SUCCESS && cache_store("checkpoint", gpu->checkpoint_key, &blob, sizeof(unsigned char)) == 0 && gpu->verbose) {
+        fprintf(stdout, "Checkpoint saved at diagonal %llu\n", (unsigned long long)header->diagonal);
+        fflush(stdout);
+    }
+    t_free(blob.image_data);
+    return ret;
+}
+
+//restores a checkpoint of the same dithering, header holds the expected sizes and gets the position to continue from.
+//returns 1 if the buffers were restored
+char gpu_checkpoint_load(gpu_t *gpu, gpu_checkpoint *header, gpu_checkpoint_section *sections, unsigned int section_count, cl_int *ret) {
+    size_t size = sizeof(gpu_checkpoint);
+    for (unsigned int i = 0; i < section_count; i++)
+        size += sections[i].size;
+
+    image_data blob = {};
+    if (cache_load("checkpoint", gpu->checkpoint_key, &blob, sizeof(unsigned char)) != 0)
+        return 0;
+
+    gpu_checkpoint saved = {};
+    image_data expected = gpu_checkpoint_blob(size);
+    char valid = blob.width == expected.width && blob.height == expected.height;
+    if (valid) {
+        memcpy(&saved, blob.image_data, sizeof(gpu_checkpoint));
+        valid = saved.version == GPU_CHECKPOINT_VERSION && saved.width == header->width && saved.height == header->height &&
+                saved.err_rows == header->err_rows && saved.band_rows == header->band_rows;
+    }
+    if (!valid)
+        fprintf(stderr, "Ignoring a checkpoint of a different dithering\n");
+
+    size_t offset = sizeof(gpu_checkpoint);
+    for (unsigned int i = 0; i < section_count && valid && *ret == CL_SUCCESS; i++) {
+        if (sections[i].buffer != NULL)
+            *ret = clEnqueueWriteBuffer(gpu->commandQueue, sections[i].buffer, CL_TRUE, 0, sections[i].size,
+                                        (unsigned char *)blob.image_data + offset, 0, NULL, NULL);
+        else
+            memcpy(sections[i].host, (unsigned char *)blob.image_data + offset, sections[i].size);
+        offset += sections[i].size;
+    }
+    t_free(blob.image_data);
+
+    if (valid && *ret == CL_SUCCESS) {
+        *header = saved;
+        fprintf(stdout, "Resuming the dithering from row %u diagonal %llu\n", saved.band_start, (unsigned long long)saved.diagonal);
+        fflush(stdout);
+        return 1;
+    }
+    return 0;
+}
+
+//depth of the liquids for each state ( must match LIQUID_DEPTH in dither.cl )
+static const int liquid_depth[MULTIPLIER_SIZE] = {10, 5, 0};
+
+//the ( id, state ) pairs the palette search can pick, see the top of dither.cl
+typedef struct {
+    float *lab;             // entry_count L values, then the a values, then the b values
+    unsigned int *entries;  // id | state << 8 | liquid << 10
+    unsigned int entry_count;
+} compact_palette;
+
+//keeps the usable ids in search order and drops the states the height mode never allows,
+//a few KB at most so it fits the constant memory of any device
+compact_palette gpu_compact_palette(float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids,
+                                    unsigned char palette_indexes, int max_minecraft_y) {
+    compact_palette compact = {};
+    size_t capacity = MAX(palette_indexes * MULTIPLIER_SIZE, 1);
+    compact.lab = t_calloc(capacity * RGB_SIZE, sizeof(float));
+    compact.entries = t_calloc(capacity, sizeof(unsigned int));
+
+    for (unsigned int p = 1; p < palette_indexes; p++) {
+        if (!valid_palette_ids[p])
+            continue;
+        for (unsigned int s = 0; s < MULTIPLIER_SIZE; s++) {
+            if (max_minecraft_y == 0 && (liquid_palette_ids[p] ? s != 2 : s != 1))
+                continue;
+            if (max_minecraft_y != 0 && liquid_palette_ids[p] && liquid_depth[s] > max_minecraft_y)
+                continue;
+            compact.entries[compact.entry_count++] = p | (s << 8) | ((liquid_palette_ids[p] ? 1 : 0) << 10);
+        }
+    }
+
+    for (unsigned int e = 0; e < compact.entry_count; e++) {
+        float *color = &palette[((compact.entries[e] & 0xFF) * MULTIPLIER_SIZE + ((compact.entries[e] >> 8) & 0x3)) * RGBA_SIZE];
+        compact.lab[e] = color[0];
+        compact.lab[compact.entry_count + e] = color[1];
+        compact.lab[(2 * compact.entry_count) + e] = color[2];
+    }
+    return compact;
+}
+
+//build options of the dither program specialized for a call, see the top of dither.cl
+void gpu_dither_variant(gpu_t *gpu, char *build_options, unsigned int entry_count, int max_minecraft_y,
+                        int *bleeding_params, unsigned char bleeding_count) {
+    int height_mode = max_minecraft_y == 0 ? 0 : (max_minecraft_y < 0 ? 1 : 2);
+    int length = sprintf(build_options, "-DDITHER_SPECIALIZED -DPALETTE_ENTRIES=%u -DHEIGHT_MODE=%d -DMETRIC_VARIANT=%d -DBLEEDING_COUNT=%d%s",
+                         entry_count, height_mode, gpu->metric, bleeding_count, gpu->half_lab ? " -DHALF_LAB" : "");
+    for (unsigned char j = 0; j < bleeding_count; j++) {
+        int *param = &bleeding_params[j * RGBA_SIZE];
+        length += sprintf(build_options + length, "%s(int4)(%d,%d,%d,%d)", j == 0 ? " -DBLEEDING_MATRIX=" : ",",
+                          param[0], param[1], param[2], param[3]);
+    }
+}
+
+int gpu_internal_dither_error_bleed(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed,
+                                    unsigned int width, unsigned int height, unsigned char palette_indexes, int *bleeding_params,
+                                    unsigned char bleeding_count, unsigned char min_required_pixels,
+                                    int max_minecraft_y) {
+    size_t palette_size = palette_indexes * MULTIPLIER_SIZE * RGBA_SIZE;
+    size_t bleeding_size = bleeding_count * RGBA_SIZE;
+
+    //the error only travels a few rows down, so only keep those rows in a ring buffer
+    //( int fixed point error for error_bleed, float quantization error for error_gather ).
+    //a row slot can be reused once every pixel that bleeds into it is guaranteed to run after its previous owner
+    unsigned int err_rows = 1;
+    for (unsigned char j = 0; j < bleeding_count; j++)
+        err_rows = MAX(err_rows, bleeding_params[j * RGBA_SIZE + 1] + 1);
+    for (unsigned char j = 0; j < bleeding_count; j++)
+        while ((long)min_required_pixels * (err_rows - bleeding_params[j * RGBA_SIZE + 1]) <= bleeding_params[j * RGBA_SIZE])
+            err_rows++;
+    size_t err_buf_size = (size_t)width * err_rows * RGBA_SIZE;
+
+    //images too big for the device run in bands of rows, each band also needs the halo rows the matrix reaches
+    //around it and the row above for the transparency check, the error ring and the heights carry over
+    unsigned int halo = 1;
+    for (unsigned char j = 0; j < bleeding_count; j++)
+        halo = MAX(halo, (unsigned int)abs(bleeding_params[j * RGBA_SIZE + 1]));
+    size_t row_input = (size_t)width * RGBA_SIZE * GPU_LAB_SIZE(gpu);
+    size_t row_output = (size_t)width * 2;
+    size_t fixed_size = err_buf_size * sizeof(int) + palette_size * sizeof(float) + width * sizeof(int) +
+                        DIAG_SIZE * sizeof(unsigned int) + bleeding_size * sizeof(int);
+    unsigned int band_rows = gpu_plan_tile(gpu, height, row_input + row_output, row_input, fixed_size);
+    if (band_rows < height)
+        band_rows = band_rows > 2 * halo ? band_rows - 2 * halo : 0;
+    if (band_rows == 0) {
+        fprintf(stderr, "The image is too wide for the memory of the device\n");
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+    unsigned int input_rows = MIN(band_rows + 2 * halo, height);
+    unsigned int output_rows = MIN(band_rows + halo, height);
+    if (band_rows < height && gpu->verbose) {
+        fprintf(stdout, "Dithering in bands of %u rows\n", band_rows);
+        fflush(stdout);
+    }
+
+    compact_palette compact = gpu_compact_palette(palette, valid_palette_ids, liquid_palette_ids, palette_indexes, max_minecraft_y);
+
+    cl_int ret = CL_SUCCESS;
+    cl_mem input_mem_obj = NULL;
+    cl_mem output_mem_obj = NULL;
+    cl_mem error_buf_mem_obj = NULL;
+    cl_mem palette_mem_obj = NULL;
+    cl_mem palette_lab_mem_obj = NULL;
+    cl_mem palette_entry_mem_obj = NULL;
+    cl_mem palette_liquid_mem_obj = NULL;
+    cl_mem height_mem_obj = NULL;
+    cl_mem bleeding_mem_obj = NULL;
+    cl_mem metric_palette_mem_obj = NULL;
+    cl_mem metric_lut_mem_obj = NULL;
+    cl_mem diagnostics_mem_obj = NULL;
+    cl_kernel kernel = NULL;
+
+    //create memory objects
+
+    input_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY,
+                                   input_rows * row_input, NULL, &ret);
+    if (ret == CL_SUCCESS)
+        output_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,
+                                        output_rows * row_output, NULL, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        error_buf_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,
+                                           err_buf_size * sizeof(int), NULL, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        palette_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                         palette_size * sizeof(float), palette, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        palette_lab_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                             MAX(compact.entry_count, 1) * RGB_SIZE * sizeof(float), compact.lab, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        palette_entry_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                               MAX(compact.entry_count, 1) * sizeof(unsigned int), compact.entries, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        palette_liquid_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                            palette_indexes * sizeof(unsigned char), liquid_palette_ids, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        height_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,
+                                       width * sizeof(int), NULL, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS) {
+        if (bleeding_count > 0)
+            bleeding_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                              bleeding_size * sizeof(int), bleeding_params, &ret);
+    }else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+
+    if (ret == CL_SUCCESS)
+        ret = gpu_prepare_metric(gpu, palette_mem_obj, palette_indexes * MULTIPLIER_SIZE, &metric_palette_mem_obj, &metric_lut_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+
+    //request clean the error buffer
+    float pattern = 0;
+    int i_pattern = 0;
+
+    if (ret == CL_SUCCESS)
+        ret = clEnqueueFillBuffer(gpu->commandQueue, error_buf_mem_obj, &i_pattern, sizeof (int), 0, err_buf_size * sizeof(int), 0, NULL, NULL);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+            ret = clEnqueueFillBuffer(gpu->commandQueue, height_mem_obj, &i_pattern, sizeof (int), 0, width * sizeof(int), 0, NULL, NULL);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        diagnostics_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE, DIAG_SIZE * sizeof(unsigned int), NULL, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clEnqueueFillBuffer(gpu->commandQueue, diagnostics_mem_obj, &i_pattern, sizeof (int), 0, DIAG_SIZE * sizeof(unsigned int), 0, NULL, NULL);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+
+    //create kernel, specialized for this matrix, palette and height limit
+    char build_options[1024] = {};
+    gpu_dither_variant(gpu, build_options, compact.entry_count, max_minecraft_y, bleeding_params, bleeding_count);
+    if (ret == CL_SUCCESS)
+        kernel = gpu_acquire_variant_kernel(gpu, 2, build_options, gpu->gather_error ? "error_gather" : "error_bleed", &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+
+    unsigned char arg_index = 0;
+    //set kernel arguments
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &input_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &output_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &error_buf_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &palette_lab_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &palette_entry_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &palette_liquid_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(const unsigned int), (void *) &seed);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &coord_mem_obj);
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &height_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
@@ -663,7 +1547,7 @@ int gpu_internal_dither_error_bleed(gpu_t *gpu, float *input, unsigned char *out
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(const unsigned char), (void *) &palette_indexes);
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(const unsigned int), (void *) &compact.entry_count);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
@@ -692,20 +1576,40 @@ int gpu_internal_dither_error_bleed(gpu_t *gpu, float *input, unsigned char *out
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
-
-    //set progress kernel params
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(progress_kernel, 0, sizeof(const unsigned int), (void *) &width);
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(const unsigned int), (void *) &err_rows);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    //left NULL for the plain distance
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &metric_palette_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &metric_lut_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(progress_kernel, 1, sizeof(const unsigned int), (void *) &height);
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(const unsigned char), (void *) &gpu->metric);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &diagnostics_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    //the band arguments are set for each band
+    unsigned char band_arg = arg_index;
+
 
     //let all the fill operations complete first
     if (ret == CL_SUCCESS){
@@ -716,51 +1620,109 @@ int gpu_internal_dither_error_bleed(gpu_t *gpu, float *input, unsigned char *out
     }
 
 
+    //everything the next diagonals depend on, for the checkpoints
+    char use_checkpoints = gpu->checkpoint_key != 0 && gpu->checkpoint_interval > 0;
+    gpu_checkpoint checkpoint = {GPU_CHECKPOINT_VERSION, width, height, err_rows, band_rows, 0, 0, 0};
+    gpu_checkpoint_section checkpoint_sections[] = {
+            {NULL, output, band_rows < height ? (size_t)height * row_output : 0},
+            {output_mem_obj, NULL, output_rows * row_output},
+            {error_buf_mem_obj, NULL, err_buf_size * sizeof(int)},
+            {height_mem_obj, NULL, width * sizeof(int)},
+            {diagnostics_mem_obj, NULL, DIAG_SIZE * sizeof(unsigned int)}
+    };
+    if (ret == CL_SUCCESS && gpu->checkpoint_key != 0 && gpu->resume)
+        gpu_checkpoint_load(gpu, &checkpoint, checkpoint_sections, ARRAY_SIZE(checkpoint_sections), &ret);
+
     //request the gpu process
+    gpu_progress progress;
+    gpu_progress_start(&progress, (size_t)width * height);
     if (ret == CL_SUCCESS){
-        unsigned int totalOffset = 0;
-        for (unsigned int diagonal = 0; diagonal < index_holder.diagonal_count; diagonal++){
-            unsigned int diaLen = index_holder.diagonals[diagonal];
-            for (size_t local_workgroup_size = 0, offset = 0; offset < diaLen  && ret == CL_SUCCESS; offset += local_workgroup_size){
-                local_workgroup_size = MIN(diaLen - offset, gpu->max_parallelism);
-                size_t curr_offset = totalOffset + offset;
-                ret = clEnqueueNDRangeKernel(gpu->commandQueue, kernel, 1, &curr_offset, &local_workgroup_size, &local_workgroup_size,
-                                             0,  NULL,NULL);
+        size_t totalOffset = checkpoint.done;
+        //the host stops after these many diagonals, the spacing follows the measured speed
+        unsigned int ran = 0;
+        unsigned int next_checkpoint = GPU_CHECKPOINT_PROBE;
+        unsigned int last_ran = 0;
+        double last_time = gpu_now_seconds();
+        double last_store = last_time;
+        for (unsigned int band_first = checkpoint.band_start; band_first < height && ret == CL_SUCCESS; band_first += band_rows){
+            unsigned int band_end = MIN(band_first + band_rows, height);
+            //first row held by the buffers
+            unsigned int band_row = band_first - MIN(band_first, halo);
+            unsigned int diagonals = diagonal_count(width, band_end - band_first, min_required_pixels);
+
+            //upload the rows of the band with its halo, and the rows already dithered above it
+            ret = clEnqueueWriteBuffer(gpu->commandQueue, input_mem_obj, CL_FALSE, 0, (MIN(band_end + halo, height) - band_row) * row_input,
+                                       (unsigned char *)input + band_row * row_input, 0, NULL, NULL);
+            if (ret == CL_SUCCESS && band_row < band_first)
+                ret = clEnqueueWriteBuffer(gpu->commandQueue, output_mem_obj, CL_FALSE, 0, (band_first - band_row) * row_output,
+                                           output + band_row * row_output, 0, NULL, NULL);
+            if (ret == CL_SUCCESS)
+                ret = clSetKernelArg(kernel, band_arg, sizeof(const unsigned int), (void *) &band_first);
+            if (ret == CL_SUCCESS)
+                ret = clSetKernelArg(kernel, band_arg + 1, sizeof(const unsigned int), (void *) &band_row);
+
+            unsigned int first_diagonal = band_first == checkpoint.band_start ? (unsigned int)checkpoint.diagonal : 0;
+            for (unsigned int diagonal = first_diagonal; diagonal < diagonals && ret == CL_SUCCESS; diagonal++){
+                unsigned int diaLen = diagonal_length(diagonal, width, band_end - band_first, min_required_pixels);
+                for (size_t local_workgroup_size = 0, offset = 0; offset < diaLen  && ret == CL_SUCCESS; offset += local_workgroup_size){
+                    local_workgroup_size = MIN(diaLen - offset, gpu->max_parallelism);
+                    //the kernel gets its coordinates from the diagonal and the position along it
+                    size_t curr_offset[2] = {offset, diagonal};
+                    size_t curr_size[2] = {local_workgroup_size, 1};
+                    ret = clEnqueueNDRangeKernel(gpu->commandQueue, kernel, 2, curr_offset, curr_size, curr_size,
+                                                 0,  NULL,NULL);
 
+                }
+                //let all computations for the previous diagonal to complete then continue ( this is all non-blocking for the cpu)
+                if (ret == CL_SUCCESS){
+                    ret = clEnqueueBarrierWithWaitList(gpu->commandQueue, 0, NULL, NULL);
+                }
+                totalOffset += diaLen;
+                ran++;
+                if (ret == CL_SUCCESS)
+                    ret = gpu_progress_mark(gpu, &progress, totalOffset);
+
+                //the last diagonal of a band is never saved, its rows are read back just after
+                if (ret == CL_SUCCESS && use_checkpoints && ran >= next_checkpoint && diagonal + 1 < diagonals){
+                    ret = clFinish(gpu->commandQueue);
+                    double now = gpu_now_seconds();
+                    double speed = (ran - last_ran) / MAX(now - last_time, 1e-6);
+                    if (ret == CL_SUCCESS && now - last_store >= gpu->checkpoint_interval){
+                        checkpoint.band_start = band_first;
+                        checkpoint.diagonal = diagonal + 1;
+                        checkpoint.done = totalOffset;
+                        ret = gpu_checkpoint_store(gpu, &checkpoint, checkpoint_sections, ARRAY_SIZE(checkpoint_sections));
+                        last_store = gpu_now_seconds();
+                    }
+                    last_ran = ran;
+                    last_time = gpu_now_seconds();
+                    double ahead = MIN(speed * MAX(gpu->checkpoint_interval - (last_time - last_store), 0), (double)diagonals);
+                    next_checkpoint = ran + MAX((unsigned int)ahead, 1);
+                }
             }
-            //let all computations for the previous diagonal to complete then continue ( this is all non-blocking for the cpu)
-            if (ret == CL_SUCCESS){
-                ret = clEnqueueBarrierWithWaitList(gpu->commandQueue, 0, NULL, &event[0]);
-            }
-            totalOffset += diaLen;
-            if (ret == CL_SUCCESS && gpu->verbose){
-                size_t unit = 1;
-                size_t offset = totalOffset -1;
-                ret = clEnqueueNDRangeKernel(gpu->commandQueue, progress_kernel, 1, &offset, &unit, &unit,
-                                             0,  NULL, NULL);
-            }
+
+            gpu_progress_wait(gpu, &progress, "Dithering");
+
+            //read the rows of the band, the next band uploads them again as its halo
+            if (ret == CL_SUCCESS)
+                ret = clEnqueueReadBuffer(gpu->commandQueue, output_mem_obj, CL_TRUE, (band_first - band_row) * row_output,
+                                          (band_end - band_first) * row_output, output + band_first * row_output, 0, NULL, NULL);
         }
     }else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-
-    //read the outputs
     if (ret == CL_SUCCESS)
-        ret = clEnqueueReadBuffer(gpu->commandQueue, output_mem_obj, CL_TRUE, 0, output_size * sizeof(unsigned char),
-                                  output, 1, &event[0], &event[1]);
+        ret = gpu_report_diagnostics(gpu, diagnostics_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-    if (ret == CL_SUCCESS)
-        ret = clWaitForEvents(1, &event[1]);
-    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
-    }
+    //the dithering is complete, the stage cache takes over
+    if (ret == CL_SUCCESS && gpu->checkpoint_key != 0 && (use_checkpoints || gpu->resume))
+        cache_remove("checkpoint", gpu->checkpoint_key);
 
     //flush remaining tasks
     if (ret == CL_SUCCESS)
@@ -771,46 +1733,46 @@ int gpu_internal_dither_error_bleed(gpu_t *gpu, float *input, unsigned char *out
     }
 
     if (kernel != NULL)
-        clReleaseKernel(kernel);
+        gpu_release_kernel(gpu, kernel);
 
-    if (progress_kernel != NULL)
-        clReleaseKernel(progress_kernel);
 
     if (input_mem_obj != NULL)
-        clReleaseMemObject(input_mem_obj);
+        gpu_release_buffer(gpu, input_mem_obj);
     if (palette_mem_obj != NULL)
-        clReleaseMemObject(palette_mem_obj);
-    if (palette_id_mem_obj != NULL)
-        clReleaseMemObject(palette_id_mem_obj);
+        gpu_release_buffer(gpu, palette_mem_obj);
+    if (palette_lab_mem_obj != NULL)
+        gpu_release_buffer(gpu, palette_lab_mem_obj);
+    if (palette_entry_mem_obj != NULL)
+        gpu_release_buffer(gpu, palette_entry_mem_obj);
     if (palette_liquid_mem_obj != NULL)
-        clReleaseMemObject(palette_liquid_mem_obj);
-    if (noise_mem_obj != NULL)
-        clReleaseMemObject(noise_mem_obj);
+        gpu_release_buffer(gpu, palette_liquid_mem_obj);
     if (output_mem_obj != NULL)
-        clReleaseMemObject(output_mem_obj);
+        gpu_release_buffer(gpu, output_mem_obj);
     if (error_buf_mem_obj != NULL)
-        clReleaseMemObject(error_buf_mem_obj);
+        gpu_release_buffer(gpu, error_buf_mem_obj);
     if (height_mem_obj != NULL)
-        clReleaseMemObject(height_mem_obj);
-    if (coord_mem_obj != NULL)
-        clReleaseMemObject(coord_mem_obj);
+        gpu_release_buffer(gpu, height_mem_obj);
     if (bleeding_mem_obj != NULL)
-        clReleaseMemObject(bleeding_mem_obj);
-    if (index_holder.indexes != NULL)
-        t_free(index_holder.indexes);
-    if (index_holder.diagonals != NULL)
-        t_free(index_holder.diagonals);
+        gpu_release_buffer(gpu, bleeding_mem_obj);
+    if (metric_palette_mem_obj != NULL)
+        gpu_release_buffer(gpu, metric_palette_mem_obj);
+    if (metric_lut_mem_obj != NULL)
+        gpu_release_buffer(gpu, metric_lut_mem_obj);
+    if (diagnostics_mem_obj != NULL)
+        gpu_release_buffer(gpu, diagnostics_mem_obj);
+    t_free(compact.lab);
+    t_free(compact.entries);
     return ret;
 }
 
-int gpu_dither_none(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_none(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y) {
-    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, noise, width, height, palette_indexes, NULL,
+    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, seed, width, height, palette_indexes, NULL,
                                            0, 0, max_minecraft_y);
 }
 
-int gpu_dither_floyd_steinberg(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_floyd_steinberg(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y) {
     int bleeding_parameters[4][4] = {
@@ -819,11 +1781,11 @@ int gpu_dither_floyd_steinberg(gpu_t *gpu, float *input, unsigned char *output,
             {0, 1, 5, 16},
             {1, 1, 1, 16}
     };
-    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, noise, width, height, palette_indexes,
+    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, seed, width, height, palette_indexes,
                                            (int *) bleeding_parameters, 4, 2, max_minecraft_y);
 }
 
-int gpu_dither_JJND(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_JJND(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y) {
     int bleeding_parameters[12][4] = {
@@ -840,11 +1802,11 @@ int gpu_dither_JJND(gpu_t *gpu, float *input, unsigned char *output, float *pale
             {1, 2, 3, 48},
             {2, 2, 1, 48}
     };
-    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, noise, width, height, palette_indexes,
+    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, seed, width, height, palette_indexes,
                                            (int *) bleeding_parameters, 12, 3, max_minecraft_y);
 }
 
-int gpu_dither_Stucki(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_Stucki(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y) {
     int bleeding_parameters[12][4] = {
@@ -861,86 +1823,706 @@ int gpu_dither_Stucki(gpu_t *gpu, float *input, unsigned char *output, float *pa
             {1, 2, 2, 42},
             {2, 2, 1, 42}
     };
-    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, noise, width, height, palette_indexes,
+    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, seed, width, height, palette_indexes,
                                            (int *) bleeding_parameters, 12, 3, max_minecraft_y);
 }
 
-int gpu_dither_Atkinson(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
-                    unsigned int height, unsigned char palette_indexes,
-                    int max_minecraft_y) {
-    int bleeding_parameters[6][4] = {
-            {1, 0, 1, 8},
-            {2, 0, 1, 8},
-            {-1, 1, 1, 8},
-            {0, 1, 1, 8},
-            {1, 1, 1, 8},
-            {0, 2, 1, 8}
-    };
-    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, noise, width, height, palette_indexes,
-                                           (int *) bleeding_parameters, 6, 3, max_minecraft_y);
-}
+int gpu_dither_Atkinson(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
+                    unsigned int height, unsigned char palette_indexes,
+                    int max_minecraft_y) {
+    int bleeding_parameters[6][4] = {
+            {1, 0, 1, 8},
+            {2, 0, 1, 8},
+            {-1, 1, 1, 8},
+            {0, 1, 1, 8},
+            {1, 1, 1, 8},
+            {0, 2, 1, 8}
+    };
+    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, seed, width, height, palette_indexes,
+                                           (int *) bleeding_parameters, 6, 3, max_minecraft_y);
+}
+
+int gpu_dither_Burkes(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
+                    unsigned int height, unsigned char palette_indexes,
+                    int max_minecraft_y) {
+    int bleeding_parameters[7][4] = {
+            {1, 0, 8, 32},
+            {2, 0, 4, 32},
+            {-2, 1, 2, 32},
+            {-1, 1, 4, 32},
+            {0, 1, 8, 32},
+            {1, 1, 4, 32},
+            {2, 1, 2, 32}
+    };
+    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, seed, width, height, palette_indexes,
+                                           (int *) bleeding_parameters, 7, 3, max_minecraft_y);
+}
+
+int gpu_dither_Sierra(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
+                    unsigned int height, unsigned char palette_indexes,
+                    int max_minecraft_y) {
+    int bleeding_parameters[10][4] = {
+            {1, 0, 5, 32},
+            {2, 0, 3, 32},
+            {-2, 1, 2, 32},
+            {-1, 1, 4, 32},
+            {0, 1, 5, 32},
+            {1, 1, 4, 32},
+            {2, 1, 2, 32},
+            {-1, 2, 2, 32},
+            {0, 2, 3, 32},
+            {1, 2, 2, 32}
+    };
+    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, seed, width, height, palette_indexes,
+                                           (int *) bleeding_parameters, 10, 3, max_minecraft_y);
+}
+
+int gpu_dither_Sierra2(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
+                    unsigned int height, unsigned char palette_indexes,
+                    int max_minecraft_y) {
+    int bleeding_parameters[7][4] = {
+            {1, 0, 4, 16},
+            {2, 0, 3, 16},
+            {-2, 1, 1, 16},
+            {-1, 1, 2, 16},
+            {0, 1, 3, 16},
+            {1, 1, 2, 16},
+            {2, 1, 1, 16}
+    };
+    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, seed, width, height, palette_indexes,
+                                           (int *) bleeding_parameters, 7, 3, max_minecraft_y);
+}
+
+int gpu_dither_SierraL(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
+                    unsigned int height, unsigned char palette_indexes,
+                    int max_minecraft_y) {
+    int bleeding_parameters[3][4] = {
+            {1, 0, 2, 4},
+            {-1, 1, 1, 4},
+            {0, 1, 1, 4}
+    };
+    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, seed, width, height, palette_indexes,
+                                           (int *) bleeding_parameters, 3, 2, max_minecraft_y);
+}
+
+// threshold maps
+
+#define BAYER_SIZE 8
+#define BLUE_NOISE_SIZE 64
+#define BLUE_NOISE_SIGMA 1.5f
+
+static float blue_noise_map[BLUE_NOISE_SIZE * BLUE_NOISE_SIZE];
+static pthread_once_t blue_noise_once = PTHREAD_ONCE_INIT;
+
+//recursive Bayer matrix, thresholds centered in (0,1)
+static void generate_bayer_map(float *map) {
+    for (unsigned int y = 0; y < BAYER_SIZE; y++)
+        for (unsigned int x = 0; x < BAYER_SIZE; x++) {
+            //interleave the bits of x ^ y and y, the lowest bits of the coordinates are the highest of the rank
+            unsigned int rank = 0;
+            for (unsigned int bit = 1; bit < BAYER_SIZE; bit <<= 1)
+                rank = (rank << 2) | ((((x & bit) != 0) ^ ((y & bit) != 0)) << 1) | ((y & bit) != 0);
+            map[y * BAYER_SIZE + x] = (rank + 0.5f) / (BAYER_SIZE * BAYER_SIZE);
+        }
+}
+
+//void and cluster ( Ulichney ), the energy of each cell is the sum of a toroidal gaussian around every set cell
+static void blue_noise_update(float *energy, const float *gaussian, unsigned int cell, float sign) {
+    unsigned int cx = cell % BLUE_NOISE_SIZE, cy = cell / BLUE_NOISE_SIZE;
+    for (unsigned int y = 0; y < BLUE_NOISE_SIZE; y++) {
+        unsigned int dy = (y + BLUE_NOISE_SIZE - cy) % BLUE_NOISE_SIZE;
+        for (unsigned int x = 0; x < BLUE_NOISE_SIZE; x++) {
+            unsigned int dx = (x + BLUE_NOISE_SIZE - cx) % BLUE_NOISE_SIZE;
+            energy[y * BLUE_NOISE_SIZE + x] += sign * gaussian[dy * BLUE_NOISE_SIZE + dx];
+        }
+    }
+}
+
+//tightest cluster ( highest energy set cell ) or largest void ( lowest energy free cell )
+static unsigned int blue_noise_find(const float *energy, const unsigned char *pattern, unsigned char set) {
+    unsigned int best = 0;
+    float best_energy = set ? -1.f : INFINITY;
+    for (unsigned int i = 0; i < BLUE_NOISE_SIZE * BLUE_NOISE_SIZE; i++) {
+        if (pattern[i] != set)
+            continue;
+        if (set ? energy[i] > best_energy : energy[i] < best_energy) {
+            best_energy = energy[i];
+            best = i;
+        }
+    }
+    return best;
+}
+
+static void generate_blue_noise_map() {
+    const unsigned int cells = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+    float *gaussian = t_calloc(cells, sizeof(float));
+    float *energy = t_calloc(cells, sizeof(float));
+    unsigned char *initial = t_calloc(cells, sizeof(unsigned char));
+    unsigned char *pattern = t_calloc(cells, sizeof(unsigned char));
+
+    for (unsigned int y = 0; y < BLUE_NOISE_SIZE; y++)
+        for (unsigned int x = 0; x < BLUE_NOISE_SIZE; x++) {
+            float dx = (float) MIN(x, BLUE_NOISE_SIZE - x);
+            float dy = (float) MIN(y, BLUE_NOISE_SIZE - y);
+            gaussian[y * BLUE_NOISE_SIZE + x] = expf(-(dx * dx + dy * dy) / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+        }
+
+    //fixed seed, the map has to be the same on every run ( the dither seed only shifts it )
+    unsigned int state = 0x2545F491u;
+    unsigned int ones = cells / 10;
+    for (unsigned int placed = 0; placed < ones;) {
+        state = state * 1664525u + 1013904223u;
+        unsigned int cell = (state >> 8) % cells;
+        if (!initial[cell]) {
+            initial[cell] = 1;
+            blue_noise_update(energy, gaussian, cell, 1.f);
+            placed++;
+        }
+    }
+
+    //move the tightest cluster into the largest void until it stops moving
+    while (1) {
+        unsigned int cluster = blue_noise_find(energy, initial, 1);
+        initial[cluster] = 0;
+        blue_noise_update(energy, gaussian, cluster, -1.f);
+        unsigned int hole = blue_noise_find(energy, initial, 0);
+        initial[hole] = 1;
+        blue_noise_update(energy, gaussian, hole, 1.f);
+        if (hole == cluster)
+            break;
+    }
+
+    //rank the initial points by removing the tightest clusters
+    memcpy(pattern, initial, cells);
+    float *initial_energy = t_calloc(cells, sizeof(float));
+    memcpy(initial_energy, energy, cells * sizeof(float));
+    for (unsigned int rank = ones; rank > 0; rank--) {
+        unsigned int cluster = blue_noise_find(energy, pattern, 1);
+        pattern[cluster] = 0;
+        blue_noise_update(energy, gaussian, cluster, -1.f);
+        blue_noise_map[cluster] = rank - 1;
+    }
+
+    //then fill the largest voids, once half is set this is the same as removing the clusters of the free cells
+    memcpy(pattern, initial, cells);
+    memcpy(energy, initial_energy, cells * sizeof(float));
+    for (unsigned int rank = ones; rank < cells; rank++) {
+        unsigned int hole = blue_noise_find(energy, pattern, 0);
+        pattern[hole] = 1;
+        blue_noise_update(energy, gaussian, hole, 1.f);
+        blue_noise_map[hole] = rank;
+    }
+
+    for (unsigned int i = 0; i < cells; i++)
+        blue_noise_map[i] = (blue_noise_map[i] + 0.5f) / cells;
+
+    t_free(gaussian);
+    t_free(energy);
+    t_free(initial_energy);
+    t_free(initial);
+    t_free(pattern);
+}
+
+//average distance between each usable color and its nearest neighbour, the thresholds move a pixel by about one step
+static float threshold_spread(float *palette, unsigned char *valid_palette_ids, unsigned char palette_indexes, int max_minecraft_y) {
+    double total = 0;
+    unsigned int count = 0;
+    for (unsigned int p = 1; p < palette_indexes; p++) {
+        if (!valid_palette_ids[p])
+            continue;
+        for (unsigned int s = 0; s < MULTIPLIER_SIZE; s++) {
+            if (max_minecraft_y == 0 && s != 1)
+                continue;
+            float *color = &palette[(p * MULTIPLIER_SIZE + s) * RGBA_SIZE];
+            float nearest = INFINITY;
+            for (unsigned int q = 1; q < palette_indexes; q++) {
+                if (!valid_palette_ids[q])
+                    continue;
+                for (unsigned int t = 0; t < MULTIPLIER_SIZE; t++) {
+                    if ((max_minecraft_y == 0 && t != 1) || (p == q && s == t))
+                        continue;
+                    float *other = &palette[(q * MULTIPLIER_SIZE + t) * RGBA_SIZE];
+                    float distance = sqrtf((color[0] - other[0]) * (color[0] - other[0]) +
+                                           (color[1] - other[1]) * (color[1] - other[1]) +
+                                           (color[2] - other[2]) * (color[2] - other[2]));
+                    nearest = MIN(nearest, distance);
+                }
+            }
+            if (isfinite(nearest)) {
+                total += nearest;
+                count++;
+            }
+        }
+    }
+    return count > 0 ? (float) (total / count) : 0.f;
+}
+
+//every pixel is quantized on its own against a threshold map, then one pass per column repairs the staircase
+int gpu_internal_dither_threshold(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed,
+                                  unsigned int width, unsigned int height, unsigned char palette_indexes, float *threshold_map, unsigned int map_size,
+                                  int max_minecraft_y) {
+    size_t palette_size = palette_indexes * MULTIPLIER_SIZE * RGBA_SIZE;
+    size_t map_items = (size_t)map_size * map_size;
+    size_t column_workgroup_size = width;
+    float spread = threshold_spread(palette, valid_palette_ids, palette_indexes, max_minecraft_y);
+
+    //images too big for the device run in bands of rows, the buffers also hold the row above
+    //the band for the fix-up, the heights carry over
+    size_t row_input = (size_t)width * RGBA_SIZE * GPU_LAB_SIZE(gpu);
+    size_t row_output = (size_t)width * 2;
+    size_t fixed_size = palette_size * sizeof(float) + map_items * sizeof(float) + width * sizeof(int) +
+                        DIAG_SIZE * sizeof(unsigned int);
+    unsigned int band_rows = gpu_plan_tile(gpu, height, row_input + row_output, row_input, fixed_size);
+    if (band_rows < height)
+        band_rows = band_rows > 1 ? band_rows - 1 : 0;
+    if (band_rows == 0) {
+        fprintf(stderr, "The image is too wide for the memory of the device\n");
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+    unsigned int buffer_rows = MIN(band_rows + 1, height);
+    if (band_rows < height && gpu->verbose) {
+        fprintf(stdout, "Dithering in bands of %u rows\n", band_rows);
+        fflush(stdout);
+    }
+
+    compact_palette compact = gpu_compact_palette(palette, valid_palette_ids, liquid_palette_ids, palette_indexes, max_minecraft_y);
+
+    cl_int ret = CL_SUCCESS;
+    cl_mem input_mem_obj = NULL;
+    cl_mem output_mem_obj = NULL;
+    cl_mem palette_mem_obj = NULL;
+    cl_mem palette_lab_mem_obj = NULL;
+    cl_mem palette_entry_mem_obj = NULL;
+    cl_mem palette_liquid_mem_obj = NULL;
+    cl_mem map_mem_obj = NULL;
+    cl_mem height_mem_obj = NULL;
+    cl_mem metric_palette_mem_obj = NULL;
+    cl_mem metric_lut_mem_obj = NULL;
+    cl_mem diagnostics_mem_obj = NULL;
+    cl_kernel dither_kernel = NULL;
+    cl_kernel fixup_kernel = NULL;
+
+    //create memory objects
+
+    input_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY,
+                                   buffer_rows * row_input, NULL, &ret);
+    if (ret == CL_SUCCESS)
+        output_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,
+                                        buffer_rows * row_output, NULL, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        palette_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                         palette_size * sizeof(float), palette, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        palette_lab_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                             MAX(compact.entry_count, 1) * RGB_SIZE * sizeof(float), compact.lab, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        palette_entry_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                               MAX(compact.entry_count, 1) * sizeof(unsigned int), compact.entries, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        palette_liquid_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                            palette_indexes * sizeof(unsigned char), liquid_palette_ids, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        map_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                     map_items * sizeof(float), threshold_map, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        height_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,
+                                       width * sizeof(int), NULL, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+
+    if (ret == CL_SUCCESS)
+        ret = gpu_prepare_metric(gpu, palette_mem_obj, palette_indexes * MULTIPLIER_SIZE, &metric_palette_mem_obj, &metric_lut_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+
+    int i_pattern = 0;
+    if (ret == CL_SUCCESS)
+        ret = clEnqueueFillBuffer(gpu->commandQueue, height_mem_obj, &i_pattern, sizeof (int), 0, width * sizeof(int), 0, NULL, NULL);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        diagnostics_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE, DIAG_SIZE * sizeof(unsigned int), NULL, &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clEnqueueFillBuffer(gpu->commandQueue, diagnostics_mem_obj, &i_pattern, sizeof (int), 0, DIAG_SIZE * sizeof(unsigned int), 0, NULL, NULL);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+
+    //create kernels, specialized for this palette and height limit
+    char build_options[1024] = {};
+    gpu_dither_variant(gpu, build_options, compact.entry_count, max_minecraft_y, NULL, 0);
+    if (ret == CL_SUCCESS)
+        dither_kernel = gpu_acquire_variant_kernel(gpu, 2, build_options, "threshold_dither", &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        fixup_kernel = gpu_acquire_variant_kernel(gpu, 2, build_options, "threshold_fixup", &ret);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+
+    unsigned char arg_index = 0;
+    //set kernel arguments
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(cl_mem), (void *) &input_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(cl_mem), (void *) &output_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(cl_mem), (void *) &palette_lab_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(cl_mem), (void *) &palette_entry_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(cl_mem), (void *) &palette_liquid_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(cl_mem), (void *) &map_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(const unsigned int), (void *) &map_size);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(const unsigned int), (void *) &seed);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(const unsigned int), (void *) &width);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(const unsigned int), (void *) &height);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(const unsigned int), (void *) &compact.entry_count);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(const int), (void *) &max_minecraft_y);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(const float), (void *) &spread);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(cl_mem), (void *) &metric_palette_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(cl_mem), (void *) &metric_lut_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(dither_kernel, arg_index++, sizeof(const unsigned char), (void *) &gpu->metric);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    //the band arguments are set for each band
+    unsigned char dither_band_arg = arg_index;
+
+    arg_index = 0;
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(cl_mem), (void *) &input_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(cl_mem), (void *) &output_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(cl_mem), (void *) &palette_lab_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(cl_mem), (void *) &palette_entry_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(cl_mem), (void *) &palette_liquid_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(cl_mem), (void *) &map_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(const unsigned int), (void *) &map_size);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(const unsigned int), (void *) &seed);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(cl_mem), (void *) &height_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(const unsigned int), (void *) &width);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(const unsigned int), (void *) &height);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(const unsigned int), (void *) &compact.entry_count);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(const int), (void *) &max_minecraft_y);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(const float), (void *) &spread);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(cl_mem), (void *) &metric_palette_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(cl_mem), (void *) &metric_lut_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(const unsigned char), (void *) &gpu->metric);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(fixup_kernel, arg_index++, sizeof(cl_mem), (void *) &diagnostics_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    unsigned char fixup_band_arg = arg_index;
+
+    //let all the fill operations complete first
+    if (ret == CL_SUCCESS)
+        ret = clEnqueueBarrierWithWaitList(gpu->commandQueue, 0, NULL, NULL);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
 
-int gpu_dither_Burkes(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
-                    unsigned int height, unsigned char palette_indexes,
-                    int max_minecraft_y) {
-    int bleeding_parameters[7][4] = {
-            {1, 0, 8, 32},
-            {2, 0, 4, 32},
-            {-2, 1, 2, 32},
-            {-1, 1, 4, 32},
-            {0, 1, 8, 32},
-            {1, 1, 4, 32},
-            {2, 1, 2, 32}
-    };
-    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, noise, width, height, palette_indexes,
-                                           (int *) bleeding_parameters, 7, 3, max_minecraft_y);
-}
+    //request the gpu process, the queue is in order so the fix-up sees every pixel of the band
+    if (ret == CL_SUCCESS){
+        for (unsigned int band_first = 0; band_first < height && ret == CL_SUCCESS; band_first += band_rows){
+            unsigned int band_end = MIN(band_first + band_rows, height);
+            //first row held by the buffers
+            unsigned int band_row = band_first - MIN(band_first, 1);
+            size_t pixel_workgroup_size = (size_t)width * (band_end - band_first);
+
+            //upload the rows of the band, and the row already fixed above it
+            ret = clEnqueueWriteBuffer(gpu->commandQueue, input_mem_obj, CL_FALSE, 0, (band_end - band_row) * row_input,
+                                       (unsigned char *)input + band_row * row_input, 0, NULL, NULL);
+            if (ret == CL_SUCCESS && band_row < band_first)
+                ret = clEnqueueWriteBuffer(gpu->commandQueue, output_mem_obj, CL_FALSE, 0, (band_first - band_row) * row_output,
+                                           output + band_row * row_output, 0, NULL, NULL);
+            if (ret == CL_SUCCESS)
+                ret = clSetKernelArg(dither_kernel, dither_band_arg, sizeof(const unsigned int), (void *) &band_first);
+            if (ret == CL_SUCCESS)
+                ret = clSetKernelArg(dither_kernel, dither_band_arg + 1, sizeof(const unsigned int), (void *) &band_end);
+            if (ret == CL_SUCCESS)
+                ret = clSetKernelArg(dither_kernel, dither_band_arg + 2, sizeof(const unsigned int), (void *) &band_row);
+            if (ret == CL_SUCCESS)
+                ret = clSetKernelArg(fixup_kernel, fixup_band_arg, sizeof(const unsigned int), (void *) &band_first);
+            if (ret == CL_SUCCESS)
+                ret = clSetKernelArg(fixup_kernel, fixup_band_arg + 1, sizeof(const unsigned int), (void *) &band_end);
+            if (ret == CL_SUCCESS)
+                ret = clSetKernelArg(fixup_kernel, fixup_band_arg + 2, sizeof(const unsigned int), (void *) &band_row);
+
+            if (ret == CL_SUCCESS)
+                ret = clEnqueueNDRangeKernel(gpu->commandQueue, dither_kernel, 1, NULL, &pixel_workgroup_size, NULL, 0, NULL, NULL);
+            if (ret == CL_SUCCESS)
+                ret = clEnqueueNDRangeKernel(gpu->commandQueue, fixup_kernel, 1, NULL, &column_workgroup_size, NULL, 0, NULL, NULL);
+
+            //read the rows of the band, the next band uploads the last one again
+            if (ret == CL_SUCCESS)
+                ret = clEnqueueReadBuffer(gpu->commandQueue, output_mem_obj, CL_TRUE, (band_first - band_row) * row_output,
+                                          (band_end - band_first) * row_output, output + band_first * row_output, 0, NULL, NULL);
+        }
+    }else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+    if (ret == CL_SUCCESS)
+        ret = gpu_report_diagnostics(gpu, diagnostics_mem_obj);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
 
-int gpu_dither_Sierra(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
-                    unsigned int height, unsigned char palette_indexes,
-                    int max_minecraft_y) {
-    int bleeding_parameters[10][4] = {
-            {1, 0, 5, 32},
-            {2, 0, 3, 32},
-            {-2, 1, 2, 32},
-            {-1, 1, 4, 32},
-            {0, 1, 5, 32},
-            {1, 1, 4, 32},
-            {2, 1, 2, 32},
-            {-1, 2, 2, 32},
-            {0, 2, 3, 32},
-            {1, 2, 2, 32}
-    };
-    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, noise, width, height, palette_indexes,
-                                           (int *) bleeding_parameters, 10, 3, max_minecraft_y);
+    //flush remaining tasks
+    if (ret == CL_SUCCESS)
+        ret = clFlush(gpu->commandQueue);
+    else{
+        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
+        exit(ret);
+    }
+
+    if (dither_kernel != NULL)
+        gpu_release_kernel(gpu, dither_kernel);
+    if (fixup_kernel != NULL)
+        gpu_release_kernel(gpu, fixup_kernel);
+
+    if (input_mem_obj != NULL)
+        gpu_release_buffer(gpu, input_mem_obj);
+    if (output_mem_obj != NULL)
+        gpu_release_buffer(gpu, output_mem_obj);
+    if (palette_mem_obj != NULL)
+        gpu_release_buffer(gpu, palette_mem_obj);
+    if (palette_lab_mem_obj != NULL)
+        gpu_release_buffer(gpu, palette_lab_mem_obj);
+    if (palette_entry_mem_obj != NULL)
+        gpu_release_buffer(gpu, palette_entry_mem_obj);
+    if (palette_liquid_mem_obj != NULL)
+        gpu_release_buffer(gpu, palette_liquid_mem_obj);
+    if (map_mem_obj != NULL)
+        gpu_release_buffer(gpu, map_mem_obj);
+    if (height_mem_obj != NULL)
+        gpu_release_buffer(gpu, height_mem_obj);
+    if (metric_palette_mem_obj != NULL)
+        gpu_release_buffer(gpu, metric_palette_mem_obj);
+    if (metric_lut_mem_obj != NULL)
+        gpu_release_buffer(gpu, metric_lut_mem_obj);
+    if (diagnostics_mem_obj != NULL)
+        gpu_release_buffer(gpu, diagnostics_mem_obj);
+    t_free(compact.lab);
+    t_free(compact.entries);
+    return ret;
 }
 
-int gpu_dither_Sierra2(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_bayer(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y) {
-    int bleeding_parameters[7][4] = {
-            {1, 0, 4, 16},
-            {2, 0, 3, 16},
-            {-2, 1, 1, 16},
-            {-1, 1, 2, 16},
-            {0, 1, 3, 16},
-            {1, 1, 2, 16},
-            {2, 1, 1, 16}
-    };
-    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, noise, width, height, palette_indexes,
-                                           (int *) bleeding_parameters, 7, 3, max_minecraft_y);
+    float map[BAYER_SIZE * BAYER_SIZE];
+    generate_bayer_map(map);
+    return gpu_internal_dither_threshold(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, seed, width, height, palette_indexes,
+                                         map, BAYER_SIZE, max_minecraft_y);
 }
 
-int gpu_dither_SierraL(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_blue_noise(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y) {
-    int bleeding_parameters[3][4] = {
-            {1, 0, 2, 4},
-            {-1, 1, 1, 4},
-            {0, 1, 1, 4}
-    };
-    return gpu_internal_dither_error_bleed(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, noise, width, height, palette_indexes,
-                                           (int *) bleeding_parameters, 3, 2, max_minecraft_y);
+    //generated once, shared by every device
+    pthread_once(&blue_noise_once, generate_blue_noise_map);
+    return gpu_internal_dither_threshold(gpu, input, output, palette, valid_palette_ids, liquid_palette_ids, seed, width, height, palette_indexes,
+                                         blue_noise_map, BLUE_NOISE_SIZE, max_minecraft_y);
 }
 
 // de-conversion
@@ -960,17 +2542,17 @@ int gpu_palette_to_rgb(gpu_t *gpu, unsigned char *input, int *palette, unsigned
 
     //create memory objects
 
-    input_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY,
+    input_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY,
                                    buffer_size * sizeof(unsigned char), NULL, &ret);
     if (ret == CL_SUCCESS)
-        palette_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY,
+        palette_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY,
                                          palette_size * sizeof(int), NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        output_mem_obj = clCreateBuffer(gpu->context, CL_MEM_WRITE_ONLY,
+        output_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_WRITE_ONLY,
                                         output_size * sizeof(unsigned char), NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
@@ -995,7 +2577,7 @@ int gpu_palette_to_rgb(gpu_t *gpu, unsigned char *input, int *palette, unsigned
 
     //create kernel
     if (ret == CL_SUCCESS)
-        kernel = clCreateKernel(gpu->programs[1].program, "palette_to_rgb", &ret);
+        kernel = gpu_acquire_kernel(gpu, 1, "palette_to_rgb", &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
@@ -1070,24 +2652,93 @@ int gpu_palette_to_rgb(gpu_t *gpu, unsigned char *input, int *palette, unsigned
     }
 
     if (kernel != NULL)
-        clReleaseKernel(kernel);
+        gpu_release_kernel(gpu, kernel);
 
     if (input_mem_obj != NULL)
-        clReleaseMemObject(input_mem_obj);
+        gpu_release_buffer(gpu, input_mem_obj);
     if (palette_mem_obj != NULL)
-        clReleaseMemObject(palette_mem_obj);
+        gpu_release_buffer(gpu, palette_mem_obj);
     if (output_mem_obj != NULL)
-        clReleaseMemObject(output_mem_obj);
+        gpu_release_buffer(gpu, output_mem_obj);
 
     return ret;
 }
 
 // mapart
 
+//layers of a local histogram ( UCHAR_MAX + 1 bins each ) that fit the local memory the kernel leaves free,
+//the histogram argument is set to a single bin first so the query only sees the kernel's own usage
+unsigned int gpu_local_histogram_layers(gpu_t *gpu, cl_kernel kernel, unsigned char histogram_arg, unsigned int layers, cl_int *ret) {
+    cl_ulong kernel_local = 0;
+    *ret = clSetKernelArg(kernel, histogram_arg, sizeof(unsigned int), NULL);
+    if (*ret == CL_SUCCESS)
+        *ret = clGetKernelWorkGroupInfo(kernel, gpu->deviceId, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(cl_ulong), &kernel_local, NULL);
+    cl_ulong available = gpu->local_memory > kernel_local ? gpu->local_memory - kernel_local : 0;
+    return (unsigned int)MIN((cl_ulong)layers, available / ((UCHAR_MAX + 1) * sizeof(unsigned int)));
+}
+
+//adds the partial histograms of group_count work groups to the 64bit counters layer_id_count[bin_offset..bin_offset+bins-1],
+//a work group for each bin folds the groups in a tree
+cl_int gpu_enqueue_reduce_stats(gpu_t *gpu, cl_kernel reduce_kernel, cl_mem partial_mem_obj, cl_mem layer_id_mem_obj,
+                                unsigned int group_count, unsigned int bins, unsigned int bin_offset) {
+    size_t max_local_size = gpu->max_parallelism;
+    cl_int ret = clGetKernelWorkGroupInfo(reduce_kernel, gpu->deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max_local_size, NULL);
+    max_local_size = MIN(max_local_size, gpu->max_parallelism);
+    //the tree needs a power of two, no larger than the groups to sum
+    size_t reduce_local_size = 1;
+    while (reduce_local_size * 2 <= max_local_size && reduce_local_size < group_count)
+        reduce_local_size *= 2;
+    size_t reduce_global_size = (size_t)bins * reduce_local_size;
+
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(reduce_kernel, 0, sizeof(cl_mem), (void *) &partial_mem_obj);
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(reduce_kernel, 1, sizeof(cl_mem), (void *) &layer_id_mem_obj);
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(reduce_kernel, 2, reduce_local_size * sizeof(cl_ulong), NULL);
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(reduce_kernel, 3, sizeof(const unsigned int), (void *) &group_count);
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(reduce_kernel, 4, sizeof(const unsigned int), (void *) &bins);
+    if (ret == CL_SUCCESS)
+        ret = clSetKernelArg(reduce_kernel, 5, sizeof(const unsigned int), (void *) &bin_offset);
+
+    if (ret == CL_SUCCESS)
+        ret = clEnqueueNDRangeKernel(gpu->commandQueue, reduce_kernel, 1, NULL, &reduce_global_size, &reduce_local_size, 0,  NULL,
+                                     NULL);
+
+    //the partial histograms are reused right after
+    if (ret == CL_SUCCESS)
+        ret = clEnqueueBarrierWithWaitList(gpu->commandQueue,0, NULL, NULL);
+    return ret;
+}
+
 int gpu_palette_to_height(gpu_t *gpu, unsigned char *input, unsigned char *is_liquid, unsigned int *output,unsigned char palette_size, unsigned int width,
-                          unsigned int height, int max_minecraft_y, unsigned int* computed_max_minecraft_y) {
-    size_t buffer_size = (size_t)width * height * 2;
-    size_t output_size = (size_t)width * (height + 1) * 3;
+                          unsigned int height, int max_minecraft_y, unsigned int* computed_max_minecraft_y, uint64_t **layer_id_count) {
+    size_t column_input = (size_t)height * 2;
+    size_t pixel_output = 3 * sizeof(unsigned int);
+    size_t column_output = (height + 1) * pixel_output;
+    //a column climbs at most one block per row, plus the support and the liquid depth
+    unsigned int layer_limit = height + 12;
+    size_t layer_bins = (size_t)layer_limit * (UCHAR_MAX + 1);
+
+    //the columns are independent, images too big for the device run in stripes of columns sharing the stats.
+    //each work group of a stripe saves a histogram of the lowest layers, at most local_memory bytes,
+    //the higher layers go to an overflow histogram of the stripe and all of them add up in the 64bit counters
+    size_t column_partial = gpu->local_memory / MAX(gpu->max_parallelism, 1) + 1;
+    unsigned int stripe_width = gpu_plan_tile(gpu, width, column_input + column_output + column_partial + (gpu->column_height ? 0 : sizeof(gpu_column_state)),
+                                              column_output, gpu->local_memory * 3 + palette_size + 2 * sizeof(unsigned int) +
+                                              layer_bins * (sizeof(unsigned int) + sizeof(cl_ulong)));
+    //the histograms of a stripe count in 32 bits
+    stripe_width = MIN(stripe_width, UINT_MAX / (height + 1));
+    if (stripe_width == 0) {
+        fprintf(stderr, "The image is too tall for the memory of the device\n");
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+    if (stripe_width < width && gpu->verbose) {
+        fprintf(stdout, "Computing the heights in stripes of %u columns\n", stripe_width);
+        fflush(stdout);
+    }
 
     cl_event event[5];
 
@@ -1096,20 +2747,22 @@ int gpu_palette_to_height(gpu_t *gpu, unsigned char *input, unsigned char *is_li
     cl_mem liquid_mem_obj = NULL;
     cl_mem output_mem_obj = NULL;
     cl_mem error_mem_obj = NULL;
-    cl_mem height_mem_obj = NULL;
-    cl_mem index_mem_obj = NULL;
-    cl_mem padding_mem_obj = NULL;
-    cl_mem flat_mem_obj = NULL;
+    cl_mem state_mem_obj = NULL;
     cl_mem max_mem_obj = NULL;
+    cl_mem partial_mem_obj = NULL;
+    cl_mem overflow_mem_obj = NULL;
+    cl_mem stats_mem_obj = NULL;
     cl_kernel kernel = NULL;
-    cl_kernel progress_kernel = NULL;
+    cl_kernel reduce_kernel = NULL;
+
+    *layer_id_count = NULL;
 
     //create memory objects
 
-    input_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                   buffer_size * sizeof(unsigned char), input, &ret);
+    input_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY,
+                                   stripe_width * column_input, NULL, &ret);
     if (ret == CL_SUCCESS){
-        liquid_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        liquid_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
                                        palette_size * sizeof(unsigned char), is_liquid, &ret);
     }else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
@@ -1117,113 +2770,110 @@ int gpu_palette_to_height(gpu_t *gpu, unsigned char *input, unsigned char *is_li
     }
 
     if (ret == CL_SUCCESS)
-        output_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,
-                                        output_size * sizeof(unsigned int), NULL, &ret);
+        output_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,
+                                        stripe_width * column_output, NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        error_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,
+        error_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,
                                                  sizeof(unsigned int), NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
-    if (ret == CL_SUCCESS)
-        height_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,width * sizeof(int), NULL, &ret);
+    //the per row launches keep the column states on the device between rows
+    if (ret == CL_SUCCESS && !gpu->column_height)
+        state_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,stripe_width * sizeof(gpu_column_state), NULL, &ret);
 
-    else{
+    if (ret != CL_SUCCESS){
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        index_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,width * sizeof(unsigned int), NULL, &ret);
-
+        max_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,sizeof(unsigned int), NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
-    if (ret == CL_SUCCESS)
-        padding_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,width * sizeof(int), NULL, &ret);
 
-    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
-    }
-    if (ret == CL_SUCCESS)
-        flat_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,width * sizeof(unsigned int), NULL, &ret);
+    //request clean the error indicator
+    unsigned int pattern = 0;
 
+    if (ret == CL_SUCCESS)
+        ret = clEnqueueFillBuffer(gpu->commandQueue, error_mem_obj, &pattern, sizeof(unsigned int), 0, sizeof(unsigned int), 0, NULL, NULL);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        max_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,sizeof(unsigned int), NULL, &ret);
+        ret = clEnqueueFillBuffer(gpu->commandQueue, max_mem_obj, &pattern, sizeof(unsigned int), 0, sizeof(unsigned int), 0,  NULL, NULL);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-    //request clean the error indicator
-    unsigned int pattern = 0;
-    int pattern2 = 1;
-
-    if (ret == CL_SUCCESS)
-        ret = clEnqueueFillBuffer(gpu->commandQueue, error_mem_obj, &pattern, sizeof(unsigned int), 0, sizeof(unsigned int), 0, NULL, NULL);
-    else{
+    //let all the fill operations complete first
+    if (ret == CL_SUCCESS){
+        ret = clEnqueueBarrierWithWaitList(gpu->commandQueue, 0, NULL, NULL);
+    }    else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
+
+
+    //create kernel
     if (ret == CL_SUCCESS)
-        ret = clEnqueueFillBuffer(gpu->commandQueue, max_mem_obj, &pattern, sizeof(unsigned int), 0, sizeof(unsigned int), 0,  NULL, NULL);
+        kernel = gpu_acquire_kernel(gpu, 1, gpu->column_height ? "palette_to_height_columns" : "palette_to_height", &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clEnqueueFillBuffer(gpu->commandQueue, height_mem_obj, &pattern, sizeof (int), 0, width * sizeof(int), 0, NULL, NULL);
+        reduce_kernel = gpu_acquire_kernel(gpu, 1, "reduce_stats", &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
-    if (ret == CL_SUCCESS)
-            ret = clEnqueueFillBuffer(gpu->commandQueue, index_mem_obj, &pattern, sizeof (int), 0, width * sizeof(int), 0, NULL, NULL);
+
+    //the work groups count the rows they finalize in histograms of the lowest layers: local ones for the column walk,
+    //their slices of partial_counts for the per row launches ( the local memory does not outlive a launch ).
+    //a partial histogram for each work group of a stripe and the overflow are summed into the 64bit counters after the stripe
+    unsigned int stats_layers = 0;
+    if (ret == CL_SUCCESS && gpu->column_height)
+        stats_layers = gpu_local_histogram_layers(gpu, kernel, 10, layer_limit, &ret);
+    else if (ret == CL_SUCCESS)
+        stats_layers = MIN(layer_limit, gpu->local_memory / ((UCHAR_MAX + 1) * sizeof(unsigned int)));
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
+    unsigned int stats_bins = stats_layers * (UCHAR_MAX + 1);
+    unsigned int overflow_bins = (layer_limit - stats_layers) * (UCHAR_MAX + 1);
+    unsigned int stats_groups = (stripe_width + gpu->max_parallelism - 1) / gpu->max_parallelism;
+    size_t partial_size = (size_t)stats_groups * stats_bins * sizeof(unsigned int);
+    cl_ulong stats_pattern = 0;
     if (ret == CL_SUCCESS)
-            ret = clEnqueueFillBuffer(gpu->commandQueue, padding_mem_obj, &pattern2, sizeof (int), 0, width * sizeof(int), 0, NULL, NULL);
+        partial_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE, MAX(partial_size, sizeof(unsigned int)), NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-            ret = clEnqueueFillBuffer(gpu->commandQueue, flat_mem_obj, &pattern, sizeof (int), 0, width * sizeof(int), 0, NULL, NULL);
+        overflow_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE, MAX(overflow_bins, 1) * sizeof(unsigned int), NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
-
-    //let all the fill operations complete first
-    if (ret == CL_SUCCESS){
-        ret = clEnqueueBarrierWithWaitList(gpu->commandQueue, 0, NULL, NULL);
-    }    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
-    }
-
-
-    //create kernel
     if (ret == CL_SUCCESS)
-        kernel = clCreateKernel(gpu->programs[1].program, "palette_to_height", &ret);
+        stats_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE, layer_bins * sizeof(cl_ulong), NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        progress_kernel = clCreateKernel(gpu->programs[3].program, "progress", &ret);
+        ret = clEnqueueFillBuffer(gpu->commandQueue, stats_mem_obj, &stats_pattern, sizeof(cl_ulong), 0, layer_bins * sizeof(cl_ulong), 0,  NULL, NULL);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
@@ -1255,100 +2905,156 @@ int gpu_palette_to_height(gpu_t *gpu, unsigned char *input, unsigned char *is_li
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
-    if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &height_mem_obj);
-    else{
+    if (ret == CL_SUCCESS && state_mem_obj != NULL)
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &state_mem_obj);
+
+    if (ret != CL_SUCCESS){
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
+    //the width is set for each stripe
+    unsigned char width_arg = arg_index++;
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &index_mem_obj);
+        ret = clSetKernelArg(kernel, width_arg, sizeof(const unsigned int), (void *) &stripe_width);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &padding_mem_obj);
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(const unsigned int), (void *) &height);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &flat_mem_obj);
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(const int), (void *) &max_minecraft_y);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(const unsigned int), (void *) &width);
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &max_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(const unsigned int), (void *) &height);
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &partial_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(const int), (void *) &max_minecraft_y);
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &overflow_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
-    if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &max_mem_obj);
-    else{
+    //a local argument can not be empty, keep a single bin when no layer fits
+    if (ret == CL_SUCCESS && gpu->column_height)
+        ret = clSetKernelArg(kernel, arg_index++, MAX(stats_bins, 1) * sizeof(unsigned int), NULL);
+    if (ret != CL_SUCCESS){
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
-
-
-    //set progress kernel params
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(progress_kernel, 0, sizeof(const unsigned int), (void *) &width);
+        ret = clSetKernelArg(kernel, arg_index++, sizeof(const unsigned int), (void *) &stats_layers);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
+    //the slice of the first work group, moved along the launches of each row
+    unsigned char slice_arg = arg_index++;
+    unsigned int stats_slice = 0;
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(progress_kernel, 1, sizeof(const unsigned int), (void *) &height);
+        ret = clSetKernelArg(kernel, slice_arg, sizeof(const unsigned int), (void *) &stats_slice);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
+
+
     //request the gpu process
+    gpu_progress progress;
+    gpu_progress_start(&progress, (size_t)width * height);
     if (ret == CL_SUCCESS){
-        size_t unit = 1;
-        unsigned int totalOffset = 0;
-        for (unsigned int row = 0; row < height; row++){
-            for (size_t local_workgroup_size = 0, offset = 0; offset < width  && ret == CL_SUCCESS; offset += local_workgroup_size){
-                local_workgroup_size = MIN(width - offset, gpu->max_parallelism);
-                size_t curr_offset = totalOffset + offset;
-                ret = clEnqueueNDRangeKernel(gpu->commandQueue, kernel, 1, &curr_offset, &local_workgroup_size, &local_workgroup_size,
+        size_t totalOffset = 0;
+        for (unsigned int first_column = 0; first_column < width && ret == CL_SUCCESS; first_column += stripe_width){
+            unsigned int columns = MIN(stripe_width, width - first_column);
+
+            //upload the columns of the stripe
+            size_t input_origin[3] = {first_column * 2, 0, 0};
+            size_t input_region[3] = {columns * 2, height, 1};
+            size_t buffer_origin[3] = {0, 0, 0};
+            ret = clEnqueueWriteBufferRect(gpu->commandQueue, input_mem_obj, CL_FALSE, buffer_origin, input_origin, input_region,
+                                           columns * 2, 0, (size_t)width * 2, 0, input, 0, NULL, NULL);
+            if (ret == CL_SUCCESS)
+                ret = clSetKernelArg(kernel, width_arg, sizeof(const unsigned int), (void *) &columns);
+            //the per row launches add to their slices, the column walk overwrites them
+            if (ret == CL_SUCCESS && !gpu->column_height && partial_size > 0)
+                ret = clEnqueueFillBuffer(gpu->commandQueue, partial_mem_obj, &pattern, sizeof(unsigned int), 0, partial_size, 0, NULL, NULL);
+            if (ret == CL_SUCCESS && overflow_bins > 0)
+                ret = clEnqueueFillBuffer(gpu->commandQueue, overflow_mem_obj, &pattern, sizeof(unsigned int), 0, overflow_bins * sizeof(unsigned int), 0, NULL, NULL);
+            if (ret == CL_SUCCESS)
+                ret = clEnqueueBarrierWithWaitList(gpu->commandQueue, 0, NULL, NULL);
+
+            if (ret == CL_SUCCESS && gpu->column_height){
+                //a single launch, every work item walks its column from top to bottom
+                size_t local_workgroup_size = MIN(columns, gpu->max_parallelism);
+                size_t global_workgroup_size = ((columns + local_workgroup_size - 1) / local_workgroup_size) * local_workgroup_size;
+                ret = clEnqueueNDRangeKernel(gpu->commandQueue, kernel, 1, NULL, &global_workgroup_size, &local_workgroup_size,
                                              0,  NULL,NULL);
-
-            }
-            //let all computations for the previous row to complete then continue ( this is all non-blocking for the cpu)
-            if (ret == CL_SUCCESS){
-                ret = clEnqueueBarrierWithWaitList(gpu->commandQueue, 0, NULL, &event[0]);
+                if (ret == CL_SUCCESS){
+                    ret = clEnqueueBarrierWithWaitList(gpu->commandQueue, 0, NULL, &event[0]);
+                }
+            }else if (ret == CL_SUCCESS){
+                size_t stripeOffset = 0;
+                for (unsigned int row = 0; row < height; row++){
+                    for (size_t local_workgroup_size = 0, offset = 0; offset < columns  && ret == CL_SUCCESS; offset += local_workgroup_size){
+                        local_workgroup_size = MIN(columns - offset, gpu->max_parallelism);
+                        size_t curr_offset = stripeOffset + offset;
+                        //each launch is a single work group
+                        stats_slice = offset / gpu->max_parallelism;
+                        ret = clSetKernelArg(kernel, slice_arg, sizeof(const unsigned int), (void *) &stats_slice);
+                        if (ret != CL_SUCCESS)
+                            break;
+                        ret = clEnqueueNDRangeKernel(gpu->commandQueue, kernel, 1, &curr_offset, &local_workgroup_size, &local_workgroup_size,
+                                                     0,  NULL,NULL);
+
+                    }
+                    //let all computations for the previous row to complete then continue ( this is all non-blocking for the cpu)
+                    if (ret == CL_SUCCESS){
+                        ret = clEnqueueBarrierWithWaitList(gpu->commandQueue, 0, NULL, &event[0]);
+                    }
+
+                    stripeOffset += columns;
+                    totalOffset += columns;
+                    if (ret == CL_SUCCESS)
+                        ret = gpu_progress_mark(gpu, &progress, totalOffset);
+                }
             }
 
-            totalOffset += width;
-            if (ret == CL_SUCCESS && gpu->verbose){
-                size_t offset = totalOffset -1;
-                ret = clEnqueueNDRangeKernel(gpu->commandQueue, progress_kernel, 1, &offset, &unit, &unit,
-                                             0,  NULL, NULL);
-            }
+            gpu_progress_wait(gpu, &progress, "Heights");
+
+            if (ret == CL_SUCCESS && stats_bins > 0)
+                ret = gpu_enqueue_reduce_stats(gpu, reduce_kernel, partial_mem_obj, stats_mem_obj,
+                                               (columns + gpu->max_parallelism - 1) / gpu->max_parallelism, stats_bins, 0);
+            if (ret == CL_SUCCESS && overflow_bins > 0)
+                ret = gpu_enqueue_reduce_stats(gpu, reduce_kernel, overflow_mem_obj, stats_mem_obj, 1, overflow_bins, stats_bins);
+
+            //read the columns of the stripe back in place
+            size_t output_origin[3] = {first_column * pixel_output, 0, 0};
+            size_t output_region[3] = {columns * pixel_output, height + 1, 1};
+            if (ret == CL_SUCCESS)
+                ret = clEnqueueReadBufferRect(gpu->commandQueue, output_mem_obj, CL_TRUE, buffer_origin, output_origin, output_region,
+                                              output_region[0], 0, width * pixel_output, 0, output, 0, NULL, NULL);
         }
     }    else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-
     //read the outputs
     unsigned int error_status = 0;
     if (ret == CL_SUCCESS)
@@ -1373,16 +3079,20 @@ int gpu_palette_to_height(gpu_t *gpu, unsigned char *input, unsigned char *is_li
     }
 
     if (ret == CL_SUCCESS)
-        ret = clEnqueueReadBuffer(gpu->commandQueue, output_mem_obj, CL_TRUE, 0, output_size * sizeof(unsigned int),
-                                  output, 1, &event[2], &event[3]);
+        ret = clWaitForEvents(1, &event[2]);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-    if (ret == CL_SUCCESS)
-        ret = clWaitForEvents(1, &event[3]);
-    else{
+    //read the block stats counted while the columns were finalized
+    if (ret == CL_SUCCESS){
+        size_t layer_id_size = (size_t)(MIN(*computed_max_minecraft_y, layer_limit - 1) + 1) * (UCHAR_MAX + 1);
+        *layer_id_count = t_calloc(layer_id_size, sizeof(uint64_t));
+        ret = clEnqueueReadBuffer(gpu->commandQueue, stats_mem_obj, CL_TRUE, 0, layer_id_size * sizeof(cl_ulong),
+                                  *layer_id_count, 0, NULL, NULL);
+    }
+    if (ret != CL_SUCCESS){
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
@@ -1396,176 +3106,169 @@ int gpu_palette_to_height(gpu_t *gpu, unsigned char *input, unsigned char *is_li
     }
 
     if (kernel != NULL)
-        clReleaseKernel(kernel);
-    if (progress_kernel != NULL)
-        clReleaseKernel(progress_kernel);
+        gpu_release_kernel(gpu, kernel);
+    if (reduce_kernel != NULL)
+        gpu_release_kernel(gpu, reduce_kernel);
 
     if (input_mem_obj != NULL)
-        clReleaseMemObject(input_mem_obj);
+        gpu_release_buffer(gpu, input_mem_obj);
     if (liquid_mem_obj != NULL)
-        clReleaseMemObject(liquid_mem_obj);
+        gpu_release_buffer(gpu, liquid_mem_obj);
     if (output_mem_obj != NULL)
-        clReleaseMemObject(output_mem_obj);
-    if (height_mem_obj != NULL)
-        clReleaseMemObject(height_mem_obj);
-    if (index_mem_obj != NULL)
-        clReleaseMemObject(index_mem_obj);
-    if (padding_mem_obj != NULL)
-        clReleaseMemObject(padding_mem_obj);
+        gpu_release_buffer(gpu, output_mem_obj);
+    if (state_mem_obj != NULL)
+        gpu_release_buffer(gpu, state_mem_obj);
     if (error_mem_obj != NULL)
-        clReleaseMemObject(error_mem_obj);
+        gpu_release_buffer(gpu, error_mem_obj);
     if (max_mem_obj != NULL)
-        clReleaseMemObject(max_mem_obj);
+        gpu_release_buffer(gpu, max_mem_obj);
+    if (partial_mem_obj != NULL)
+        gpu_release_buffer(gpu, partial_mem_obj);
+    if (overflow_mem_obj != NULL)
+        gpu_release_buffer(gpu, overflow_mem_obj);
+    if (stats_mem_obj != NULL)
+        gpu_release_buffer(gpu, stats_mem_obj);
 
     return ret;
 }
 
 
-int gpu_height_to_stats(gpu_t *gpu, unsigned int *input, unsigned int *layer_count, unsigned int *layer_id_count, unsigned int *id_count, unsigned int width, unsigned int height, unsigned int layers) {
+int gpu_height_to_stats(gpu_t *gpu, unsigned int *input, uint64_t *layer_count, uint64_t *layer_id_count, uint64_t *id_count, unsigned int width, unsigned int height, unsigned int layers) {
     size_t buffer_size = (size_t)width * height * 3;
-    size_t layer_size = layers + 1;
-    size_t layer_id_size = (layers + 1) * (UCHAR_MAX + 1);
-    size_t id_size = (UCHAR_MAX + 1);
+    cl_ulong pixel_count = (cl_ulong)width * height;
+    unsigned int layer_size = layers + 1;
+    size_t layer_id_size = (size_t)layer_size * (UCHAR_MAX + 1);
     cl_int ret = 0;
     cl_mem input_mem_obj = NULL;
-    cl_mem layer_mem_obj = NULL;
+    cl_mem partial_mem_obj = NULL;
     cl_mem layer_id_mem_obj = NULL;
-    cl_mem id_mem_obj = NULL;
     cl_kernel kernel = NULL;
+    cl_kernel reduce_kernel = NULL;
 
-    cl_event event[4];
-
-    //create memory objects
-
-    input_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
-                                   buffer_size * sizeof(unsigned int), input, &ret);
-
+    //create kernels
+    kernel = gpu_acquire_kernel(gpu, 1, "height_to_stats", &ret);
     if (ret == CL_SUCCESS)
-        layer_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,
-                                        layer_size * sizeof(unsigned int), NULL, &ret);
+        reduce_kernel = gpu_acquire_kernel(gpu, 1, "reduce_stats", &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
+    //split the layers in bands that fit the local memory left by the kernel
+    unsigned int band_layers = 0;
     if (ret == CL_SUCCESS)
-        layer_id_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,
-                                        layer_id_size * sizeof(unsigned int), NULL, &ret);
+        band_layers = gpu_local_histogram_layers(gpu, kernel, 2, layer_size, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
+    if (band_layers == 0)
+        band_layers = 1;
+    unsigned int band_bins = band_layers * (UCHAR_MAX + 1);
 
+    //the local histogram limits the size of the work groups
+    size_t local_item_size = gpu->max_parallelism;
     if (ret == CL_SUCCESS)
-        id_mem_obj = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,
-                                        id_size * sizeof(unsigned int), NULL, &ret);
+        ret = clGetKernelWorkGroupInfo(kernel, gpu->deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &local_item_size, NULL);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
+    local_item_size = MIN(local_item_size, gpu->max_parallelism);
+
+    //a few groups per compute unit, each one strides over the whole image
+    unsigned int group_count = MAX(gpu->compute_units, 1) * 4;
+    group_count = MIN(group_count, (pixel_count + local_item_size - 1) / local_item_size);
+    if (group_count == 0)
+        group_count = 1;
+    size_t global_item_size = group_count * local_item_size;
+
+    //create memory objects
 
-    unsigned int zero = 0;
-    if (ret == CL_SUCCESS)
-        ret = clEnqueueFillBuffer(gpu->commandQueue, layer_mem_obj, &zero, sizeof (unsigned int), 0, layer_size * sizeof(unsigned int), 0, NULL, NULL);
-    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
-    }
     if (ret == CL_SUCCESS)
-        ret = clEnqueueFillBuffer(gpu->commandQueue, layer_id_mem_obj, &zero, sizeof (unsigned int), 0, layer_id_size * sizeof(unsigned int), 0, NULL, NULL);
+        input_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+                                       buffer_size * sizeof(unsigned int), input, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
+
     if (ret == CL_SUCCESS)
-        ret = clEnqueueFillBuffer(gpu->commandQueue, id_mem_obj, &zero, sizeof (unsigned int), 0, id_size * sizeof(unsigned int), 0, NULL, NULL);
+        partial_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,
+                                         (size_t)group_count * band_bins * sizeof(unsigned int), NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
-    //create kernel
     if (ret == CL_SUCCESS)
-        kernel = clCreateKernel(gpu->programs[1].program, "height_to_stats", &ret);
+        layer_id_mem_obj = gpu_acquire_buffer(gpu, CL_MEM_READ_WRITE,
+                                        layer_id_size * sizeof(cl_ulong), NULL, &ret);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
     //set kernel arguments
-    unsigned char arg_index = 0;
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &input_mem_obj);
+        ret = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &input_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &layer_mem_obj);
+        ret = clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &partial_mem_obj);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &layer_id_mem_obj);
+        ret = clSetKernelArg(kernel, 2, band_bins * sizeof(unsigned int), NULL);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
     if (ret == CL_SUCCESS)
-        ret = clSetKernelArg(kernel, arg_index++, sizeof(cl_mem), (void *) &id_mem_obj);
+        ret = clSetKernelArg(kernel, 3, sizeof(const cl_ulong), (void *) &pixel_count);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
-
-    size_t global_item_size = width * height;
-    size_t local_item_size = MIN(height, gpu->max_parallelism);
-    while (global_item_size % local_item_size != 0) { local_item_size--; }
-
+    //the bands are added to the counters
+    cl_ulong pattern = 0;
     if (ret == CL_SUCCESS)
-        ret = clEnqueueBarrierWithWaitList(gpu->commandQueue,0, NULL, NULL);
+        ret = clEnqueueFillBuffer(gpu->commandQueue, layer_id_mem_obj, &pattern, sizeof(cl_ulong), 0, layer_id_size * sizeof(cl_ulong), 0, NULL, NULL);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
     }
 
     //request the gpu process
-    if (ret == CL_SUCCESS)
-        ret = clEnqueueNDRangeKernel(gpu->commandQueue, kernel, 1, NULL, &global_item_size, &local_item_size, 0,  NULL,
-                                     &event[0]);
-    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
-    }
+    for (unsigned int band_start = 0; band_start < layer_size && ret == CL_SUCCESS; band_start += band_layers){
+        unsigned int curr_layers = MIN(band_layers, layer_size - band_start);
+        unsigned int curr_bins = curr_layers * (UCHAR_MAX + 1);
+        unsigned int band_offset = band_start * (UCHAR_MAX + 1);
 
-    //read the outputs
-    if (ret == CL_SUCCESS)
-        ret = clEnqueueReadBuffer(gpu->commandQueue, layer_mem_obj, CL_TRUE, 0, layer_size * sizeof(unsigned int), layer_count, 0,
-                                  NULL, &event[1]);
-    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
-    }
+        ret = clSetKernelArg(kernel, 4, sizeof(const unsigned int), (void *) &band_start);
+        if (ret == CL_SUCCESS)
+            ret = clSetKernelArg(kernel, 5, sizeof(const unsigned int), (void *) &curr_layers);
 
-    if (ret == CL_SUCCESS)
-        ret = clEnqueueReadBuffer(gpu->commandQueue, layer_id_mem_obj, CL_TRUE, 0, layer_id_size * sizeof(unsigned int), layer_id_count, 0,
-    NULL, &event[2]);
-    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
-    }
-    if (ret == CL_SUCCESS)
-        ret = clEnqueueReadBuffer(gpu->commandQueue, id_mem_obj, CL_TRUE, 0, id_size * sizeof(unsigned int), id_count, 0,
-                                  NULL, &event[3]);
-    else{
-        fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
-        exit(ret);
+        if (ret == CL_SUCCESS)
+            ret = clEnqueueNDRangeKernel(gpu->commandQueue, kernel, 1, NULL, &global_item_size, &local_item_size, 0,  NULL,
+                                         NULL);
+
+        //the partial histograms are reused by the next band so reduce them right away
+        if (ret == CL_SUCCESS)
+            ret = clEnqueueBarrierWithWaitList(gpu->commandQueue,0, NULL, NULL);
+
+        if (ret == CL_SUCCESS)
+            ret = gpu_enqueue_reduce_stats(gpu, reduce_kernel, partial_mem_obj, layer_id_mem_obj, group_count, curr_bins, band_offset);
     }
 
-    //wait for outputs
+    //read the outputs
     if (ret == CL_SUCCESS)
-        ret = clWaitForEvents(4, event);
+        ret = clEnqueueReadBuffer(gpu->commandQueue, layer_id_mem_obj, CL_TRUE, 0, layer_id_size * sizeof(cl_ulong), layer_id_count, 0,
+                                  NULL, NULL);
     else{
         fprintf(stderr,"Fail at %s:%d code:%d\n",__FILE_NAME__,__LINE__, ret);
         exit(ret);
@@ -1579,63 +3282,54 @@ int gpu_height_to_stats(gpu_t *gpu, unsigned int *input, unsigned int *layer_cou
         exit(ret);
     }
 
+    //the per layer and per id counts are sums of the layer_id matrix
+    for (unsigned int id = 0; id < UCHAR_MAX + 1; id++)
+        id_count[id] = 0;
+    for (unsigned int layer = 0; layer < layer_size; layer++){
+        layer_count[layer] = 0;
+        for (unsigned int id = 0; id < UCHAR_MAX + 1; id++){
+            uint64_t count = layer_id_count[((size_t)layer * (UCHAR_MAX + 1)) + id];
+            layer_count[layer] += count;
+            id_count[id] += count;
+        }
+    }
+
     if (kernel != NULL)
-        clReleaseKernel(kernel);
+        gpu_release_kernel(gpu, kernel);
+    if (reduce_kernel != NULL)
+        gpu_release_kernel(gpu, reduce_kernel);
 
     if (input_mem_obj != NULL)
-        clReleaseMemObject(input_mem_obj);
-    if (layer_mem_obj != NULL)
-        clReleaseMemObject(layer_mem_obj);
+        gpu_release_buffer(gpu, input_mem_obj);
+    if (partial_mem_obj != NULL)
+        gpu_release_buffer(gpu, partial_mem_obj);
     if (layer_id_mem_obj != NULL)
-        clReleaseMemObject(layer_id_mem_obj);
-    if (id_mem_obj != NULL)
-        clReleaseMemObject(id_mem_obj);
+        gpu_release_buffer(gpu, layer_id_mem_obj);
 
     return ret;
 }
 // diagonals
 
-index_holder generate_indexes(unsigned int width, unsigned int height, unsigned int steepness){
-    index_holder holder = {};
-    holder.indexes = t_calloc(width*height*2, sizeof (unsigned int));
-
-    if (steepness == 0){
-        holder.diagonal_count = height;
-        holder.diagonals = t_calloc(height, sizeof (unsigned int));
-
-        for (unsigned int y = 0; y < height; y++)
-            holder.diagonals[y] = width;
-
-        for (unsigned int i = 0; i < width * height; i++){
-            holder.indexes[i*2] = i % width;
-            holder.indexes[(i*2) + 1] = i / width;
-        }
-
-    }else{
-        unsigned int i = 0;
-        holder.diagonals = t_calloc(width + height * steepness, sizeof (unsigned int));
-
-        for (unsigned int x = 0; x < width; x++){
-            unsigned int count = 0;
-            for (long c_x = x, c_y = 0; c_x >= 0 && c_y < height; c_y += 1, c_x -= steepness, i++, count++){
-                holder.indexes[i*2] = c_x;
-                holder.indexes[(i*2) + 1] = c_y;
-            }
-            holder.diagonals[holder.diagonal_count++] = count;
-        }
-
-        for (unsigned int y = 1; y < height; y++) {
-            for (long offset = steepness - 1; offset >= 0; offset--) {
-                unsigned int count = 0;
-                for (long c_x = width - 1 - offset, c_y = y; c_x >= 0 && c_y < height; c_y += 1, c_x -= steepness, i++, count++){
-                    holder.indexes[i*2] = c_x;
-                    holder.indexes[(i*2) + 1] = c_y;
-                }
-                holder.diagonals[holder.diagonal_count++] = count;
-            }
-        }
-    }
-
-    return holder;
+//the diagonals are walked by the kernel ( diagonal_coords in dither.cl ), only their lengths are needed here
+unsigned int diagonal_count(unsigned int width, unsigned int height, unsigned int steepness){
+    if (steepness == 0)
+        return height;
+    return width + (height - 1) * steepness;
+}
 
+unsigned int diagonal_length(unsigned int diagonal, unsigned int width, unsigned int height, unsigned int steepness){
+    if (steepness == 0)
+        return width;
+
+    long start_x = diagonal;
+    long start_y = 0;
+    if (diagonal >= width){
+        unsigned int row_diagonal = diagonal - width;
+        start_x = (long)width - steepness + (row_diagonal % steepness);
+        start_y = 1 + (row_diagonal / steepness);
+    }
+    //the walk stops at the left edge or at the bottom
+    if (start_x < 0)
+        return 0;
+    return MIN(start_x / steepness + 1, height - start_y);
 }
\ No newline at end of file
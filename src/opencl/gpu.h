@@ -15,16 +15,39 @@ typedef struct {
     cl_program program;
 } gpu_program;
 
+/// <summary>
+/// Kernels and buffers kept alive between calls, shared by all the queues of a context
+/// </summary>
+typedef struct gpu_object_cache gpu_object_cache;
+
 typedef struct {
     cl_platform_id platformId;
     cl_device_id deviceId;
     size_t max_parallelism;
+    cl_ulong local_memory;
+    cl_uint compute_units;
+    cl_ulong max_alloc;
+    cl_ulong memory_budget; // global memory one queue may use, the large stages are tiled to fit it
     cl_context context;
     cl_command_queue commandQueue;
     gpu_program programs[12];
+    gpu_object_cache *cache;
     char verbose;
+    char gather_error;
+    char column_height;
+    char metric;
+    char half_lab;
+    float progress_interval; // seconds between the progress lines of verbose mode
+    float checkpoint_interval; // seconds between the checkpoints of the error diffusion, 0 to disable
+    char resume;
+    cl_ulong checkpoint_key; // cache key of the dithering, 0 when the cache is disabled
 } gpu_t;
 
+/// <summary>
+/// Size of one channel of the OK-L*ab image on the host and on the device ( cl_half with -H, float otherwise )
+/// </summary>
+#define GPU_LAB_SIZE(gpu) ((gpu)->half_lab ? sizeof(cl_half) : sizeof(float))
+
 #endif
 
 #ifndef GPU_CODE_NO_RECURSION
@@ -33,50 +56,70 @@ typedef struct {
 
 int gpu_init(main_options *config, gpu_t *);
 
+int gpu_init_all(main_options *config, gpu_t **gpu_holders, unsigned int *gpu_count);
+
 void gpu_clear(gpu_t *);
 
+int gpu_create_queue(gpu_t *gpu_holder, gpu_t *queue_holder);
+
+void gpu_release_queue(gpu_t *queue_holder);
+
+uint64_t gpu_hash_program_source(uint64_t key, unsigned int program);
+
 int gpu_rgba_to_composite(gpu_t *gpu, int *input, int *output, unsigned int width, unsigned int height);
 
 int gpu_rgb_to_ok(gpu_t *gpu, int *input, float *output, unsigned int width, unsigned int height);
 
-typedef int (*dither_function)(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_rgb_to_ok_image(gpu_t *gpu, int *input, void *output, unsigned int width, unsigned int height);
+
+int gpu_downsample(gpu_t *gpu, void *input, void *output, unsigned int width, unsigned int height, unsigned int factor);
+
+typedef int (*dither_function)(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                                unsigned int height, unsigned char palette_indexes,
                                int max_minecraft_y);
 
 
-int gpu_dither_none(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_none(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
+                    unsigned int height, unsigned char palette_indexes,
+                    int max_minecraft_y);
+
+int gpu_dither_floyd_steinberg(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
+                    unsigned int height, unsigned char palette_indexes,
+                    int max_minecraft_y);
+
+int gpu_dither_JJND(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y);
 
-int gpu_dither_floyd_steinberg(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_Stucki(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y);
 
-int gpu_dither_JJND(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_Atkinson(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y);
 
-int gpu_dither_Stucki(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_Burkes(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y);
 
-int gpu_dither_Atkinson(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_Sierra(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y);
 
-int gpu_dither_Burkes(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_Sierra2(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y);
 
-int gpu_dither_Sierra(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_SierraL(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y);
 
-int gpu_dither_Sierra2(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_bayer(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y);
 
-int gpu_dither_SierraL(gpu_t *gpu, float *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, float *noise, unsigned int width,
+int gpu_dither_blue_noise(gpu_t *gpu, void *input, unsigned char *output, float *palette, unsigned char *valid_palette_ids, unsigned char *liquid_palette_ids, unsigned int seed, unsigned int width,
                     unsigned int height, unsigned char palette_indexes,
                     int max_minecraft_y);
 
@@ -88,9 +131,9 @@ int gpu_palette_to_rgb(gpu_t *gpu, unsigned char *input, int *palette, unsigned
 // mapart methods
 
 int gpu_palette_to_height(gpu_t *gpu, unsigned char *input, unsigned char *is_liquid, unsigned int *output,unsigned char palette_size, unsigned int width,
-                          unsigned int height, int max_minecraft_y, unsigned int* computed_max_minecraft_y);
+                          unsigned int height, int max_minecraft_y, unsigned int* computed_max_minecraft_y, uint64_t **layer_id_count);
 
-int gpu_height_to_stats(gpu_t *gpu, unsigned int *input, unsigned int *layer_count, unsigned int *layer_id_count, unsigned int *id_count, unsigned int width, unsigned int height, unsigned int layers);
+int gpu_height_to_stats(gpu_t *gpu, unsigned int *input, uint64_t *layer_count, uint64_t *layer_id_count, uint64_t *id_count, unsigned int width, unsigned int height, unsigned int layers);
 
 #else
 #undef GPU_CODE_NO_RECURSION